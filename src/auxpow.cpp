@@ -120,7 +120,8 @@ void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigne
     }
 
     pblock->vtx[0].vin[0].scriptSig = MakeCoinbaseWithAux(pblock->nBits, nExtraNonce, vchAux);
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->vtx[0].InvalidateHash();
+    pblock->hashMerkleRoot = pblock->UpdateMerkleCoinbase();
 }
 
 
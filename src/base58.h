@@ -16,48 +16,80 @@
 
 #include <string>
 #include <vector>
-#include "bignum.h"
 
 static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
+// Digit value of each character, -1 if it isn't one
+static const signed char mapBase58[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8,-1,-1,-1,-1,-1,-1,
+    -1, 9,10,11,12,13,14,15,16,-1,17,18,19,20,21,-1,
+    22,23,24,25,26,27,28,29,30,31,32,-1,-1,-1,-1,-1,
+    -1,33,34,35,36,37,38,39,40,41,42,43,-1,44,45,46,
+    47,48,49,50,51,52,53,54,55,56,57,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+// Anything an address or a key encodes to fits in this without the heap
+static const unsigned int BASE58_STACK_SIZE = 128;
+
 
 inline std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
-    CAutoBN_CTX pctx;
-    CBigNum bn58 = 58;
-    CBigNum bn0 = 0;
-
-    // Convert big endian data to little endian
-    // Extra zero at the end make sure bignum will interpret as a positive number
-    std::vector<unsigned char> vchTmp(pend-pbegin+1, 0);
-    reverse_copy(pbegin, pend, vchTmp.begin());
-
-    // Convert little endian data to bignum
-    CBigNum bn;
-    bn.setvch(vchTmp);
+    // Leading zeroes encoded as base58 zeros
+    int nZeros = 0;
+    while (pbegin != pend && *pbegin == 0)
+    {
+        pbegin++;
+        nZeros++;
+    }
 
-    // Convert bignum to std::string
-    std::string str;
     // Expected size increase from base58 conversion is approximately 137%
     // use 138% to be safe
-    str.reserve((pend - pbegin) * 138 / 100 + 1);
-    CBigNum dv;
-    CBigNum rem;
-    while (bn > bn0)
+    unsigned int nSize = (pend - pbegin) * 138 / 100 + 1;
+    unsigned char pchStack[BASE58_STACK_SIZE];
+    std::vector<unsigned char> vchHeap;
+    unsigned char* pb58 = pchStack;
+    if (nSize > sizeof(pchStack))
     {
-        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
-            throw bignum_error("EncodeBase58 : BN_div failed");
-        bn = dv;
-        unsigned int c = rem.getulong();
-        str += pszBase58[c];
+        vchHeap.resize(nSize);
+        pb58 = &vchHeap[0];
     }
+    memset(pb58, 0, nSize);
 
-    // Leading zeroes encoded as base58 zeros
-    for (const unsigned char* p = pbegin; p < pend && *p == 0; p++)
-        str += pszBase58[0];
+    // Big endian base256 to big endian base58, one input byte at a time:
+    // multiply what's there by 256 and add the byte in
+    unsigned int nLength = 0;
+    for (const unsigned char* p = pbegin; p != pend; p++)
+    {
+        unsigned int nCarry = *p;
+        unsigned int i = 0;
+        for (unsigned char* pdigit = pb58 + nSize - 1; (nCarry != 0 || i < nLength) && pdigit >= pb58; pdigit--, i++)
+        {
+            nCarry += 256 * (*pdigit);
+            *pdigit = nCarry % 58;
+            nCarry /= 58;
+        }
+        nLength = i;
+    }
 
-    // Convert little endian std::string to big endian
-    reverse(str.begin(), str.end());
+    const unsigned char* pdigit = pb58 + nSize - nLength;
+    while (pdigit != pb58 + nSize && *pdigit == 0)
+        pdigit++;
+    std::string str;
+    str.reserve(nZeros + (pb58 + nSize - pdigit));
+    str.assign(nZeros, pszBase58[0]);
+    while (pdigit != pb58 + nSize)
+        str += pszBase58[*pdigit++];
     return str;
 }
 
@@ -68,47 +100,59 @@ inline std::string EncodeBase58(const std::vector<unsigned char>& vch)
 
 inline bool DecodeBase58(const char* psz, std::vector<unsigned char>& vchRet)
 {
-    CAutoBN_CTX pctx;
     vchRet.clear();
-    CBigNum bn58 = 58;
-    CBigNum bn = 0;
-    CBigNum bnChar;
     while (isspace(*psz))
         psz++;
 
-    // Convert big endian string to bignum
-    for (const char* p = psz; *p; p++)
+    // Leading base58 zeros decode as zero bytes
+    int nZeros = 0;
+    while (*psz == pszBase58[0])
     {
-        const char* p1 = strchr(pszBase58, *p);
-        if (p1 == NULL)
-        {
-            while (isspace(*p))
-                p++;
-            if (*p != '\0')
-                return false;
-            break;
-        }
-        bnChar.setulong(p1 - pszBase58);
-        if (!BN_mul(&bn, &bn, &bn58, pctx))
-            throw bignum_error("DecodeBase58 : BN_mul failed");
-        bn += bnChar;
+        psz++;
+        nZeros++;
     }
 
-    // Get bignum as little endian data
-    std::vector<unsigned char> vchTmp = bn.getvch();
+    // log(58) / log(256), rounded up
+    unsigned int nSize = strlen(psz) * 733 / 1000 + 1;
+    unsigned char pchStack[BASE58_STACK_SIZE];
+    std::vector<unsigned char> vchHeap;
+    unsigned char* pb256 = pchStack;
+    if (nSize > sizeof(pchStack))
+    {
+        vchHeap.resize(nSize);
+        pb256 = &vchHeap[0];
+    }
+    memset(pb256, 0, nSize);
 
-    // Trim off sign byte if present
-    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
-        vchTmp.erase(vchTmp.end()-1);
+    // Big endian base58 to big endian base256, the same way round as encoding
+    unsigned int nLength = 0;
+    for (; *psz && !isspace(*psz); psz++)
+    {
+        int nCarry = mapBase58[(unsigned char)*psz];
+        if (nCarry == -1)
+            return false;
+        unsigned int i = 0;
+        for (unsigned char* pbyte = pb256 + nSize - 1; (nCarry != 0 || i < nLength) && pbyte >= pb256; pbyte--, i++)
+        {
+            nCarry += 58 * (*pbyte);
+            *pbyte = nCarry % 256;
+            nCarry /= 256;
+        }
+        nLength = i;
+    }
 
-    // Restore leading zeros
-    int nLeadingZeros = 0;
-    for (const char* p = psz; *p == pszBase58[0]; p++)
-        nLeadingZeros++;
-    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
+    // Only whitespace allowed after the digits
+    while (isspace(*psz))
+        psz++;
+    if (*psz != '\0')
+        return false;
 
-    // Convert little endian data to big endian
-    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    const unsigned char* pbyte = pb256 + nSize - nLength;
+    while (pbyte != pb256 + nSize && *pbyte == 0)
+        pbyte++;
+    vchRet.reserve(nZeros + (pb256 + nSize - pbyte));
+    vchRet.assign(nZeros, 0);
+    vchRet.insert(vchRet.end(), pbyte, (const unsigned char*)pb256 + nSize);
     return true;
 }
 
@@ -180,7 +224,6 @@ inline bool AddressToHash160(const char* psz, uint160& hash160Ret)
     if (vch.size() != sizeof(hash160Ret) + 1)
         return false;
     memcpy(&hash160Ret, &vch[1], sizeof(hash160Ret));
-    printf("uAddressVersion = %d  nVersion = %d \n",uAddressVersion,nVersion);
     return (nVersion <= uAddressVersion);
 }
 
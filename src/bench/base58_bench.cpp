@@ -0,0 +1,38 @@
+//
+// Addresses encoded and decoded per second
+//
+BENCHMARK(address_codec)
+{
+    vector<uint160> vHash;
+    vector<string> vAddress;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint160 hash160;
+        for (unsigned int j = 0; j < sizeof(hash160); j++)
+            UBEGIN(hash160)[j] = InsecureRand(256);
+        vHash.push_back(hash160);
+        vAddress.push_back(Hash160ToAddress(hash160));
+    }
+
+    const int nRounds = 20;
+    int nAddresses = nRounds * vHash.size();
+    int64 nStart = GetTimeMillis();
+    for (int n = 0; n < nRounds; n++)
+        BOOST_FOREACH(const uint160& hash160, vHash)
+            Hash160ToAddress(hash160);
+    int64 nEncode = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    for (int n = 0; n < nRounds; n++)
+    {
+        BOOST_FOREACH(const string& strAddress, vAddress)
+        {
+            uint160 hash160;
+            AddressToHash160(strAddress, hash160);
+        }
+    }
+    int64 nDecode = GetTimeMillis() - nStart;
+
+    printf("  Hash160ToAddress: %.0f addresses/s, AddressToHash160: %.0f addresses/s\n",
+           BenchRate(nAddresses, nEncode), BenchRate(nAddresses, nDecode));
+}
@@ -0,0 +1,37 @@
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+//
+// A benchmark is a function registered by name with BENCHMARK(name).  It
+// times what it's measuring itself and prints the result with printf,
+// which bench_bitcoin sends to the console.
+//
+typedef void (*BenchFunction)();
+
+inline std::vector<std::pair<std::string, BenchFunction> >& GetBenchmarks()
+{
+    static std::vector<std::pair<std::string, BenchFunction> > vBenchmarks;
+    return vBenchmarks;
+}
+
+class CBenchRegistration
+{
+public:
+    CBenchRegistration(const char* pszName, BenchFunction pfn)
+    {
+        GetBenchmarks().push_back(std::make_pair(std::string(pszName), pfn));
+    }
+};
+
+#define BENCHMARK(name) \
+    static void name(); \
+    static CBenchRegistration name##_registration(#name, name); \
+    static void name()
+
+// Operations per second for nCount operations taking nMillis
+inline double BenchRate(int64 nCount, int64 nMillis)
+{
+    return nCount * 1000.0 / std::max(nMillis, (int64)1);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#include "../headers.h"
+#include "../strlcpy.h"
+#include "../test/insecure_rand.h"
+#include "bench.h"
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace boost;
+
+#include "base58_bench.cpp"
+#include "block_bench.cpp"
+#include "bloom_bench.cpp"
+#include "coinselect_bench.cpp"
+#include "db_bench.cpp"
+#include "key_bench.cpp"
+#include "script_bench.cpp"
+#include "uint256_bench.cpp"
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToConsole = true;
+
+    // Databases go in a scratch directory, never next to a real wallet
+    filesystem::path pathBench = filesystem::path(GetDefaultDataDir()) / "bench";
+    filesystem::remove_all(pathBench);
+    filesystem::create_directories(pathBench);
+    strlcpy(pszSetDataDir, pathBench.string().c_str(), sizeof(pszSetDataDir));
+
+    // With a name given, run only the benchmarks that contain it
+    string strFilter;
+    for (int i = 1; i < argc; i++)
+        if (argv[i][0] != '-')
+            strFilter = argv[i];
+
+    for (unsigned int i = 0; i < GetBenchmarks().size(); i++)
+    {
+        const string& strName = GetBenchmarks()[i].first;
+        if (!strFilter.empty() && strName.find(strFilter) == string::npos)
+            continue;
+        printf("%s\n", strName.c_str());
+        GetBenchmarks()[i].second();
+    }
+
+    DBFlush(true);
+    return 0;
+}
@@ -0,0 +1,71 @@
+//
+// Transaction hashes it takes to check a block twice, as ProcessBlock and
+// then ConnectBlock do, with the hash cache and with every hash thrown
+// away in between the way each GetHash used to hash again
+//
+BENCHMARK(check_block)
+{
+    const int nTransactions = 1000;
+    const int nRepeat = 20;
+
+    // Easy enough to solve on the spot
+    uint256 nProofOfWorkLimitSaved = nProofOfWorkLimit;
+    nProofOfWorkLimit = ~uint256(0) >> 1;
+
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = GetAdjustedTime();
+    block.nBits = nProofOfWorkLimit.GetCompact();
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vin[0].scriptSig << OP_0 << OP_0;
+    txNew.vout.resize(1);
+    txNew.vout[0].nValue = 50 * COIN;
+    txNew.vout[0].scriptPubKey << OP_TRUE;
+    block.vtx.push_back(txNew);
+    for (int i = 1; i < nTransactions; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(InsecureRandHash(), 0);
+        tx.vin[0].scriptSig << vector<unsigned char>(72, 1) << vector<unsigned char>(65, 2);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = CENT;
+        tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << InsecureRandHash() << OP_EQUALVERIFY << OP_CHECKSIG;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    while (block.GetHash() > uint256().SetCompact(block.nBits))
+        block.nNonce++;
+
+    for (int fCache = 1; fCache >= 0; fCache--)
+    {
+        bool fValid = true;
+        int64 nHashesStart = GetTransactionHashCount();
+        int64 nStart = GetTimeMillis();
+        for (int n = 0; n < nRepeat; n++)
+        {
+            // Each time as if it had just arrived
+            BOOST_FOREACH(CTransaction& tx, block.vtx)
+                tx.InvalidateHash();
+            if (!block.CheckBlock(0))
+                fValid = false;
+            if (!fCache)
+            {
+                BOOST_FOREACH(CTransaction& tx, block.vtx)
+                    tx.InvalidateHash();
+            }
+            if (!block.CheckBlock(0))
+                fValid = false;
+        }
+        int64 nElapsed = GetTimeMillis() - nStart;
+        int64 nHashes = GetTransactionHashCount() - nHashesStart;
+        if (!fValid)
+            printf("  CheckBlock failed\n");
+        printf("  %s: %.1f blocks/s, %"PRI64d" transaction hashes per block (%d transactions)\n", fCache ? "hash cache" : "hashing every time",
+               BenchRate(nRepeat, nElapsed), nHashes / nRepeat, nTransactions);
+    }
+
+    nProofOfWorkLimit = nProofOfWorkLimitSaved;
+}
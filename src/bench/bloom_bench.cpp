@@ -0,0 +1,57 @@
+//
+// What each peer used to keep for INVENTORY_KNOWN_SIZE announced items
+// against the fixed size of the rolling filter that replaced it, and how
+// quick the filter is to look in
+//
+static uint64 nAllocatedBytes = 0;
+
+template<typename T>
+class counting_allocator : public std::allocator<T>
+{
+public:
+    template<typename U> struct rebind { typedef counting_allocator<U> other; };
+
+    counting_allocator() {}
+    counting_allocator(const counting_allocator&) : std::allocator<T>() {}
+    template<typename U> counting_allocator(const counting_allocator<U>&) {}
+
+    T* allocate(size_t n, const void* = 0)
+    {
+        nAllocatedBytes += n * sizeof(T);
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        nAllocatedBytes -= n * sizeof(T);
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+BENCHMARK(inventory_known)
+{
+    CRollingBloomFilter filter(INVENTORY_KNOWN_SIZE, 0.000001);
+    uint64 nSetBytes = 0;
+    {
+        nAllocatedBytes = 0;
+        set<CInv, less<CInv>, counting_allocator<CInv> > setInventoryKnown;
+        for (unsigned int i = 0; i < INVENTORY_KNOWN_SIZE; i++)
+        {
+            CInv inv(MSG_TX, InsecureRandHash());
+            setInventoryKnown.insert(inv);
+            filter.insert(inv.hash);
+        }
+        nSetBytes = nAllocatedBytes;
+    }
+
+    const int nLookups = 100000;
+    int nFound = 0;
+    int64 nStart = GetTimeMillis();
+    for (int i = 0; i < nLookups; i++)
+        if (filter.contains(InsecureRandHash()))
+            nFound++;
+    int64 nElapsed = GetTimeMillis() - nStart;
+
+    printf("  %u items: set %"PRI64u" bytes, filter %u bytes, %.0f lookups/s, %d false positives\n",
+           INVENTORY_KNOWN_SIZE, nSetBytes, filter.GetMemoryUsage(), BenchRate(nLookups, nElapsed), nFound);
+}
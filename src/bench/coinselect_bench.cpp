@@ -0,0 +1,46 @@
+//
+// Coin selection over a wallet that has taken thousands of payments, for
+// sends from small change up to most of the balance.  This is the part of
+// SelectCoinsMinConf that runs once it has gathered the confirmed coins:
+// the exact match search and, when that finds nothing, the stochastic one.
+//
+BENCHMARK(select_coins)
+{
+    const int nCoins = 10000;
+    const int nRepeat = 20;
+
+    // Spread over 0.0001 to about 100, payments and change both
+    CWalletTx wtxDummy;
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vCoins;
+    for (int i = 0; i < nCoins; i++)
+    {
+        int64 nValue = CENT / 100;
+        for (int n = InsecureRand(21); n > 0; n--)
+            nValue *= 2;
+        nValue += nValue * InsecureRand(1000) / 1000;
+        vCoins.push_back(make_pair(nValue, make_pair((const CWalletTx*)&wtxDummy, (unsigned int)i)));
+    }
+
+    const int64 nTargets[] = { CENT, COIN / 2, 3 * COIN, 25 * COIN, 400 * COIN };
+    for (unsigned int t = 0; t < sizeof(nTargets) / sizeof(nTargets[0]); t++)
+    {
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64 nValue = 0;
+        bool fFound = false;
+
+        // SelectCoinsFromValues prints every selection, keep it off the console
+        fPrintToConsole = false;
+        int64 nStart = GetTimeMillis();
+        for (int n = 0; n < nRepeat; n++)
+            fFound = SelectCoinsFromValues(vCoins, nTargets[t], setCoins, nValue);
+        int64 nElapsed = GetTimeMillis() - nStart;
+        fPrintToConsole = true;
+
+        if (fFound)
+            printf("  send %s: %.1f selections/s, %d inputs, %s over\n", FormatMoney(nTargets[t]).c_str(),
+                   BenchRate(nRepeat, nElapsed), (int)setCoins.size(), FormatMoney(nValue - nTargets[t]).c_str());
+        else
+            printf("  send %s: %.1f selections/s, nothing found\n", FormatMoney(nTargets[t]).c_str(),
+                   BenchRate(nRepeat, nElapsed));
+    }
+}
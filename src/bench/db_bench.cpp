@@ -0,0 +1,59 @@
+//
+// Block index writes as ConnectBlock makes them during initial download,
+// one transaction per block against holding a batch of blocks in memory
+// and writing them together
+//
+static const int nBenchBlocks = 2000;
+static const int nBenchTxPerBlock = 50;
+
+static uint256 BenchHash(int n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+static bool WriteBenchBlock(CTxDB& txdb, int nHeight, uint256& hashPrevRet)
+{
+    if (!txdb.TxnBegin())
+        return false;
+    for (int i = 0; i < nBenchTxPerBlock; i++)
+        if (!txdb.UpdateTxIndex(BenchHash(nHeight * nBenchTxPerBlock + i), CTxIndex(CDiskTxPos(1, nHeight, i), 2)))
+            return false;
+
+    CDiskBlockIndex blockindex;
+    blockindex.nHeight = nHeight;
+    blockindex.hashPrev = hashPrevRet;
+    blockindex.nNonce = nHeight;
+    if (!txdb.WriteBlockIndex(blockindex) || !txdb.WriteHashBestChain(blockindex.GetBlockHash()))
+        return false;
+    hashPrevRet = blockindex.GetBlockHash();
+    return txdb.TxnCommit();
+}
+
+static void BenchBlockIndex(int nBatch)
+{
+    CTxDB txdb("cr+");
+    uint256 hashPrev = 0;
+    int64 nStart = GetTimeMillis();
+    for (int nHeight = 0; nHeight < nBenchBlocks; nHeight++)
+    {
+        if (nBatch > 0 && !IsTxDBBatch())
+            BeginTxDBBatch();
+        if (!WriteBenchBlock(txdb, nHeight, hashPrev))
+        {
+            printf("  writing block %d failed\n", nHeight);
+            return;
+        }
+        if (nBatch > 0 && (nHeight + 1) % nBatch == 0)
+            txdb.FlushBatch();
+    }
+    txdb.FlushBatch();
+    int64 nElapsed = GetTimeMillis() - nStart;
+    printf("  %s: %.0f blocks/s (%d tx each)\n", nBatch > 0 ? strprintf("batches of %d", nBatch).c_str() : "a block at a time",
+           BenchRate(nBenchBlocks, nElapsed), nBenchTxPerBlock);
+}
+
+BENCHMARK(block_index_write)
+{
+    BenchBlockIndex(0);
+    BenchBlockIndex(DEFAULT_DB_BATCH_BLOCKS);
+}
@@ -0,0 +1,113 @@
+static vector<unsigned char> BenchCompressPubKey(const vector<unsigned char>& vchPubKey)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char* pbegin = &vchPubKey[0];
+    o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size());
+    EC_KEY_set_conv_form(pkey, POINT_CONVERSION_COMPRESSED);
+    vector<unsigned char> vchRet(i2o_ECPublicKey(pkey, NULL));
+    unsigned char* pch = &vchRet[0];
+    i2o_ECPublicKey(pkey, &pch);
+    EC_KEY_free(pkey);
+    return vchRet;
+}
+
+//
+// Where the time goes verifying against a handful of busy keys, as a pool
+// payout address looks, with and without the public key cache
+//
+BENCHMARK(pubkey_cache)
+{
+    const int nKeys = 10;
+    const int nRepeat = 50;
+    for (int fCompressed = 0; fCompressed < 2; fCompressed++)
+    {
+        vector<vector<unsigned char> > vchPubKeys, vchSigs;
+        vector<uint256> vHash;
+        for (int i = 0; i < nKeys; i++)
+        {
+            CKey key;
+            key.MakeNewKey();
+            vchPubKeys.push_back(fCompressed ? BenchCompressPubKey(key.GetPubKey()) : key.GetPubKey());
+            vHash.push_back(Hash(vchPubKeys.back().begin(), vchPubKeys.back().end()));
+            vchSigs.push_back(vector<unsigned char>());
+            key.Sign(vHash.back(), vchSigs.back());
+        }
+
+        int64 nStart = GetTimeMillis();
+        for (int n = 0; n < nRepeat; n++)
+        {
+            for (int i = 0; i < nKeys; i++)
+            {
+                CKey key;
+                key.SetPubKey(vchPubKeys[i]);
+                key.Verify(vHash[i], vchSigs[i]);
+            }
+        }
+        int64 nUncached = GetTimeMillis() - nStart;
+
+        nStart = GetTimeMillis();
+        for (int n = 0; n < nRepeat; n++)
+        {
+            for (int i = 0; i < nKeys; i++)
+            {
+                CKey key;
+                key.SetPubKey(vchPubKeys[i]);
+            }
+        }
+        int64 nDecode = GetTimeMillis() - nStart;
+
+        CPubKeyCache cache(PUBKEY_CACHE_SIZE);
+        nStart = GetTimeMillis();
+        for (int n = 0; n < nRepeat; n++)
+        {
+            for (int i = 0; i < nKeys; i++)
+            {
+                EC_KEY* pkey = cache.Get(vchPubKeys[i]);
+                ECDSA_verify(0, (unsigned char*)&vHash[i], sizeof(uint256), &vchSigs[i][0], vchSigs[i].size(), pkey);
+                EC_KEY_free(pkey);
+            }
+        }
+        int64 nCached = GetTimeMillis() - nStart;
+
+        int nVerify = nKeys * nRepeat;
+        printf("  %s keys: uncached %.0f verifies/s, decoding %.1f%% of that, cached %.0f verifies/s (%"PRI64u" hits)\n",
+               fCompressed ? "compressed" : "uncompressed",
+               BenchRate(nVerify, nUncached),
+               100.0 * nDecode / max((int64)1, nUncached),
+               BenchRate(nVerify, nCached),
+               cache.nHits);
+    }
+}
+
+//
+// Signatures checked across all cores at once against one at a time
+//
+BENCHMARK(verify_batch)
+{
+    vector<CSigCheck> vChecks;
+    for (int i = 0; i < 8; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        for (int j = 0; j < 25; j++)
+        {
+            CSigCheck check;
+            check.hash = Hash(BEGIN(i), END(i), BEGIN(j), END(j));
+            check.vchPubKey = key.GetPubKey();
+            key.Sign(check.hash, check.vchSig);
+            vChecks.push_back(check);
+        }
+    }
+
+    vector<unsigned char> vfValid;
+    int64 nStart = GetTimeMillis();
+    CKey::VerifyBatch(vChecks, vfValid);
+    int64 nBatch = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    BOOST_FOREACH(const CSigCheck& check, vChecks)
+        check.Verify();
+    int64 nSerial = GetTimeMillis() - nStart;
+    printf("  VerifyBatch: %.0f signatures/s on %u cores, one at a time: %.0f signatures/s\n",
+           BenchRate(vChecks.size(), nBatch), boost::thread::hardware_concurrency(), BenchRate(vChecks.size(), nSerial));
+}
@@ -0,0 +1,99 @@
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, vector<unsigned char> > >& vSolutionRet);
+
+//
+// Scripts per second for a hash-and-compare script, which is all of a
+// pay-to-address check except the signature
+//
+BENCHMARK(eval_script)
+{
+    CTransaction txTo;
+    vector<unsigned char> vchPubKey(65, 4);
+    CScript scriptSig = CScript() << vchPubKey;
+    CScript scriptPubKey = CScript() << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY << OP_1 << OP_1ADD << OP_2 << OP_NUMEQUAL;
+
+    const int nScripts = 100000;
+    int nValid = 0;
+    int64 nStart = GetTimeMillis();
+    for (int i = 0; i < nScripts; i++)
+        if (VerifyScript(scriptSig, scriptPubKey, txTo, 0, 0))
+            nValid++;
+    int64 nElapsed = GetTimeMillis() - nStart;
+    if (nValid != nScripts)
+        printf("  only %d of %d scripts verified\n", nValid, nScripts);
+    printf("  EvalScript: %.0f scripts/s\n", BenchRate(nScripts, nElapsed));
+}
+
+// A one-input spend of scriptPubKey signed the way the wallet signs
+static CTransaction BenchSpend(CKey& key, const CScript& scriptPubKey)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.hash = Hash(scriptPubKey.begin(), scriptPubKey.end());
+    txTo.vin[0].prevout.n = 0;
+    txTo.vout[0].nValue = 50 * COIN;
+    txTo.vout[0].scriptPubKey = scriptPubKey;
+
+    vector<unsigned char> vchSig;
+    key.Sign(SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL), vchSig);
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txTo.vin[0].scriptSig << vchSig;
+    if (scriptPubKey[0] == OP_DUP)
+        txTo.vin[0].scriptSig << key.GetPubKey();
+    txTo.InvalidateHash();
+    return txTo;
+}
+
+//
+// Standard scripts as they appear on the chain: the genesis coinbase
+// output, the genesis address, and signed spends of both templates with
+// 65-byte keys.  VerifyScript takes its shortcut for these; EvalScript is
+// the interpreter it used to go through.
+//
+BENCHMARK(standard_scripts)
+{
+    vector<CScript> vScriptPubKey;
+    vector<CTransaction> vSpend;
+    vScriptPubKey.push_back(CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG);
+    vScriptPubKey.push_back(CScript() << OP_DUP << OP_HASH160 << ParseHex("62e907b15cbf27d5425399ebf6f0fb50ebb88f18") << OP_EQUALVERIFY << OP_CHECKSIG);
+    for (int i = 0; i < 20; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        if (i % 2 == 0)
+            vScriptPubKey.push_back(CScript() << key.GetPubKey() << OP_CHECKSIG);
+        else
+            vScriptPubKey.push_back(CScript() << OP_DUP << OP_HASH160 << Hash160(key.GetPubKey()) << OP_EQUALVERIFY << OP_CHECKSIG);
+        vSpend.push_back(BenchSpend(key, vScriptPubKey.back()));
+    }
+
+    const int nRounds = 20;
+    int nVerify = nRounds * vSpend.size();
+    int64 nStart = GetTimeMillis();
+    for (int n = 0; n < nRounds; n++)
+        BOOST_FOREACH(const CTransaction& tx, vSpend)
+            VerifyScript(tx.vin[0].scriptSig, tx.vout[0].scriptPubKey, tx, 0, 0);
+    int64 nMid = GetTimeMillis();
+    for (int n = 0; n < nRounds; n++)
+    {
+        BOOST_FOREACH(const CTransaction& tx, vSpend)
+        {
+            vector<vector<unsigned char> > stack;
+            EvalScript(stack, tx.vin[0].scriptSig, tx, 0, 0);
+            EvalScript(stack, tx.vout[0].scriptPubKey, tx, 0, 0);
+        }
+    }
+    int64 nEnd = GetTimeMillis();
+    printf("  VerifyScript: %.0f scripts/s, EvalScript: %.0f scripts/s\n",
+           BenchRate(nVerify, nMid - nStart), BenchRate(nVerify, nEnd - nMid));
+
+    const int nSolveRounds = 100000;
+    int nSolve = nSolveRounds * vScriptPubKey.size();
+    vector<pair<opcodetype, vector<unsigned char> > > vSolution;
+    nStart = GetTimeMillis();
+    for (int n = 0; n < nSolveRounds; n++)
+        BOOST_FOREACH(const CScript& script, vScriptPubKey)
+            Solver(script, vSolution);
+    printf("  Solver: %.0f scripts/s\n", BenchRate(nSolve, GetTimeMillis() - nStart));
+}
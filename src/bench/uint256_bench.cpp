@@ -0,0 +1,28 @@
+//
+// Adding up the chain work, the way LoadBlockIndex does for every block,
+// in uint256 against the CBigNum arithmetic it replaced
+//
+BENCHMARK(chain_work)
+{
+    const int nBlocks = 100000;
+    CBlockIndex index;
+    int64 nStart = GetTimeMillis();
+    uint256 nChainWork = 0;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        index.nBits = 0x1c000000 | ((i & 0xffff) + 1);
+        nChainWork = nChainWork + index.GetBlockWork();
+    }
+    int64 nMid = GetTimeMillis();
+    CBigNum bnChainWork = 0;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBigNum bnTarget;
+        bnTarget.SetCompact(0x1c000000 | ((i & 0xffff) + 1));
+        bnChainWork = bnChainWork + (CBigNum(1)<<256) / (bnTarget+1);
+    }
+    int64 nEnd = GetTimeMillis();
+    if (nChainWork != bnChainWork.getuint256())
+        printf("  chain work doesn't match CBigNum\n");
+    printf("  uint256: %.0f blocks/s, CBigNum: %.0f blocks/s\n", BenchRate(nBlocks, nMid - nStart), BenchRate(nBlocks, nEnd - nMid));
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headers.h"
+
+using namespace std;
+
+
+
+
+static inline unsigned int ROTL32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nLen)
+{
+    // The public domain MurmurHash3_x86_32, reading little-endian blocks
+    unsigned int h1 = nHashSeed;
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+
+    const int nBlocks = nLen / 4;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        const unsigned char* p = pch + i * 4;
+        unsigned int k1 = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    const unsigned char* tail = pch + nBlocks * 4;
+    unsigned int k1 = 0;
+    switch (nLen & 3)
+    {
+    case 3: k1 ^= tail[2] << 16;
+    case 2: k1 ^= tail[1] << 8;
+    case 1: k1 ^= tail[0];
+            k1 *= c1;
+            k1 = ROTL32(k1, 15);
+            k1 *= c2;
+            h1 ^= k1;
+    }
+
+    h1 ^= nLen;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CRollingBloomFilter
+//
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    // Optimal number of hash functions and bits for three generations' worth
+    // of entries at this false positive rate
+    double logFpRate = log(fpRate);
+    nHashFuncs = max(1, min((int)(logFpRate / log(0.5) + 0.5), 50));
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+
+    // Cells are two bits split across a pair of words, generation bit 0 in
+    // the even word and bit 1 in the odd one
+    data.resize(((nFilterBits + 63) / 64) * 2);
+    reset();
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pch, unsigned int nLen)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+
+        // Clear every cell that holds the new generation's number, 64 at a time
+        uint64 nGenerationMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nGenerationMask2 = 0 - (uint64)(nGeneration >> 1);
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64 p1 = data[p], p2 = data[p + 1];
+            uint64 mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = MurmurHash3(n * 0xFBA4C795 + nTweak, pch, nLen);
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        data[pos & ~1] = (data[pos & ~1] & ~((uint64)1 << bit)) | ((uint64)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~((uint64)1 << bit)) | ((uint64)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pch, unsigned int nLen) const
+{
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = MurmurHash3(n * 0xFBA4C795 + nTweak, pch, nLen);
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // A cell in use has a nonzero generation
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(UINT_MAX);
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    fill(data.begin(), data.end(), 0);
+}
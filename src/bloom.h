@@ -0,0 +1,46 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <vector>
+
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nLen);
+
+
+
+//
+// Set membership for roughly the last nElements items inserted, in a fixed
+// amount of memory.  Each cell has two bits holding the generation that last
+// set it, there are three generations of nElements/2 inserts each, and
+// starting a new generation clears the cells of the oldest one.  So anything
+// inserted in the last nElements/2 to nElements inserts is always found, older
+// items fade out, and other lookups are false positives at about fpRate.
+// The hash tweak is random per filter so a peer can't aim collisions at us.
+//
+class CRollingBloomFilter
+{
+protected:
+    std::vector<uint64> data;
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    int nGeneration;
+    int nHashFuncs;
+    unsigned int nTweak;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double fpRate);
+
+    void insert(const unsigned char* pch, unsigned int nLen);
+    bool contains(const unsigned char* pch, unsigned int nLen) const;
+    void reset();
+
+    void insert(const uint256& hash)            { insert((const unsigned char*)&hash, sizeof(hash)); }
+    bool contains(const uint256& hash) const    { return contains((const unsigned char*)&hash, sizeof(hash)); }
+
+    unsigned int GetMemoryUsage() const         { return data.size() * sizeof(data[0]); }
+};
+
+#endif
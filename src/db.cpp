@@ -72,8 +72,13 @@ CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
 
             dbenv.set_lg_dir(strLogDir.c_str());
             dbenv.set_lg_max(10000000);
-            dbenv.set_lk_max_locks(10000);
-            dbenv.set_lk_max_objects(10000);
+            // The lock limits can only be set for the whole environment,
+            // so only go past the usual 10000 when the block index is to be
+            // written in batches, by about as much as one batch takes
+            int64 nBatchBlocks = min(max(GetArg("-dbbatch", DEFAULT_DB_BATCH_BLOCKS), (int64)0), (int64)10000);
+            unsigned int nMaxLocks = 10000 + nBatchBlocks * 1100;
+            dbenv.set_lk_max_locks(nMaxLocks);
+            dbenv.set_lk_max_objects(nMaxLocks);
             dbenv.set_errfile(fopen(strErrorFile.c_str(), "a")); /// debug
             dbenv.set_flags(DB_AUTO_COMMIT, 1);
             ret = dbenv.open(strDataDir.c_str(),
@@ -212,16 +217,194 @@ void DBFlush(bool fShutdown)
 // CTxDB
 //
 
+// While a batch is open, tx index, block index and best chain writes are
+// kept in memory and go to blkindex.dat together in one transaction when
+// the batch is flushed.  TxnBegin/TxnCommit/TxnAbort still bracket each
+// block, on top of the batch, so a block that fails to connect leaves
+// nothing behind.  What's on disk is always a consistent chain state from
+// the last flush; blocks connected since then are just downloaded again.
+
+class CTxDBOverlay
+{
+public:
+    map<uint256, CTxIndex> mapTxIndex;  // a null CTxIndex means erased
+    map<uint256, CDiskBlockIndex> mapBlockIndex;
+    uint256 hashBestChain;
+
+    CTxDBOverlay()
+    {
+        hashBestChain = 0;
+    }
+
+    void Clear()
+    {
+        mapTxIndex.clear();
+        mapBlockIndex.clear();
+        hashBestChain = 0;
+    }
+
+    void Merge(const CTxDBOverlay& overlay)
+    {
+        for (map<uint256, CTxIndex>::const_iterator mi = overlay.mapTxIndex.begin(); mi != overlay.mapTxIndex.end(); ++mi)
+            mapTxIndex[(*mi).first] = (*mi).second;
+        for (map<uint256, CDiskBlockIndex>::const_iterator mi = overlay.mapBlockIndex.begin(); mi != overlay.mapBlockIndex.end(); ++mi)
+            mapBlockIndex[(*mi).first] = (*mi).second;
+        if (overlay.hashBestChain != 0)
+            hashBestChain = overlay.hashBestChain;
+    }
+};
+
+static CCriticalSection cs_txdbbatch;
+static bool fTxDBBatch = false;
+static CTxDBOverlay batchGroup;  // connected, not yet on disk
+
+CTxDB::~CTxDB()
+{
+    if (fBatchTxn)
+        TxnAbort();
+    delete pbatchTxn;
+}
+
+bool BeginTxDBBatch()
+{
+    CRITICAL_BLOCK(cs_txdbbatch)
+        fTxDBBatch = true;
+    return true;
+}
+
+bool IsTxDBBatch()
+{
+    CRITICAL_BLOCK(cs_txdbbatch)
+        return fTxDBBatch;
+    return false;
+}
+
+bool CTxDB::TxnBegin()
+{
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fTxDBBatch)
+        {
+            if (fBatchTxn)
+                return false;
+            if (!pbatchTxn)
+                pbatchTxn = new CTxDBOverlay();
+            pbatchTxn->Clear();
+            fBatchTxn = true;
+            return true;
+        }
+    }
+    return CDB::TxnBegin();
+}
+
+bool CTxDB::TxnCommit()
+{
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn)
+        {
+            batchGroup.Merge(*pbatchTxn);
+            pbatchTxn->Clear();
+            fBatchTxn = false;
+            return true;
+        }
+    }
+    return CDB::TxnCommit();
+}
+
+bool CTxDB::TxnAbort()
+{
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn)
+        {
+            pbatchTxn->Clear();
+            fBatchTxn = false;
+            return true;
+        }
+    }
+    return CDB::TxnAbort();
+}
+
+bool CTxDB::FlushBatch()
+{
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (!fTxDBBatch)
+            return true;
+        if (fBatchTxn)
+            return error("CTxDB::FlushBatch() : block still being connected");
+        if (!CDB::TxnBegin())
+            return error("CTxDB::FlushBatch() : TxnBegin failed");
+
+        for (map<uint256, CTxIndex>::iterator mi = batchGroup.mapTxIndex.begin(); mi != batchGroup.mapTxIndex.end(); ++mi)
+        {
+            bool fOk;
+            if ((*mi).second.IsNull())
+                fOk = Erase(make_pair(string("tx"), (*mi).first));
+            else
+                fOk = Write(make_pair(string("tx"), (*mi).first), (*mi).second);
+            if (!fOk)
+            {
+                CDB::TxnAbort();
+                return error("CTxDB::FlushBatch() : writing tx index failed");
+            }
+        }
+        for (map<uint256, CDiskBlockIndex>::iterator mi = batchGroup.mapBlockIndex.begin(); mi != batchGroup.mapBlockIndex.end(); ++mi)
+        {
+            if (!Write(make_pair(string("blockindex"), (*mi).first), (*mi).second))
+            {
+                CDB::TxnAbort();
+                return error("CTxDB::FlushBatch() : writing block index failed");
+            }
+        }
+        if (batchGroup.hashBestChain != 0 && !Write(string("hashBestChain"), batchGroup.hashBestChain))
+        {
+            CDB::TxnAbort();
+            return error("CTxDB::FlushBatch() : writing best chain failed");
+        }
+        if (!CDB::TxnCommit())
+            return error("CTxDB::FlushBatch() : TxnCommit failed");
+
+        if (fDebug)
+            printf("CTxDB::FlushBatch() : wrote %d tx index and %d block index entries\n", batchGroup.mapTxIndex.size(), batchGroup.mapBlockIndex.size());
+        batchGroup.Clear();
+        fTxDBBatch = false;
+    }
+    return true;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn && pbatchTxn->mapTxIndex.count(hash))
+        {
+            txindex = pbatchTxn->mapTxIndex[hash];
+            return !txindex.IsNull();
+        }
+        if (fTxDBBatch && batchGroup.mapTxIndex.count(hash))
+        {
+            txindex = batchGroup.mapTxIndex[hash];
+            return !txindex.IsNull();
+        }
+    }
     return Read(make_pair(string("tx"), hash), txindex);
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn || fTxDBBatch)
+        {
+            (fBatchTxn ? *pbatchTxn : batchGroup).mapTxIndex[hash] = txindex;
+            return true;
+        }
+    }
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -232,7 +415,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -240,12 +423,27 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn || fTxDBBatch)
+        {
+            (fBatchTxn ? *pbatchTxn : batchGroup).mapTxIndex[hash].SetNull();
+            return true;
+        }
+    }
     return Erase(make_pair(string("tx"), hash));
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn && pbatchTxn->mapTxIndex.count(hash))
+            return !pbatchTxn->mapTxIndex[hash].IsNull();
+        if (fTxDBBatch && batchGroup.mapTxIndex.count(hash))
+            return !batchGroup.mapTxIndex[hash].IsNull();
+    }
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -331,6 +529,14 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn || fTxDBBatch)
+        {
+            (fBatchTxn ? *pbatchTxn : batchGroup).mapBlockIndex[blockindex.GetBlockHash()] = blockindex;
+            return true;
+        }
+    }
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
@@ -341,22 +547,48 @@ bool CTxDB::EraseBlockIndex(uint256 hash)
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn && pbatchTxn->hashBestChain != 0)
+        {
+            hashBestChain = pbatchTxn->hashBestChain;
+            return true;
+        }
+        if (fTxDBBatch && batchGroup.hashBestChain != 0)
+        {
+            hashBestChain = batchGroup.hashBestChain;
+            return true;
+        }
+    }
     return Read(string("hashBestChain"), hashBestChain);
 }
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
+    CRITICAL_BLOCK(cs_txdbbatch)
+    {
+        if (fBatchTxn || fTxDBBatch)
+        {
+            (fBatchTxn ? *pbatchTxn : batchGroup).hashBestChain = hashBestChain;
+            return true;
+        }
+    }
     return Write(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
+bool CTxDB::ReadBestInvalidWork(uint256& nBestInvalidWork)
 {
-    return Read(string("bnBestInvalidWork"), bnBestInvalidWork);
+    // Kept in CBigNum's format, as it always has been
+    CBigNum bnBestInvalidWork;
+    if (!Read(string("bnBestInvalidWork"), bnBestInvalidWork))
+        return false;
+    nBestInvalidWork = bnBestInvalidWork.getuint256();
+    return true;
 }
 
-bool CTxDB::WriteBestInvalidWork(CBigNum bnBestInvalidWork)
+bool CTxDB::WriteBestInvalidWork(uint256 nBestInvalidWork)
 {
-    return Write(string("bnBestInvalidWork"), bnBestInvalidWork);
+    return Write(string("bnBestInvalidWork"), CBigNum(nBestInvalidWork));
 }
 
 CBlockIndex static * InsertBlockIndex(uint256 hash)
@@ -438,7 +670,7 @@ bool CTxDB::LoadBlockIndex()
     }
     pcursor->close();
 
-    // Calculate bnChainWork
+    // Calculate nChainWork
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -450,7 +682,7 @@ bool CTxDB::LoadBlockIndex()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -464,11 +696,11 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexBest->bnChainWork;
+    nBestChainWork = pindexBest->nChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight);
 
-    // Load bnBestInvalidWork, OK if it doesn't exist
-    ReadBestInvalidWork(bnBestInvalidWork);
+    // Load nBestInvalidWork, OK if it doesn't exist
+    ReadBestInvalidWork(nBestInvalidWork);
 
     // Verify blocks in the best chain
     CBlockIndex* pindexFork = NULL;
@@ -762,6 +994,11 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
                 ssKey >> nNumber;
                 if (nNumber > nAccountingEntryNumber)
                     nAccountingEntryNumber = nNumber;
+
+                CAccountingEntry acentry;
+                ssValue >> acentry;
+                acentry.strAccount = strAccount;
+                pwallet->laccentries.push_back(acentry);
             }
             else if (strType == "key" || strType == "wkey")
             {
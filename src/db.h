@@ -22,6 +22,7 @@ class CWallet;
 class CAccount;
 class CAccountingEntry;
 class CBlockLocator;
+class CTxDBOverlay;
 
 
 extern unsigned int nWalletDBUpdated;
@@ -268,11 +269,21 @@ public:
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { fBatchTxn = false; pbatchTxn = NULL; }
+    ~CTxDB();
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+    bool fBatchTxn;
+    CTxDBOverlay* pbatchTxn;  // the block this instance is connecting
 public:
+    // While a batch is open these work on the in-memory batch instead of
+    // a database transaction
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+    bool FlushBatch();
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -287,11 +298,14 @@ public:
     bool EraseBlockIndex(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
-    bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
-    bool WriteBestInvalidWork(CBigNum bnBestInvalidWork);
+    bool ReadBestInvalidWork(uint256& nBestInvalidWork);
+    bool WriteBestInvalidWork(uint256 nBestInvalidWork);
     bool LoadBlockIndex();
 };
 
+bool BeginTxDBBatch();
+bool IsTxDBBatch();
+
 
 
 
@@ -402,6 +416,23 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    bool WriteRescanBlock(const CBlockLocator& locator)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("rescanblock"), locator);
+    }
+
+    bool ReadRescanBlock(CBlockLocator& locator)
+    {
+        return Read(std::string("rescanblock"), locator);
+    }
+
+    bool EraseRescanBlock()
+    {
+        nWalletDBUpdated++;
+        return Erase(std::string("rescanblock"));
+    }
+
     bool ReadDefaultKey(std::vector<unsigned char>& vchPubKey)
     {
         vchPubKey.clear();
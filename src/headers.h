@@ -93,6 +93,7 @@
 #include "util.h"
 #include "bignum.h"
 #include "base58.h"
+#include "bloom.h"
 #include "main.h"
 #ifdef GUI
 #include "uibase.h"
@@ -46,6 +46,8 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        CRITICAL_BLOCK(cs_main)
+            FlushBlockIndexBatch();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -187,7 +189,18 @@ bool AppInit2(int argc, char* argv[])
             "  -upnp            \t  "   + _("Attempt to use UPnP to map the listening port\n") +
 #endif
 #endif
+            "  -maxsendbuffer=<n>\t  " + _("Disconnect a node whose send buffer passes <n> kilobytes (default: 10000)\n") +
+            "  -pausesendbuffer=<n>\t" + _("Stop answering a node's getdata while its send buffer is above <n> kilobytes (default: half of maxsendbuffer)\n") +
             "  -paytxfee=<amt>  \t  "   + _("Fee per KB to add to transactions you send\n") +
+            "  -maxmempool=<n>  \t  "   + _("Keep the transaction memory pool below <n> megabytes (default: 32)\n") +
+            "  -maxrelaycache=<n>\t  " + _("Keep at most <n> megabytes of relayed transactions for peers to request (default: 16)\n") +
+            "  -maxorphantx=<n> \t  "   + _("Keep at most <n> transactions with missing inputs (default: 100)\n") +
+            "  -maxorphanblocks=<n>\t  " + _("Keep at most <n> blocks whose parent is missing (default: 1100)\n") +
+            "  -maxorphanblocksize=<n>\t" + _("Keep at most <n> megabytes of blocks whose parent is missing (default: 128)\n") +
+            "  -headersfirst    \t  "   + _("Download and check block headers first, then fetch blocks from several nodes at once\n") +
+            "  -loadblock=<file>\t  "   + _("Import blocks from an external blk000?.dat style file on startup\n") +
+            "  -dbbatch=<n>     \t  "   + _("During initial download write the block index every <n> blocks, 0 to write each block (default: 500)\n") +
+            "  -dbbatchsize=<n> \t  "   + _("During initial download also write it after <n> megabytes of blocks (default: 16)\n") +
 #ifdef GUI
             "  -server          \t\t  " + _("Accept command line and JSON-RPC commands\n") +
 #endif
@@ -404,23 +417,46 @@ bool AppInit2(int argc, char* argv[])
     RegisterWallet(pwalletMain);
 
     CBlockIndex *pindexRescan = pindexBest;
-    if (GetBoolArg("-rescan"))
-        pindexRescan = pindexGenesisBlock;
-    else
+    bool fResumeRescan = false;
     {
         CWalletDB walletdb("wallet.dat");
         CBlockLocator locator;
-        if (walletdb.ReadBestBlock(locator))
+        if (walletdb.ReadRescanBlock(locator))
+        {
+            // Finish an interrupted rescan
+            pindexRescan = locator.GetBlockIndex();
+            fResumeRescan = true;
+        }
+        else if (GetBoolArg("-rescan"))
+            pindexRescan = pindexGenesisBlock;
+        else if (walletdb.ReadBestBlock(locator))
             pindexRescan = locator.GetBlockIndex();
     }
-    if (pindexBest != pindexRescan)
+    if (pindexBest != pindexRescan || fResumeRescan)
     {
         printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+        // An interrupted scan might have been a -rescan, so the ledger is
+        // rebuilt for those too
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true, GetBoolArg("-rescan") || fResumeRescan);
         printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
     }
 
+    if (mapArgs.count("-loadblock"))
+    {
+        BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
+        {
+            printf("Importing blocks from %s...\n", strFile.c_str());
+            nStart = GetTimeMillis();
+            FILE* file = fopen(strFile.c_str(), "rb");
+            if (file)
+                LoadExternalBlockFile(file);
+            else
+                printf("Could not open %s\n", strFile.c_str());
+            printf(" import      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+        }
+    }
+
     printf("Done loading\n");
 
         //// debug print
@@ -438,7 +474,7 @@ bool AppInit2(int argc, char* argv[])
         return false;
     }
 
-    // Add wallet transactions that aren't already in a block to mapTransactions
+    // Add wallet transactions that aren't already in a block to the memory pool
     pwalletMain->ReacceptWalletTransactions();
 
     //
@@ -520,6 +556,12 @@ bool AppInit2(int argc, char* argv[])
             wxMessageBox(_("Warning: -paytxfee is set very high.  This is the transaction fee you will pay if you send a transaction."), "Bitcoin", wxOK | wxICON_EXCLAMATION);
     }
 
+    if (mapArgs.count("-maxmempool"))
+        mempool.nMaxUsage = (uint64)max((int64)1, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE)) * 1000000;
+
+    if (mapArgs.count("-maxrelaycache"))
+        relaycache.nMaxBytes = (uint64)max((int64)1, GetArg("-maxrelaycache", DEFAULT_MAX_RELAY_CACHE_SIZE)) * 1000000;
+
     if (fHaveUPnP)
     {
 #if USE_UPNP
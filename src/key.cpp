@@ -0,0 +1,136 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headers.h"
+
+using namespace std;
+
+
+CPubKeyCache pubkeycache(PUBKEY_CACHE_SIZE);
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CPubKeyCache
+//
+
+EC_KEY* CPubKeyCache::Get(const vector<unsigned char>& vchPubKey)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<vector<unsigned char>, list_type::iterator>::iterator mi = mapKeys.find(vchPubKey);
+        if (mi != mapKeys.end())
+        {
+            listKeys.splice(listKeys.begin(), listKeys, (*mi).second);
+            nHits++;
+            EC_KEY* pkey = (*mi).second->second;
+            EC_KEY_up_ref(pkey);
+            return pkey;
+        }
+        nMisses++;
+    }
+
+    // Decoding is the slow part, other threads can keep verifying meanwhile
+    if (vchPubKey.empty())
+        return NULL;
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (pkey == NULL)
+        throw key_error("CPubKeyCache::Get() : EC_KEY_new_by_curve_name failed");
+    const unsigned char* pbegin = &vchPubKey[0];
+    if (!o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+    {
+        EC_KEY_free(pkey);
+        return NULL;
+    }
+
+    CRITICAL_BLOCK(cs)
+    {
+        if (!mapKeys.count(vchPubKey))
+        {
+            EC_KEY_up_ref(pkey);
+            listKeys.push_front(make_pair(vchPubKey, pkey));
+            mapKeys[vchPubKey] = listKeys.begin();
+            while (listKeys.size() > nMaxSize)
+            {
+                EC_KEY_free(listKeys.back().second);
+                mapKeys.erase(listKeys.back().first);
+                listKeys.pop_back();
+            }
+        }
+    }
+    return pkey;
+}
+
+void CPubKeyCache::Clear()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        BOOST_FOREACH(PAIRTYPE(vector<unsigned char>, EC_KEY*)& item, listKeys)
+            EC_KEY_free(item.second);
+        listKeys.clear();
+        mapKeys.clear();
+    }
+}
+
+unsigned int CPubKeyCache::size() const
+{
+    CRITICAL_BLOCK(cs)
+        return listKeys.size();
+    return 0;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CKey
+//
+
+bool CKey::Verify(const vector<unsigned char>& vchPubKey, uint256 hash, const vector<unsigned char>& vchSig)
+{
+    EC_KEY* pkey = pubkeycache.Get(vchPubKey);
+    if (pkey == NULL)
+        return false;
+
+    // -1 = error, 0 = bad sig, 1 = good
+    bool fValid = (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1);
+    EC_KEY_free(pkey);
+    return fValid;
+}
+
+// Batches smaller than this are checked on the calling thread
+static const unsigned int SIGCHECK_PARALLEL_MIN = 16;
+
+static void ThreadVerifyBatch(const vector<CSigCheck>* pvChecks, unsigned int nStart, unsigned int nStride, vector<unsigned char>* pvfValid)
+{
+    // Each thread owns every nStride'th check, and writes only those results
+    for (unsigned int i = nStart; i < pvChecks->size(); i += nStride)
+        (*pvfValid)[i] = (*pvChecks)[i].Verify();
+}
+
+bool CKey::VerifyBatch(const vector<CSigCheck>& vChecks, vector<unsigned char>& vfValidRet)
+{
+    vfValidRet.assign(vChecks.size(), false);
+
+    unsigned int nThreads = boost::thread::hardware_concurrency();
+    nThreads = min(nThreads, (unsigned int)vChecks.size() / SIGCHECK_PARALLEL_MIN);
+    if (nThreads > 1)
+    {
+        boost::thread_group threads;
+        for (unsigned int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(ThreadVerifyBatch, &vChecks, i, nThreads, &vfValidRet));
+        ThreadVerifyBatch(&vChecks, 0, nThreads, &vfValidRet);
+        threads.join_all();
+    }
+    else
+    {
+        ThreadVerifyBatch(&vChecks, 0, 1, &vfValidRet);
+    }
+
+    BOOST_FOREACH(unsigned char fValid, vfValidRet)
+        if (!fValid)
+            return false;
+    return true;
+}
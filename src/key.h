@@ -31,6 +31,9 @@
 // see www.keylength.com
 // script supports up to 75 for single byte push
 
+// Number of decoded public keys kept for signature checks
+static const unsigned int PUBKEY_CACHE_SIZE = 20000;
+
 
 
 class key_error : public std::runtime_error
@@ -45,6 +48,52 @@ typedef std::vector<unsigned char, secure_allocator<unsigned char> > CPrivKey;
 
 
 
+// Decoded public keys, most recently used first.  Verifying against a key
+// that's already here skips allocating an EC_KEY and decoding the point,
+// which for a compressed key means a square root.  The keys are only read
+// once decoded, so any number of threads can verify against one at a time.
+class CPubKeyCache
+{
+protected:
+    typedef std::list<std::pair<std::vector<unsigned char>, EC_KEY*> > list_type;
+    list_type listKeys;
+    std::map<std::vector<unsigned char>, list_type::iterator> mapKeys;
+    unsigned int nMaxSize;
+    mutable CCriticalSection cs;
+
+public:
+    uint64 nHits;
+    uint64 nMisses;
+
+    explicit CPubKeyCache(unsigned int nMaxSizeIn)
+    {
+        nMaxSize = nMaxSizeIn;
+        nHits = 0;
+        nMisses = 0;
+    }
+
+    ~CPubKeyCache()
+    {
+        Clear();
+    }
+
+    // Returns a reference the caller has to EC_KEY_free, or NULL if the key
+    // doesn't decode
+    EC_KEY* Get(const std::vector<unsigned char>& vchPubKey);
+    void Clear();
+    unsigned int size() const;
+
+private:
+    CPubKeyCache(const CPubKeyCache&);
+    CPubKeyCache& operator=(const CPubKeyCache&);
+};
+
+extern CPubKeyCache pubkeycache;
+
+class CSigCheck;
+
+
+
 class CKey
 {
 protected:
@@ -163,12 +212,37 @@ public:
         return key.Sign(hash, vchSig);
     }
 
-    static bool Verify(const std::vector<unsigned char>& vchPubKey, uint256 hash, const std::vector<unsigned char>& vchSig)
+    static bool Verify(const std::vector<unsigned char>& vchPubKey, uint256 hash, const std::vector<unsigned char>& vchSig);
+
+    // Checks independent signatures on as many threads as there are cores.
+    // vfValidRet[i] is set if vChecks[i] is good, returns true if they all are.
+    static bool VerifyBatch(const std::vector<CSigCheck>& vChecks, std::vector<unsigned char>& vfValidRet);
+};
+
+
+// A signature check with everything needed to run it later, on any thread
+class CSigCheck
+{
+public:
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    std::vector<unsigned char> vchPubKey;
+
+    CSigCheck()
     {
-        CKey key;
-        if (!key.SetPubKey(vchPubKey))
-            return false;
-        return key.Verify(hash, vchSig);
+        hash = 0;
+    }
+
+    CSigCheck(uint256 hashIn, const std::vector<unsigned char>& vchSigIn, const std::vector<unsigned char>& vchPubKeyIn)
+    {
+        hash = hashIn;
+        vchSig = vchSigIn;
+        vchPubKey = vchPubKeyIn;
+    }
+
+    bool Verify() const
+    {
+        return CKey::Verify(vchPubKey, hash, vchSig);
     }
 };
 
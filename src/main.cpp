@@ -25,31 +25,65 @@ CCriticalSection cs_main;
 CCriticalSection cs_mapPubKeys;
 map<uint160, vector<unsigned char> > mapPubKeys;
 
-map<uint256, CTransaction> mapTransactions;
-CCriticalSection cs_mapTransactions;
+CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
-map<COutPoint, CInPoint> mapNextTx;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 
 uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
-CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
+uint256 nProofOfWorkLimit(~uint256(0) >> 32);
 const int nTotalBlocksEstimate = 134444; // Conservative estimate of total nr of blocks on main chain
 const int nInitialBlockThreshold = 120; // Regard blocks up until N-threshold as "initial download"
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainWork = 0;
-CBigNum bnBestInvalidWork = 0;
+uint256 nBestChainWork = 0;
+uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
+bool fImporting = false;
+
+// Transactions hashed so far, for the debug log and benchmarks.  Counted
+// without a lock as GetHash runs on the script check and block decoder
+// threads too.
+static volatile int64 nTransactionHashes = 0;
 //int ncoinbase_maturity = 100;
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+// Out of order blocks.  Only what's needed to chain them stays in memory
+// for long; bodies go to datadir/orphanblocks once more than
+// MAX_ORPHAN_BLOCK_MEMORY bytes of them are held.
+class COrphanBlock
+{
+public:
+    uint256 hashPrev;
+    unsigned int nSize;
+    int64 nTimeReceived;
+    boost::shared_ptr<CBlock> pblock; // NULL once spilled to disk
+};
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+map<uint256, COrphanBlock> mapOrphanBlocks;
+multimap<uint256, uint256> mapOrphanBlocksByPrev;
+uint64 nOrphanBlockBytes = 0;
+uint64 nOrphanBlockMemory = 0;
+
+map<uint256, CBlockIndex*> mapHeaderIndex;
+CBlockIndex* pindexBestHeader = NULL;
+
+class COrphanTx
+{
+public:
+    CTransaction tx;
+    int nPeerId;
+    unsigned int nSize;
+    int64 nTimeExpire;
+};
+
+// Guards the orphan maps only.  Never held while taking another lock, so
+// the socket thread can drop a peer's orphans while holding cs_vNodes.
+CCriticalSection cs_mapOrphanTransactions;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+map<int, set<uint256> > mapOrphanTransactionsByPeer;
 
 
 double dHashesPerSec;
@@ -212,38 +246,158 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-void static AddOrphanTx(const CDataStream& vMsg)
+void static EraseOrphanTx(uint256 hash)
+{
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.find(hash);
+        if (mi == mapOrphanTransactions.end())
+            return;
+        const COrphanTx& orphan = (*mi).second;
+        BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+        {
+            map<COutPoint, set<uint256> >::iterator it = mapOrphanTransactionsByPrev.find(txin.prevout);
+            if (it == mapOrphanTransactionsByPrev.end())
+                continue;
+            (*it).second.erase(hash);
+            if ((*it).second.empty())
+                mapOrphanTransactionsByPrev.erase(it);
+        }
+        map<int, set<uint256> >::iterator it = mapOrphanTransactionsByPeer.find(orphan.nPeerId);
+        if (it != mapOrphanTransactionsByPeer.end())
+        {
+            (*it).second.erase(hash);
+            if ((*it).second.empty())
+                mapOrphanTransactionsByPeer.erase(it);
+        }
+        mapOrphanTransactions.erase(mi);
+    }
+}
+
+uint256 static RandomOrphanTx(const set<uint256>& setHash)
+{
+    // Hashes are uniform, so the one after a random point is a fair pick
+    uint256 hashRand;
+    RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+    set<uint256>::const_iterator it = setHash.lower_bound(hashRand);
+    if (it == setHash.end())
+        it = setHash.begin();
+    return *it;
+}
+
+bool static AddOrphanTx(const CTransaction& tx, int nPeerId)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return;
-    CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
+
+    // Ignore big transactions, to avoid a send-big-orphans memory exhaustion
+    // attack.  A parent with lots of inputs could be this big and still be
+    // standard, but it'll get relayed again once its parents are known.
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK);
+    if (nSize > MAX_ORPHAN_TX_SIZE)
+    {
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+        return false;
+    }
+
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        if (mapOrphanTransactions.count(hash))
+            return false;
+
+        // One peer can't push everyone else's orphans out, only its own
+        set<uint256>& setPeer = mapOrphanTransactionsByPeer[nPeerId];
+        if (setPeer.size() >= MAX_ORPHAN_TRANSACTIONS_PER_PEER)
+            EraseOrphanTx(RandomOrphanTx(setPeer));
+
+        COrphanTx& orphan = mapOrphanTransactions[hash];
+        orphan.tx = tx;
+        orphan.nPeerId = nPeerId;
+        orphan.nSize = nSize;
+        orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+        mapOrphanTransactionsByPeer[nPeerId].insert(hash);
+    }
+    return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+unsigned int static LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
-    if (!mapOrphanTransactions.count(hash))
-        return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    static int64 nNextSweep;
+    unsigned int nEvicted = 0;
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
     {
-        for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
-             mi != mapOrphanTransactionsByPrev.upper_bound(txin.prevout.hash);)
+        // Drop expired orphans every so often
+        int64 nNow = GetTime();
+        if (nNextSweep <= nNow)
         {
-            if ((*mi).second == pvMsg)
-                mapOrphanTransactionsByPrev.erase(mi++);
-            else
-                mi++;
+            vector<uint256> vExpired;
+            for (map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+                if ((*mi).second.nTimeExpire <= nNow)
+                    vExpired.push_back((*mi).first);
+            BOOST_FOREACH(const uint256& hash, vExpired)
+                EraseOrphanTx(hash);
+            nNextSweep = nNow + ORPHAN_TX_EXPIRE_TIME / 4;
+            if (!vExpired.empty())
+                printf("LimitOrphanTxSize() : expired %d orphan tx\n", vExpired.size());
+        }
+
+        while (mapOrphanTransactions.size() > nMaxOrphans)
+        {
+            uint256 hashRand;
+            RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+            map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.lower_bound(hashRand);
+            if (mi == mapOrphanTransactions.end())
+                mi = mapOrphanTransactions.begin();
+            EraseOrphanTx((*mi).first);
+            nEvicted++;
+        }
+    }
+    return nEvicted;
+}
+
+void static GetOrphansSpending(const uint256& hashPrev, vector<CTransaction>& vOrphansRet)
+{
+    // Outpoints sort by hash first, so every output of hashPrev is one range
+    set<uint256> setFound;
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        for (map<COutPoint, set<uint256> >::iterator it = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hashPrev, 0));
+             it != mapOrphanTransactionsByPrev.end() && (*it).first.hash == hashPrev;
+             ++it)
+        {
+            BOOST_FOREACH(const uint256& hash, (*it).second)
+                if (setFound.insert(hash).second)
+                    vOrphansRet.push_back(mapOrphanTransactions[hash].tx);
         }
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+}
+
+bool static HaveOrphanTx(const uint256& hash)
+{
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+        return (mapOrphanTransactions.count(hash) != 0);
+    return false;
+}
+
+void EraseOrphansFor(int nPeerId)
+{
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        if (!mapOrphanTransactionsByPeer.count(nPeerId))
+            return;
+        vector<uint256> vErase(mapOrphanTransactionsByPeer[nPeerId].begin(), mapOrphanTransactionsByPeer[nPeerId].end());
+        BOOST_FOREACH(const uint256& hash, vErase)
+            EraseOrphanTx(hash);
+        printf("EraseOrphansFor() : removed %d orphan tx from peer %d\n", vErase.size(), nPeerId);
+    }
+}
+
+unsigned int GetOrphanTxCount()
+{
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+        return mapOrphanTransactions.size();
+    return 0;
 }
 
 
@@ -258,6 +412,16 @@ void static EraseOrphanTx(uint256 hash)
 // CTransaction and CTxIndex
 //
 
+int64 GetTransactionHashCount()
+{
+    return AtomicAdd(nTransactionHashes, 0);
+}
+
+void AddTransactionHashes(int nHashes)
+{
+    AtomicAdd(nTransactionHashes, nHashes);
+}
+
 bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet)
 {
     SetNull();
@@ -383,10 +547,12 @@ bool CTransaction::CheckTransaction() const
     return true;
 }
 
-bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMissingInputs)
+bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMissingInputs, bool* pfAlreadyHave)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
+    if (pfAlreadyHave)
+        *pfAlreadyHave = false;
 
     if (!CheckTransaction())
         return error("AcceptToMemoryPool() : CheckTransaction failed");
@@ -420,19 +586,20 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
 
     // Do we already have it?
     uint256 hash = GetHash();
-    CRITICAL_BLOCK(cs_mapTransactions)
-        if (mapTransactions.count(hash))
-            return false;
-    if (fCheckInputs)
-        if (txdb.ContainsTx(hash))
-            return false;
+    if (mempool.Exists(hash) || (fCheckInputs && txdb.ContainsTx(hash)))
+    {
+        if (pfAlreadyHave)
+            *pfAlreadyHave = true;
+        return false;
+    }
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    uint256 hashOld = 0;
+    CRITICAL_BLOCK(mempool.cs)
     for (int i = 0; i < vin.size(); i++)
     {
-        COutPoint outpoint = vin[i].prevout;
-        if (mapNextTx.count(outpoint))
+        const CTransaction* ptxOld = mempool.GetSpender(vin[i].prevout);
+        if (ptxOld)
         {
             // Disable replacement feature for now
             return false;
@@ -440,26 +607,23 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
             // Allow replacing with a newer version of the same transaction
             if (i != 0)
                 return false;
-            ptxOld = mapNextTx[outpoint].ptx;
             if (ptxOld->IsFinal())
                 return false;
             if (!IsNewerThan(*ptxOld))
                 return false;
             for (int i = 0; i < vin.size(); i++)
-            {
-                COutPoint outpoint = vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                if (mempool.GetSpender(vin[i].prevout) != ptxOld)
                     return false;
-            }
+            hashOld = ptxOld->GetHash();
             break;
         }
     }
 
+    int64 nFees = 0;
     if (fCheckInputs)
     {
         // Check against previous transactions
         map<uint256, CTxIndex> mapUnused;
-        int64 nFees = 0;
         if (!ConnectInputs(txdb, mapUnused, CDiskTxPos(1,1,1), pindexBest, nFees, false, false))
         {
             if (pfMissingInputs)
@@ -471,6 +635,15 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         if (nFees < GetMinFee(1000, true, true))
             return error("AcceptToMemoryPool() : not enough fees");
 
+        // Or if the pool has been full and it pays less than what was evicted
+        int64 nPoolMinFee = mempool.GetMinFee(nSize);
+        if (nFees < nPoolMinFee && !IsFromMe(*this))
+            return error("AcceptToMemoryPool() : mempool min fee not met, %"PRI64d" < %"PRI64d, nFees, nPoolMinFee);
+
+        // Or if it hangs off too long a chain of unconfirmed transactions
+        if (!mempool.CheckPackageLimits(*this, nSize))
+            return error("AcceptToMemoryPool() : too many unconfirmed ancestors or descendants %s", hash.ToString().substr(0,10).c_str());
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make other's transactions take longer to confirm.
@@ -496,62 +669,472 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
             }
         }
     }
+    else
+    {
+        // Transactions put back by a reorg or the wallet skip the checks but
+        // still need their real fee, or they'd be the first to be evicted.
+        // Their inputs are either in the pool or on disk.
+        int64 nValueIn = 0;
+        bool fHaveInputs = true;
+        BOOST_FOREACH(const CTxIn& txin, vin)
+        {
+            boost::shared_ptr<const CTransaction> ptxPool = mempool.Get(txin.prevout.hash);
+            const CTransaction* ptxPrev = ptxPool.get();
+            CTransaction txDisk;
+            if (!ptxPrev && txdb.ReadDiskTx(txin.prevout.hash, txDisk))
+                ptxPrev = &txDisk;
+            if (!ptxPrev || txin.prevout.n >= ptxPrev->vout.size())
+            {
+                fHaveInputs = false;
+                break;
+            }
+            nValueIn += ptxPrev->vout[txin.prevout.n].nValue;
+        }
+        if (fHaveInputs && nValueIn > GetValueOut())
+            nFees = nValueIn - GetValueOut();
+    }
 
     // Store transaction in memory
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
-        if (ptxOld)
+        if (hashOld != 0)
+        {
+            printf("AcceptToMemoryPool() : replacing tx %s with new version\n", hashOld.ToString().c_str());
+            mempool.Remove(hashOld);
+        }
+        AddToMemoryPoolUnchecked(nFees);
+
+        // Make room, which may mean this one doesn't stay.  Unchecked
+        // transactions are our own or were just in a block, so they're let
+        // in over the limit rather than lost; the next checked one accepted
+        // trims the pool again.
+        if (fCheckInputs)
         {
-            printf("AcceptToMemoryPool() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            ptxOld->RemoveFromMemoryPool();
+            mempool.TrimToSize(mempool.nMaxUsage);
+            if (!mempool.Exists(hash))
+                return error("AcceptToMemoryPool() : mempool full");
         }
-        AddToMemoryPoolUnchecked();
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+    if (hashOld != 0)
+        EraseFromWallets(hashOld);
 
     printf("AcceptToMemoryPool(): accepted %s\n", hash.ToString().substr(0,10).c_str());
     return true;
 }
 
-bool CTransaction::AcceptToMemoryPool(bool fCheckInputs, bool* pfMissingInputs)
+bool CTransaction::AcceptToMemoryPool(bool fCheckInputs, bool* pfMissingInputs, bool* pfAlreadyHave)
 {
     CTxDB txdb("r");
-    return AcceptToMemoryPool(txdb, fCheckInputs, pfMissingInputs);
+    return AcceptToMemoryPool(txdb, fCheckInputs, pfMissingInputs, pfAlreadyHave);
 }
 
-bool CTransaction::AddToMemoryPoolUnchecked()
+bool CTransaction::AddToMemoryPoolUnchecked(int64 nFee)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call AcceptToMemoryPool to properly check the transaction first.
-    CRITICAL_BLOCK(cs_mapTransactions)
+    return mempool.AddUnchecked(*this, nFee);
+}
+
+
+bool CTransaction::RemoveFromMemoryPool()
+{
+    // Remove transaction from memory pool
+    mempool.Remove(GetHash());
+    return true;
+}
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CTxMemPool
+//
+
+unsigned int CTxMemPool::GetTxMemoryUsage(const CTransaction& tx)
+{
+    // Rough heap footprint of the transaction, its entry and the index
+    // nodes pointing at it.  Allocator overhead is guessed at two pointers.
+    static const unsigned int nNodeOverhead = 4 * sizeof(void*);
+    unsigned int nUsage = sizeof(CTransaction) + sizeof(CTxMemPoolEntry) + sizeof(uint256) + nNodeOverhead;
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity() + sizeof(COutPoint) + sizeof(CInPoint) + nNodeOverhead;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+// Each parent/child link is a set node on both sides, and each entry has a
+// node in setEvictionScore
+static const unsigned int MEMPOOL_LINK_USAGE = 2 * (sizeof(uint256) + 4 * sizeof(void*));
+static const unsigned int MEMPOOL_SCORE_USAGE = sizeof(double) + sizeof(uint256) + 4 * sizeof(void*);
+
+void CTxMemPool::Link(const uint256& hashParent, const uint256& hashChild)
+{
+    if (mapTx[hashParent].setChildren.insert(hashChild).second)
     {
-        uint256 hash = GetHash();
-        mapTransactions[hash] = *this;
-        for (int i = 0; i < vin.size(); i++)
-            mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
+        mapTx[hashChild].setParents.insert(hashParent);
+        nUsage += MEMPOOL_LINK_USAGE;
+    }
+}
+
+void CTxMemPool::CalculateAncestors(const uint256& hash, set<uint256>& setAncestors)
+{
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        uint256 hashNext = vWork.back();
+        vWork.pop_back();
+        BOOST_FOREACH(const uint256& hashParent, mapTx[hashNext].setParents)
+            if (setAncestors.insert(hashParent).second)
+                vWork.push_back(hashParent);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants)
+{
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        uint256 hashNext = vWork.back();
+        vWork.pop_back();
+        BOOST_FOREACH(const uint256& hashChild, mapTx[hashNext].setChildren)
+            if (setDescendants.insert(hashChild).second)
+                vWork.push_back(hashChild);
+    }
+}
+
+void CTxMemPool::UpdateEvictionScore(const uint256& hash, CTxMemPoolEntry& entry)
+{
+    setEvictionScore.erase(make_pair(entry.dEvictionScore, hash));
+    entry.dEvictionScore = entry.GetEvictionScore();
+    setEvictionScore.insert(make_pair(entry.dEvictionScore, hash));
+}
+
+void CTxMemPool::UpdatePackage(const uint256& hash, int64 nFee, int64 nSize, int nCount)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    entry.nFeesWithDescendants += nFee;
+    entry.nSizeWithDescendants += nSize;
+    entry.nCountWithDescendants += nCount;
+    UpdateEvictionScore(hash, entry);
+}
+
+void CTxMemPool::RecalculatePackage(const uint256& hash)
+{
+    // The slow way, for when links appear or vanish in the middle of a chain
+    CTxMemPoolEntry& entry = mapTx[hash];
+    set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    entry.nFeesWithDescendants = entry.nFee;
+    entry.nSizeWithDescendants = entry.nTxSize;
+    entry.nCountWithDescendants = 1 + setDescendants.size();
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        const CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+        entry.nFeesWithDescendants += descendant.nFee;
+        entry.nSizeWithDescendants += descendant.nTxSize;
+    }
+    UpdateEvictionScore(hash, entry);
+}
+
+bool CTxMemPool::AddUnchecked(const CTransaction& tx, int64 nFee)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        uint256 hash = tx.GetHash();
+        if (mapTx.count(hash))
+            return false;
+
+        // The one and only copy; everything else points at it
+        CTxMemPoolEntry& entry = mapTx[hash];
+        entry.ptx.reset(new CTransaction(tx));
+        entry.nFee = nFee;
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
+        entry.nUsage = GetTxMemoryUsage(tx) + MEMPOOL_SCORE_USAGE;
+        entry.nTime = GetTime();
+        entry.nFeesWithDescendants = nFee;
+        entry.nSizeWithDescendants = entry.nTxSize;
+        entry.nCountWithDescendants = 1;
+
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            mapNextTx[prevout] = CInPoint(entry.ptx.get(), i);
+            if (mapTx.count(prevout.hash))
+                Link(prevout.hash, hash);
+        }
+
+        // Spenders can already be here when a reorg puts transactions
+        // back in an order other than parent first
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            MapNextTx::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it != mapNextTx.end())
+                Link(hash, it->second.ptx->GetHash());
+        }
+
+        // Everything upstream now carries this transaction too
+        set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        if (entry.setChildren.empty())
+        {
+            UpdateEvictionScore(hash, entry);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                UpdatePackage(hashAncestor, nFee, entry.nTxSize, 1);
+        }
+        else
+        {
+            RecalculatePackage(hash);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                RecalculatePackage(hashAncestor);
+        }
+
+        nBytes += entry.nTxSize;
+        nUsage += entry.nUsage;
+        nAdded++;
         nTransactionsUpdated++;
     }
     return true;
 }
 
-
-bool CTransaction::RemoveFromMemoryPool()
+bool CTxMemPool::Remove(const uint256& hash, bool fRecursive)
 {
-    // Remove transaction from memory pool
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(cs)
     {
-        BOOST_FOREACH(const CTxIn& txin, vin)
-            mapNextTx.erase(txin.prevout);
-        mapTransactions.erase(GetHash());
+        MapTx::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            return false;
+
+        if (fRecursive)
+        {
+            // Children go first, they can't stay without their inputs
+            vector<uint256> vChildren((*mi).second.setChildren.begin(), (*mi).second.setChildren.end());
+            BOOST_FOREACH(const uint256& hashChild, vChildren)
+                Remove(hashChild, true);
+            mi = mapTx.find(hash);
+        }
+
+        CTxMemPoolEntry& entry = (*mi).second;
+        const CTransaction& tx = *entry.ptx;
+        set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        bool fHadChildren = !entry.setChildren.empty();
+        int64 nFee = entry.nFee;
+        unsigned int nTxSize = entry.nTxSize;
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            MapNextTx::iterator it = mapNextTx.find(txin.prevout);
+            if (it != mapNextTx.end() && (*it).second.ptx == &tx)
+                mapNextTx.erase(it);
+        }
+        BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+            mapTx[hashParent].setChildren.erase(hash);
+        BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+            mapTx[hashChild].setParents.erase(hash);
+        nUsage -= (entry.setParents.size() + entry.setChildren.size()) * MEMPOOL_LINK_USAGE;
+
+        nBytes -= entry.nTxSize;
+        nUsage -= entry.nUsage;
+        nRemoved++;
+        setEvictionScore.erase(make_pair(entry.dEvictionScore, hash));
+        mapTx.erase(mi);
+
+        // Normally there's nothing below it (mined in order, or descendants
+        // already gone), otherwise the ancestors lose more than this one
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            if (fHadChildren)
+                RecalculatePackage(hashAncestor);
+            else
+                UpdatePackage(hashAncestor, -nFee, -(int64)nTxSize, -1);
+        }
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::RemoveConflicts(const CTransaction& tx)
+{
+    // Anything spending the same outputs as a transaction that made it
+    // into a block can never confirm now
+    CRITICAL_BLOCK(cs)
+    {
+        uint256 hash = tx.GetHash();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CTransaction* ptxConflict = GetSpender(txin.prevout);
+            if (ptxConflict && ptxConflict->GetHash() != hash)
+            {
+                uint256 hashConflict = ptxConflict->GetHash();
+                unsigned int nSizeBefore = mapTx.size();
+                Remove(hashConflict, true);
+                nConflicts += nSizeBefore - mapTx.size();
+                printf("CTxMemPool::RemoveConflicts() : removed %s, double spent by %s\n", hashConflict.ToString().substr(0,10).c_str(), hash.ToString().substr(0,10).c_str());
+            }
+        }
+    }
+}
+
+void CTxMemPool::TrimToSize(uint64 nSizeLimit, vector<uint256>* pvEvicted)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        while (nUsage > nSizeLimit && !setEvictionScore.empty())
+        {
+            double dFeeRate = (*setEvictionScore.begin()).first;
+            uint256 hash = (*setEvictionScore.begin()).second;
+
+            // Don't take back anything paying no more than what's thrown out
+            // (decaying the current floor first so it's compared like for like)
+            int64 nNewMinFee = (int64)dFeeRate + MIN_RELAY_TX_FEE;
+            GetMinFee(1000);
+            if (nNewMinFee > nMinFeePerK)
+                nMinFeePerK = nNewMinFee;
+            nMinFeeUpdated = GetTime();
+
+            set<uint256> setEvict;
+            CalculateDescendants(hash, setEvict);
+            setEvict.insert(hash);
+            BOOST_FOREACH(const uint256& hashEvict, setEvict)
+            {
+                nEvicted++;
+                nEvictedBytes += mapTx[hashEvict].nTxSize;
+                if (pvEvicted)
+                    pvEvicted->push_back(hashEvict);
+            }
+            if (fDebug)
+                printf("CTxMemPool::TrimToSize() : evicting %s and %d descendants at %.0f per KB\n", hash.ToString().substr(0,10).c_str(), setEvict.size() - 1, dFeeRate);
+            Remove(hash, true);
+        }
+    }
+}
+
+int64 CTxMemPool::GetMinFee(unsigned int nBytes) const
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (nMinFeePerK == 0)
+            return 0;
+
+        // Decay faster the emptier the pool is
+        int64 nNow = GetTime();
+        if (nNow > nMinFeeUpdated + 10)
+        {
+            double dHalfLife = MEMPOOL_MINFEE_HALFLIFE;
+            if (nUsage < nMaxUsage / 4)
+                dHalfLife /= 4;
+            else if (nUsage < nMaxUsage / 2)
+                dHalfLife /= 2;
+            nMinFeePerK = (int64)(nMinFeePerK / pow(2.0, (nNow - nMinFeeUpdated) / dHalfLife));
+            nMinFeeUpdated = nNow;
+            if (nMinFeePerK < MIN_RELAY_TX_FEE / 2)
+                nMinFeePerK = 0;
+        }
+        return nMinFeePerK * nBytes / 1000;
+    }
+    return 0;
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, unsigned int nTxSize) const
+{
+    // Every add and remove walks the ancestors, so a long unconfirmed chain
+    // would make each new link cost as much as the chain.  The walk stops
+    // as soon as it's over the limit.
+    CRITICAL_BLOCK(cs)
+    {
+        set<uint256> setAncestors;
+        uint64 nAncestorSize = nTxSize;
+        vector<uint256> vWork;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (mapTx.count(txin.prevout.hash) && setAncestors.insert(txin.prevout.hash).second)
+                vWork.push_back(txin.prevout.hash);
+        while (!vWork.empty())
+        {
+            if (setAncestors.size() + 1 > MEMPOOL_MAX_ANCESTORS)
+                return error("CTxMemPool::CheckPackageLimits() : more than %u unconfirmed ancestors", MEMPOOL_MAX_ANCESTORS - 1);
+
+            uint256 hashNext = vWork.back();
+            vWork.pop_back();
+            const CTxMemPoolEntry& entry = (*mapTx.find(hashNext)).second;
+            nAncestorSize += entry.nTxSize;
+            if (nAncestorSize > MEMPOOL_MAX_ANCESTOR_SIZE)
+                return error("CTxMemPool::CheckPackageLimits() : %"PRI64d" bytes with unconfirmed ancestors", (int64)nAncestorSize);
+
+            // Each ancestor would carry this one as well
+            if (entry.nCountWithDescendants + 1 > MEMPOOL_MAX_DESCENDANTS)
+                return error("CTxMemPool::CheckPackageLimits() : %s already has %u unconfirmed descendants", hashNext.ToString().substr(0,10).c_str(), entry.nCountWithDescendants - 1);
+            if (entry.nSizeWithDescendants + nTxSize > MEMPOOL_MAX_DESCENDANT_SIZE)
+                return error("CTxMemPool::CheckPackageLimits() : %s would have %"PRI64d" bytes with unconfirmed descendants", hashNext.ToString().substr(0,10).c_str(), (int64)(entry.nSizeWithDescendants + nTxSize));
+
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                if (setAncestors.insert(hashParent).second)
+                    vWork.push_back(hashParent);
+        }
+    }
+    return true;
+}
+
+bool CTxMemPool::Exists(const uint256& hash) const
+{
+    CRITICAL_BLOCK(cs)
+        return (mapTx.count(hash) != 0);
+    return false;
+}
+
+bool CTxMemPool::Lookup(const uint256& hash, CTransaction& txRet) const
+{
+    CRITICAL_BLOCK(cs)
+    {
+        MapTx::const_iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            return false;
+        txRet = *(*mi).second.ptx;
+    }
+    return true;
+}
+
+boost::shared_ptr<const CTransaction> CTxMemPool::Get(const uint256& hash) const
+{
+    CRITICAL_BLOCK(cs)
+    {
+        MapTx::const_iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
+            return (*mi).second.ptx;
+    }
+    return boost::shared_ptr<const CTransaction>();
+}
+
+const CTransaction* CTxMemPool::GetSpender(const COutPoint& outpoint) const
+{
+    // Only good while cs is held
+    CRITICAL_BLOCK(cs)
+    {
+        MapNextTx::const_iterator it = mapNextTx.find(outpoint);
+        if (it != mapNextTx.end())
+            return (*it).second.ptx;
+    }
+    return NULL;
+}
+
+void CTxMemPool::QueryHashes(vector<uint256>& vHash) const
+{
+    vHash.clear();
+    CRITICAL_BLOCK(cs)
+    {
+        vHash.reserve(mapTx.size());
+        for (MapTx::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+            vHash.push_back((*mi).first);
+    }
+}
+
 
 
 
@@ -615,7 +1198,7 @@ bool CMerkleTx::AcceptToMemoryPool()
 
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
 {
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         // Add previous supporting transactions first
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
@@ -623,7 +1206,7 @@ bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
             if (!tx.IsCoinBase())
             {
                 uint256 hash = tx.GetHash();
-                if (!mapTransactions.count(hash) && !txdb.ContainsTx(hash))
+                if (!mempool.Exists(hash) && !txdb.ContainsTx(hash))
                     tx.AcceptToMemoryPool(txdb, fCheckInputs);
             }
         }
@@ -691,12 +1274,90 @@ void CBlock::SetAuxPow(CAuxPow* pow)
     auxpow.reset(pow);
 }
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
+// Blocks with fewer transactions than this are hashed on the calling thread,
+// starting threads costs more than it saves
+static const unsigned int MERKLE_PARALLEL_MIN_TXS = 500;
+
+static void ThreadHashTransactions(const vector<CTransaction>* pvtx, unsigned int nStart, unsigned int nStride, int* pnHashed)
+{
+    // Each thread owns every nStride'th transaction, so the cached hashes
+    // aren't shared between threads
+    int nHashed = 0;
+    for (unsigned int i = nStart; i < pvtx->size(); i += nStride)
+    {
+        if ((*pvtx)[i].CacheHash())
+            nHashed++;
+    }
+    *pnHashed = nHashed;
+}
+
+uint256 CBlock::BuildMerkleTree() const
+{
+    if (vtx.size() >= MERKLE_PARALLEL_MIN_TXS)
+    {
+        unsigned int nThreads = boost::thread::hardware_concurrency();
+        nThreads = min(nThreads, (unsigned int)vtx.size() / (MERKLE_PARALLEL_MIN_TXS / 2));
+        if (nThreads > 1)
+        {
+            vector<int> vnHashed(nThreads, 0);
+            boost::thread_group threads;
+            for (unsigned int i = 1; i < nThreads; i++)
+                threads.create_thread(boost::bind(ThreadHashTransactions, &vtx, i, nThreads, &vnHashed[i]));
+            ThreadHashTransactions(&vtx, 0, nThreads, &vnHashed[0]);
+            threads.join_all();
+            int nTotal = 0;
+            BOOST_FOREACH(int nHashed, vnHashed)
+                nTotal += nHashed;
+            AddTransactionHashes(nTotal);
+        }
+    }
+
+    vMerkleTree.clear();
+    vMerkleTree.reserve(vtx.size() * 2 + 16);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vMerkleTree.push_back(tx.GetHash());
+    int j = 0;
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = min(i+1, nSize-1);
+            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
+                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+}
+
+uint256 CBlock::UpdateMerkleCoinbase() const
+{
+    unsigned int nTreeSize = 0;
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nTreeSize += nSize;
+    nTreeSize += 1;
+    if (vtx.empty() || vMerkleTree.size() != nTreeSize)
+        return BuildMerkleTree();
+
+    // The leftmost node of each level only depends on the leftmost pair below it
+    vMerkleTree[0] = vtx[0].GetHash();
+    int j = 0;
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        int i2 = min(1, nSize-1);
+        vMerkleTree[j+nSize] = Hash(BEGIN(vMerkleTree[j]),    END(vMerkleTree[j]),
+                                    BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2]));
+        j += nSize;
+    }
+    return vMerkleTree.back();
+}
+
+uint256 static GetOrphanRoot(uint256 hash)
 {
     // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
+    while (mapOrphanBlocks.count(mapOrphanBlocks[hash].hashPrev))
+        hash = mapOrphanBlocks[hash].hashPrev;
+    return hash;
 }
 
 int64 static GetBlockValue(int nHeight, int64 nFees)
@@ -735,6 +1396,29 @@ int64 static GetBlockValue(int nHeight, int64 nFees)
 }
 
 
+// nTarget * nMultiply / nDivide, capped at nProofOfWorkLimit, the same as
+// CBigNum worked it out.  Dividing first and carrying the remainder keeps
+// every step inside 256 bits, and a product too big for that is over the
+// limit anyway.  Both timespans are positive.
+uint256 static RetargetScale(const uint256& nTarget, int64 nMultiply, int64 nDivide)
+{
+    uint256 nMul = (uint64)nMultiply;
+    uint256 nDiv = (uint64)nDivide;
+    uint256 nQuotient = nTarget / nDiv;
+    uint256 nRemainder = nTarget - nQuotient * nDiv;
+    if (nQuotient != 0 && nMul > ~uint256(0) / nQuotient)
+        return nProofOfWorkLimit;
+    uint256 nNew = nQuotient * nMul;
+    uint256 nCarry = nRemainder * nMul / nDiv;
+    if (nNew > ~uint256(0) - nCarry)
+        return nProofOfWorkLimit;
+    nNew += nCarry;
+
+    if (nNew > nProofOfWorkLimit)
+        nNew = nProofOfWorkLimit;
+    return nNew;
+}
+
 unsigned int static GetNextWorkRequired_org(const CBlockIndex* pindexLast)
 {
     //const int64 nTargetTimespan = 14 * 24 * 60 * 60; // two weeks
@@ -747,9 +1431,9 @@ unsigned int static GetNextWorkRequired_org(const CBlockIndex* pindexLast)
     // Genesis block
     if (pindexLast == NULL)
     {
-        printf("GetNextWorkingRequired pindexLast == NULL, return bnProofOfWorkLimit = %08x hex \n",bnProofOfWorkLimit.GetCompact());
-        printf(" target = %s \n",CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-        return bnProofOfWorkLimit.GetCompact();
+        printf("GetNextWorkingRequired pindexLast == NULL, return nProofOfWorkLimit = %08x hex \n",nProofOfWorkLimit.GetCompact());
+        printf(" target = %s \n",nProofOfWorkLimit.ToString().c_str());
+        return nProofOfWorkLimit.GetCompact();
     }
 
     if (GetArgIntxx(0,"-Diff_triger_block") > 0)
@@ -758,26 +1442,26 @@ unsigned int static GetNextWorkRequired_org(const CBlockIndex* pindexLast)
         if (GetArgIntxx(0,"-Diff_triger_block") < pindexLast->nHeight)
         {
             printf(" Diff_triger_block < nHeights  with nHeights now at: %d \n",pindexLast->nHeight);
-            if (CBigNum().SetCompact(GetArgIntxx(487587839,"-Diff_post_triger")) < CBigNum().SetCompact(pindexLast->nBits))
+            if (uint256().SetCompact(GetArgIntxx(487587839,"-Diff_post_triger")) < uint256().SetCompact(pindexLast->nBits))
             {
                 printf(" Diff_post_triger > nBits detected so will override nBits value to: %d \n",GetArgIntxx(487587839,"-Diff_post_triger"));
-                printf(" present target is: %s \n",CBigNum().SetCompact(GetArgIntxx(487587839,"-Diff_post_triger")).getuint256().ToString().c_str());
+                printf(" present target is: %s \n",uint256().SetCompact(GetArgIntxx(487587839,"-Diff_post_triger")).ToString().c_str());
                 // default value of post_triger here 487587839 is same as weeds nbits = 1d0fffff,  dDiff dec = 0.0624
                 return GetArgIntxx(487587839,"-Diff_post_triger");
             }
-            printf(" present target already bigger than: %s \n",CBigNum().SetCompact(GetArgIntxx(487587839,"-Diff_post_triger")).getuint256().ToString().c_str());
+            printf(" present target already bigger than: %s \n",uint256().SetCompact(GetArgIntxx(487587839,"-Diff_post_triger")).ToString().c_str());
         }
         if (GetArgIntxx(0,"-Diff_triger_blockB") < pindexLast->nHeight)
         {
             printf(" Diff_triger_blockB < nHeights  with nHeights now at: %d \n",pindexLast->nHeight);
-            if (CBigNum().SetCompact(GetArgIntxx(487587839,"-Diff_post_trigerB")) < CBigNum().SetCompact(pindexLast->nBits))
+            if (uint256().SetCompact(GetArgIntxx(487587839,"-Diff_post_trigerB")) < uint256().SetCompact(pindexLast->nBits))
             {
                 printf(" Diff_post_trigerB > nBits detected so will override nBits value to: %d \n",GetArgIntxx(487587839,"-Diff_post_trigerB"));
-                printf(" present target is: %s \n",CBigNum().SetCompact(GetArgIntxx(487587839,"-Diff_post_trigerB")).getuint256().ToString().c_str());
+                printf(" present target is: %s \n",uint256().SetCompact(GetArgIntxx(487587839,"-Diff_post_trigerB")).ToString().c_str());
                 // default value of post_triger here 487587839 is same as weeds nbits = 1d0fffff,  dDiff dec = 0.0624
                 return GetArgIntxx(487587839,"-Diff_post_trigerB");
             }
-            printf(" present target already bigger than: %s \n",CBigNum().SetCompact(GetArgIntxx(487587839,"-Diff_post_trigerB")).getuint256().ToString().c_str());
+            printf(" present target already bigger than: %s \n",uint256().SetCompact(GetArgIntxx(487587839,"-Diff_post_trigerB")).ToString().c_str());
         }
     }
 
@@ -785,7 +1469,7 @@ unsigned int static GetNextWorkRequired_org(const CBlockIndex* pindexLast)
     if ((pindexLast->nHeight+1) % nInterval != 0)
     {
         printf("GetNextWorkingRequired once per interval, return pindexLast->nBits = %08x hex \n",pindexLast->nBits);
-        printf(" target = %s \n",CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
+        printf(" target = %s \n",uint256().SetCompact(pindexLast->nBits).ToString().c_str());
         return pindexLast->nBits;
     }
 
@@ -811,21 +1495,15 @@ unsigned int static GetNextWorkRequired_org(const CBlockIndex* pindexLast)
         nActualTimespan = nTargetTimespan*((float)GetArg("-LimitAdjustmentStep", 4000)/1000);
 
     // Retarget
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nTargetTimespan;
-
-    if (bnNew > bnProofOfWorkLimit)
-        bnNew = bnProofOfWorkLimit;
+    uint256 nNew = RetargetScale(uint256().SetCompact(pindexLast->nBits), nActualTimespan, nTargetTimespan);
 
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", nNew.GetCompact(), nNew.ToString().c_str());
 
-    return bnNew.GetCompact();
+    return nNew.GetCompact();
 }
 
 unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast)
@@ -839,7 +1517,7 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast)
 
     // Genesis block
     if (pindexLast == NULL)
-        return bnProofOfWorkLimit.GetCompact();
+        return nProofOfWorkLimit.GetCompact();
 
     // Only change once per interval
     if ((pindexLast->nHeight+1) % nInterval != 0)
@@ -883,21 +1561,15 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast)
 	}
 
     // Retarget
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nTargetTimespan;
-
-    if (bnNew > bnProofOfWorkLimit)
-        bnNew = bnProofOfWorkLimit;
+    uint256 nNew = RetargetScale(uint256().SetCompact(pindexLast->nBits), nActualTimespan, nTargetTimespan);
 
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", nNew.GetCompact(), nNew.ToString().c_str());
 
-    return bnNew.GetCompact();
+    return nNew.GetCompact();
 }
 
 unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast)
@@ -914,15 +1586,17 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast)
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    uint256 nTarget;
+    nTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || nTarget == 0 || nTarget > nProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > nTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -943,6 +1617,8 @@ int GetTotalBlocksEstimate()
 
 bool IsInitialBlockDownload()
 {
+    if (fImporting)
+        return true;
     if (pindexBest == NULL || nBestHeight < (GetTotalBlocksEstimate()-nInitialBlockThreshold))
         return true;
     static int64 nLastUpdate;
@@ -958,15 +1634,15 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainWork > bnBestInvalidWork)
+    if (pindexNew->nChainWork > nBestInvalidWork)
     {
-        bnBestInvalidWork = pindexNew->bnChainWork;
-        CTxDB().WriteBestInvalidWork(bnBestInvalidWork);
+        nBestInvalidWork = pindexNew->nChainWork;
+        CTxDB().WriteBestInvalidWork(nBestInvalidWork);
         MainFrameRepaint();
     }
-    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, pindexNew->bnChainWork.ToString().c_str());
-    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    printf("InvalidChainFound: invalid block=%s  height=%d  log2_work=%.8g\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, log(pindexNew->nChainWork.getdouble())/log(2.0));
+    printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0));
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1015,7 +1691,8 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
-                                 CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee)
+                                 CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee,
+                                 vector<CSigCheck>* pvChecks) const
 {
     // Take over previous transactions' spent pointers
     if (!IsCoinBase())
@@ -1046,12 +1723,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
             if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
             {
                 // Get prev tx from single transactions in memory
-                CRITICAL_BLOCK(cs_mapTransactions)
-                {
-                    if (!mapTransactions.count(prevout.hash))
-                        return error("ConnectInputs() : %s mapTransactions prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                    txPrev = mapTransactions[prevout.hash];
-                }
+                if (!mempool.Lookup(prevout.hash, txPrev))
+                    return error("ConnectInputs() : %s mempool prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
                 if (!fFound)
                     txindex.vSpent.resize(txPrev.vout.size());
             }
@@ -1073,7 +1746,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                         return error("ConnectInputs() : tried to spend coinbase at depth %d", pindexBlock->nHeight - pindex->nHeight);
 
             // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
+            // With pvChecks, standard signatures are left for the caller to check
+            if (!VerifySignature(txPrev, *this, i, 0, pvChecks))
                 return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
             // Check for conflicts
@@ -1136,16 +1810,17 @@ bool CTransaction::ClientConnectInputs()
         return false;
 
     // Take over previous transactions' spent pointers
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         int64 nValueIn = 0;
         for (int i = 0; i < vin.size(); i++)
         {
             // Get prev tx from single transactions in memory
             COutPoint prevout = vin[i].prevout;
-            if (!mapTransactions.count(prevout.hash))
+            boost::shared_ptr<const CTransaction> ptxPrev = mempool.Get(prevout.hash);
+            if (!ptxPrev)
                 return false;
-            CTransaction& txPrev = mapTransactions[prevout.hash];
+            const CTransaction& txPrev = *ptxPrev;
 
             if (prevout.n >= txPrev.vout.size())
                 return false;
@@ -1204,20 +1879,32 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     if (!CheckBlock(pindex->nHeight))
         return false;
 
+    int64 nHashesStart = GetTransactionHashCount();
+
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(*this, SER_DISK|SER_BLOCKHEADERONLY) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapUnused;
     int64 nFees = 0;
+    vector<CSigCheck> vChecks;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK);
 
-        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex, nFees, true, false))
+        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex, nFees, true, false, 0, &vChecks))
             return false;
     }
 
+    // The block's signatures are independent of each other, check them all at once
+    vector<unsigned char> vfValid;
+    if (!CKey::VerifyBatch(vChecks, vfValid))
+    {
+        for (unsigned int i = 0; i < vfValid.size(); i++)
+            if (!vfValid[i])
+                return error("ConnectBlock() : signature %u of %u failed", i, vChecks.size());
+    }
+
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return false;
 
@@ -1235,6 +1922,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
 
+    if (fDebug)
+        printf("ConnectBlock() : %d transactions, %"PRI64d" transaction hashes computed\n", vtx.size(), GetTransactionHashCount() - nHashesStart);
+
     return true;
 }
 
@@ -1325,8 +2015,79 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Delete redundant memory transactions that are in the connected branch
     BOOST_FOREACH(CTransaction& tx, vDelete)
+    {
         tx.RemoveFromMemoryPool();
+        mempool.RemoveConflicts(tx);
+    }
+
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Batched block index writes
+//
+
+static unsigned int nBatchBlocks = 0;
+static uint64 nBatchBytes = 0;
+static unsigned int nBatchFileFirst = 1;
+static int64 nBatchStartTime = 0;
+static unsigned int nBatchBlocksTotal = 0;
+static int64 nBatchMillisTotal = 0;
+
+bool static UseBlockIndexBatch()
+{
+    return GetArg("-dbbatch", DEFAULT_DB_BATCH_BLOCKS) > 0 && IsInitialBlockDownload();
+}
+
+void static BeginBlockIndexBatch(const CBlockIndex* pindexNew)
+{
+    BeginTxDBBatch();
+    nBatchBlocks = 0;
+    nBatchBytes = 0;
+    nBatchFileFirst = pindexNew->nFile;
+    nBatchStartTime = GetTimeMillis();
+}
+
+bool static SyncBlockFile(unsigned int nFile)
+{
+    FILE* file = OpenBlockFile(nFile, 0, "rb+");
+    if (!file)
+        return false;
+#ifdef __WXMSW__
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+    fclose(file);
+    return true;
+}
 
+bool FlushBlockIndexBatch()
+{
+    if (!IsTxDBBatch())
+        return true;
+
+    // Block data has to be on disk before the index that points at it
+    for (unsigned int nFile = nBatchFileFirst; SyncBlockFile(nFile); nFile++)
+        ;
+
+    int64 nStart = GetTimeMillis();
+    CTxDB txdb;
+    if (!txdb.FlushBatch())
+        return error("FlushBlockIndexBatch() : FlushBatch failed");
+    txdb.Close();
+
+    int64 nNow = GetTimeMillis();
+    nBatchBlocksTotal += nBatchBlocks;
+    nBatchMillisTotal += nNow - nBatchStartTime;
+    printf("FlushBlockIndexBatch() : %u blocks (%"PRI64u" bytes) up to height %d, write %"PRI64d"ms, %.1f blocks/s, %.1f blocks/s overall\n",
+           nBatchBlocks, nBatchBytes, nBestHeight, nNow - nStart,
+           nBatchBlocks * 1000.0 / max((int64)1, nNow - nBatchStartTime),
+           nBatchBlocksTotal * 1000.0 / max((int64)1, nBatchMillisTotal));
+    nBatchBlocks = 0;
+    nBatchBytes = 0;
     return true;
 }
 
@@ -1335,6 +2096,11 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     uint256 hash = GetHash();
 
+    // During the initial download blocks are connected against an in-memory
+    // batch that's written to blkindex.dat every so often
+    if (!IsTxDBBatch() && UseBlockIndexBatch())
+        BeginBlockIndexBatch(pindexNew);
+
     txdb.TxnBegin();
     if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
     {
@@ -1358,9 +2124,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         // Add to current best branch
         pindexNew->pprev->pnext = pindexNew;
 
-        // Delete redundant memory transactions
+        // Delete redundant memory transactions, and any they double spend
         BOOST_FOREACH(CTransaction& tx, vtx)
+        {
             tx.RemoveFromMemoryPool();
+            mempool.RemoveConflicts(tx);
+        }
     }
     else
     {
@@ -1384,10 +2153,20 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     hashBestChain = hash;
     pindexBest = pindexNew;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexNew->bnChainWork;
+    nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
-    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
+    printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0));
+
+    if (IsTxDBBatch())
+    {
+        nBatchBlocks++;
+        nBatchBytes += ::GetSerializeSize(*this, SER_DISK);
+        if (nBatchBlocks >= GetArg("-dbbatch", DEFAULT_DB_BATCH_BLOCKS) ||
+            nBatchBytes >= (uint64)GetArg("-dbbatchsize", DEFAULT_DB_BATCH_SIZE) * 1000000 ||
+            !IsInitialBlockDownload())
+            FlushBlockIndexBatch();
+    }
 
     return true;
 }
@@ -1412,7 +2191,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
-    pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
 
     CTxDB txdb;
     txdb.TxnBegin();
@@ -1421,7 +2200,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return false;
 
     // New best
-    if (pindexNew->bnChainWork > bnBestChainWork)
+    if (pindexNew->nChainWork > nBestChainWork)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -1611,6 +2390,183 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// mapOrphanBlocks
+//
+
+string static OrphanBlockPath(const uint256& hash)
+{
+    return strprintf("%s/orphanblocks/%s.dat", GetDataDir().c_str(), hash.GetHex().c_str());
+}
+
+bool static SpillOrphanBlock(const uint256& hash, COrphanBlock& orphan)
+{
+    // Whatever was left from the last run goes the first time through
+    static bool fDirReady;
+    if (!fDirReady)
+    {
+        try
+        {
+            filesystem::path pathDir(GetDataDir() + "/orphanblocks");
+            filesystem::remove_all(pathDir);
+            filesystem::create_directory(pathDir);
+        }
+        catch (std::exception& e)
+        {
+            return error("SpillOrphanBlock() : %s", e.what());
+        }
+        fDirReady = true;
+    }
+
+    CAutoFile fileout = fopen(OrphanBlockPath(hash).c_str(), "wb");
+    if (!fileout)
+        return error("SpillOrphanBlock() : open failed");
+    try
+    {
+        fileout << *orphan.pblock;
+    }
+    catch (std::exception& e)
+    {
+        return error("SpillOrphanBlock() : %s", e.what());
+    }
+    nOrphanBlockMemory -= orphan.nSize;
+    orphan.pblock.reset();
+    return true;
+}
+
+bool static ReadOrphanBlock(const uint256& hash, CBlock& block)
+{
+    map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hash);
+    if (mi == mapOrphanBlocks.end())
+        return false;
+    if ((*mi).second.pblock)
+    {
+        block = *(*mi).second.pblock;
+        return true;
+    }
+
+    CAutoFile filein = fopen(OrphanBlockPath(hash).c_str(), "rb");
+    if (!filein)
+        return error("ReadOrphanBlock() : open failed");
+    try
+    {
+        filein >> block;
+    }
+    catch (std::exception& e)
+    {
+        return error("ReadOrphanBlock() : %s", e.what());
+    }
+    if (block.GetHash() != hash)
+        return error("ReadOrphanBlock() : hash doesn't match");
+    return true;
+}
+
+void static EraseOrphanBlock(const uint256& hash)
+{
+    map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hash);
+    if (mi == mapOrphanBlocks.end())
+        return;
+    COrphanBlock& orphan = (*mi).second;
+    for (multimap<uint256, uint256>::iterator it = mapOrphanBlocksByPrev.lower_bound(orphan.hashPrev);
+         it != mapOrphanBlocksByPrev.upper_bound(orphan.hashPrev);
+         ++it)
+    {
+        if ((*it).second == hash)
+        {
+            mapOrphanBlocksByPrev.erase(it);
+            break;
+        }
+    }
+    nOrphanBlockBytes -= orphan.nSize;
+    if (orphan.pblock)
+        nOrphanBlockMemory -= orphan.nSize;
+    else
+    {
+        try
+        {
+            filesystem::remove(OrphanBlockPath(hash));
+        }
+        catch (std::exception& e)
+        {
+            printf("EraseOrphanBlock() : %s\n", e.what());
+        }
+    }
+    mapOrphanBlocks.erase(mi);
+}
+
+int static OrphanBlockDistance(const uint256& hash)
+{
+    // Only the headers-first download knows where an orphan sits, anything
+    // else counts as far away
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return (*mi).second->nHeight - nBestHeight;
+    return INT_MAX;
+}
+
+void static LimitOrphanBlocks()
+{
+    unsigned int nMaxCount = max((int64)1, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS));
+    uint64 nMaxBytes = (uint64)max((int64)1, GetArg("-maxorphanblocksize", DEFAULT_MAX_ORPHAN_BLOCK_SIZE)) * 1000000;
+
+    // Drop the ones furthest from the tip, oldest first among equals
+    while (mapOrphanBlocks.size() > nMaxCount || nOrphanBlockBytes > nMaxBytes)
+    {
+        map<uint256, COrphanBlock>::iterator miEvict = mapOrphanBlocks.end();
+        int nEvictDistance = 0;
+        for (map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+        {
+            int nDistance = OrphanBlockDistance((*mi).first);
+            if (miEvict == mapOrphanBlocks.end() || nDistance > nEvictDistance ||
+                (nDistance == nEvictDistance && (*mi).second.nTimeReceived < (*miEvict).second.nTimeReceived))
+            {
+                miEvict = mi;
+                nEvictDistance = nDistance;
+            }
+        }
+        printf("LimitOrphanBlocks() : evicting orphan block %s\n", (*miEvict).first.ToString().substr(0,20).c_str());
+        EraseOrphanBlock((*miEvict).first);
+    }
+
+    // Keep the newest bodies in memory, they're the likeliest to connect soon
+    while (nOrphanBlockMemory > MAX_ORPHAN_BLOCK_MEMORY)
+    {
+        map<uint256, COrphanBlock>::iterator miOldest = mapOrphanBlocks.end();
+        for (map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+            if ((*mi).second.pblock && (miOldest == mapOrphanBlocks.end() || (*mi).second.nTimeReceived < (*miOldest).second.nTimeReceived))
+                miOldest = mi;
+        if (miOldest == mapOrphanBlocks.end() || !SpillOrphanBlock((*miOldest).first, (*miOldest).second))
+            break;
+    }
+}
+
+void static AddOrphanBlock(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    if (mapOrphanBlocks.count(hash))
+        return;
+    COrphanBlock& orphan = mapOrphanBlocks[hash];
+    orphan.hashPrev = block.hashPrevBlock;
+    orphan.nSize = ::GetSerializeSize(block, SER_DISK);
+    orphan.nTimeReceived = GetTimeMillis();
+    orphan.pblock.reset(new CBlock(block));
+    mapOrphanBlocksByPrev.insert(make_pair(block.hashPrevBlock, hash));
+    nOrphanBlockBytes += orphan.nSize;
+    nOrphanBlockMemory += orphan.nSize;
+    LimitOrphanBlocks();
+}
+
+void GetOrphanBlockStats(unsigned int& nCountRet, uint64& nBytesRet, uint64& nMemoryRet)
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        nCountRet = mapOrphanBlocks.size();
+        nBytesRet = nOrphanBlockBytes;
+        nMemoryRet = nOrphanBlockMemory;
+    }
+}
+
 bool static ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     // Check for duplicate
@@ -1630,13 +2586,12 @@ bool static ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        AddOrphanBlock(*pblock);
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+        // Ask this guy to fill in what we're missing, unless the
+        // headers-first download is already fetching it
+        if (pfrom && !mapHeaderIndex.count(hash) && mapOrphanBlocks.count(hash))
+            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(hash));
         return true;
     }
 
@@ -1650,17 +2605,18 @@ bool static ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+        vector<uint256> vOrphans;
+        for (multimap<uint256, uint256>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vOrphans.push_back((*mi).second);
+        BOOST_FOREACH(const uint256& hashOrphan, vOrphans)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            delete pblockOrphan;
+            CBlock blockOrphan;
+            if (ReadOrphanBlock(hashOrphan, blockOrphan) && blockOrphan.AcceptBlock())
+                vWorkQueue.push_back(hashOrphan);
+            EraseOrphanBlock(hashOrphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     printf("ProcessBlock: ACCEPTED\n");
@@ -1671,6 +2627,276 @@ bool static ProcessBlock(CNode* pfrom, CBlock* pblock)
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first download (-headersfirst)
+//
+// The header chain is fetched from one peer and checked on its own,
+// aux pow included, before any block bodies are asked for.  Blocks along
+// the best header chain are then requested from every full node, at most
+// MAX_BLOCKS_IN_FLIGHT_PER_PEER each and no further than
+// BLOCK_DOWNLOAD_WINDOW past our best block.  A request that isn't answered
+// in BLOCK_STALL_TIMEOUT goes back to the pool for a different peer.
+//
+// Headers we don't have blocks for live in mapHeaderIndex, apart from
+// mapBlockIndex, and are thrown away once the download has caught up.
+//
+
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+static const int64 BLOCK_STALL_TIMEOUT = 60;
+static const int64 HEADERS_SYNC_TIMEOUT = 2 * 60;
+
+// Past this many headers in mapHeaderIndex only ones extending the best
+// header chain are taken, so peers feeding us forks can't grow it forever
+static const unsigned int MAX_HEADER_INDEX_SIZE = 200000;
+
+vector<CBlockIndex*> vBlocksToFetch;
+unsigned int nBlocksToFetchStart = 0;
+
+class CBlockInFlight
+{
+public:
+    int nPeerId;
+    int64 nTime;
+};
+map<uint256, CBlockInFlight> mapBlocksInFlight;
+map<int, int> mapPeerBlocksInFlight;
+map<uint256, int> mapBlockStalledBy;
+
+int nHeadersSyncPeer = -1;
+int64 nHeadersSyncTime = 0;
+
+bool static IsHeadersFirst()
+{
+    return GetBoolArg("-headersfirst") && !fClient;
+}
+
+CBlockIndex static * GetBestHeader()
+{
+    if (pindexBestHeader && (!pindexBest || pindexBestHeader->nChainWork > pindexBest->nChainWork))
+        return pindexBestHeader;
+    return pindexBest;
+}
+
+int GetBestHeaderHeight()
+{
+    // FinishHeadersFirst frees the header index under cs_main
+    CRITICAL_BLOCK(cs_main)
+    {
+        CBlockIndex* pindex = GetBestHeader();
+        return (pindex ? pindex->nHeight : -1);
+    }
+    return -1;
+}
+
+CBlockIndex static * LookupHeader(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return (*mi).second;
+    return NULL;
+}
+
+bool AcceptBlockHeader(const CBlock& header)
+{
+    // requires cs_main
+    uint256 hash = header.GetHash();
+    if (LookupHeader(hash))
+        return true;
+
+    CBlockIndex* pindexPrev = LookupHeader(header.hashPrevBlock);
+    if (!pindexPrev)
+        return error("AcceptBlockHeader() : prev header not found");
+    if (mapHeaderIndex.size() >= MAX_HEADER_INDEX_SIZE && pindexPrev != GetBestHeader())
+        return error("AcceptBlockHeader() : header index full");
+    int nHeight = pindexPrev->nHeight+1;
+
+    // The header checks CheckBlock and AcceptBlock will make again with the body
+    if (!header.CheckProofOfWork(nHeight))
+        return error("AcceptBlockHeader() : proof of work failed");
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.nBits != GetNextWorkRequired(pindexPrev))
+        return error("AcceptBlockHeader() : incorrect proof of work");
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return error("AcceptBlockHeader() : block's timestamp is too early");
+
+    CBlockIndex* pindexNew = new CBlockIndex(0, 0, header);
+    if (!pindexNew)
+        return error("AcceptBlockHeader() : new CBlockIndex failed");
+    // Checked now, and it comes again with the block, so don't hold on to it
+    pindexNew->auxpow.reset();
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork();
+
+    if (!pindexBestHeader || pindexNew->nChainWork > pindexBestHeader->nChainWork)
+        pindexBestHeader = pindexNew;
+    return true;
+}
+
+void static UpdateBlocksToFetch()
+{
+    // Everything on the best header chain that we don't have a block for,
+    // lowest first.  Anything with its block in mapBlockIndex has all its
+    // ancestors there too, so the walk stops at the first one.
+    vBlocksToFetch.clear();
+    nBlocksToFetchStart = 0;
+    CBlockIndex* pindexHeader = GetBestHeader();
+    if (pindexHeader == pindexBest)
+        return;
+    for (CBlockIndex* pindex = pindexHeader; pindex && !mapBlockIndex.count(pindex->GetBlockHash()); pindex = pindex->pprev)
+        vBlocksToFetch.push_back(pindex);
+    reverse(vBlocksToFetch.begin(), vBlocksToFetch.end());
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi != mapBlocksInFlight.end())
+    {
+        if (--mapPeerBlocksInFlight[(*mi).second.nPeerId] <= 0)
+            mapPeerBlocksInFlight.erase((*mi).second.nPeerId);
+        mapBlocksInFlight.erase(mi);
+    }
+    mapBlockStalledBy.erase(hash);
+}
+
+void FinishHeadersFirst()
+{
+    // requires cs_main
+    // Caught up with the best header chain, the rest is ordinary relay
+    if (mapHeaderIndex.empty())
+        return;
+    printf("FinishHeadersFirst() : download complete at height %d\n", nBestHeight);
+    BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+        delete item.second;
+    mapHeaderIndex.clear();
+    pindexBestHeader = NULL;
+    vBlocksToFetch.clear();
+    nBlocksToFetchStart = 0;
+    mapBlocksInFlight.clear();
+    mapPeerBlocksInFlight.clear();
+    mapBlockStalledBy.clear();
+}
+
+void static ProcessHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    int nAccepted = 0;
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        if (!AcceptBlockHeader(header))
+        {
+            printf("ProcessHeaders() : bad header from peer %d, stopping at %s\n", pfrom->id, header.GetHash().ToString().substr(0,20).c_str());
+            if (pfrom->id == nHeadersSyncPeer)
+                nHeadersSyncPeer = -1;
+            break;
+        }
+        nAccepted++;
+    }
+    if (nAccepted > 0)
+        UpdateBlocksToFetch();
+    printf("ProcessHeaders() : %d of %d headers from peer %d, best header height %d\n", nAccepted, vHeaders.size(), pfrom->id, GetBestHeaderHeight());
+
+    if (pfrom->id != nHeadersSyncPeer || nAccepted < vHeaders.size())
+        return;
+    if (vHeaders.size() >= MAX_HEADERS_RESULTS)
+    {
+        // There's more, carry on from the last one
+        pfrom->PushMessage("getheaders", CBlockLocator(LookupHeader(vHeaders.back().GetHash())), uint256(0));
+        nHeadersSyncTime = GetTime();
+    }
+    else
+    {
+        nHeadersSyncPeer = -1;
+    }
+}
+
+void static RequestHeaders(CNode* pto)
+{
+    // One peer at a time fetches headers; a quiet one gets replaced
+    if (pto->fClient || pto->nStartingHeight <= GetBestHeaderHeight())
+        return;
+    if (nHeadersSyncPeer != -1 && GetTime() - nHeadersSyncTime < HEADERS_SYNC_TIMEOUT)
+        return;
+    nHeadersSyncPeer = pto->id;
+    nHeadersSyncTime = GetTime();
+    printf("RequestHeaders() : asking peer %d for headers from height %d\n", pto->id, GetBestHeaderHeight());
+    pto->PushMessage("getheaders", CBlockLocator(GetBestHeader()), uint256(0));
+}
+
+void static RequestBlocks(CNode* pto)
+{
+    if (pto->fClient || vBlocksToFetch.empty())
+        return;
+    int64 nNow = GetTime();
+
+    // Give stalled requests back to the pool, remembering who stalled
+    for (map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end();)
+    {
+        if (nNow - (*mi).second.nTime > BLOCK_STALL_TIMEOUT)
+        {
+            printf("RequestBlocks() : block %s stalled at peer %d\n", (*mi).first.ToString().substr(0,20).c_str(), (*mi).second.nPeerId);
+            mapBlockStalledBy[(*mi).first] = (*mi).second.nPeerId;
+            if (--mapPeerBlocksInFlight[(*mi).second.nPeerId] <= 0)
+                mapPeerBlocksInFlight.erase((*mi).second.nPeerId);
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            mi++;
+    }
+
+    // Skip what's been connected since
+    while (nBlocksToFetchStart < vBlocksToFetch.size() && vBlocksToFetch[nBlocksToFetchStart]->nHeight <= nBestHeight)
+        nBlocksToFetchStart++;
+    if (nBlocksToFetchStart >= vBlocksToFetch.size())
+    {
+        FinishHeadersFirst();
+        return;
+    }
+
+    int nInFlight = (mapPeerBlocksInFlight.count(pto->id) ? mapPeerBlocksInFlight[pto->id] : 0);
+    int nMaxHeight = nBestHeight + BLOCK_DOWNLOAD_WINDOW;
+    vector<CInv> vGetData;
+    for (unsigned int i = nBlocksToFetchStart; i < vBlocksToFetch.size() && nInFlight < MAX_BLOCKS_IN_FLIGHT_PER_PEER; i++)
+    {
+        CBlockIndex* pindex = vBlocksToFetch[i];
+        if (pindex->nHeight > nMaxHeight || pindex->nHeight > pto->nStartingHeight)
+            break;
+        uint256 hash = pindex->GetBlockHash();
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) ||
+            downloadscheduler.IsInFlight(CInv(MSG_BLOCK, hash)))
+            continue;
+        map<uint256, int>::iterator it = mapBlockStalledBy.find(hash);
+        if (it != mapBlockStalledBy.end() && (*it).second == pto->id)
+            continue;
+
+        CBlockInFlight& inflight = mapBlocksInFlight[hash];
+        inflight.nPeerId = pto->id;
+        inflight.nTime = nNow;
+        nInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+    if (vGetData.empty())
+        return;
+    mapPeerBlocksInFlight[pto->id] = nInFlight;
+    if (fDebug)
+        printf("RequestBlocks() : asking peer %d for %d blocks from height %d\n", pto->id, vGetData.size(), vBlocksToFetch[nBlocksToFetchStart]->nHeight);
+    pto->PushMessage("getdata", vGetData);
+}
+
+
+
+
+
+
 
 
 
@@ -1715,6 +2941,179 @@ bool static ScanMessageStart(Stream& s)
     }
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block import
+//
+
+// Importing a bootstrap file: one thread reads and frames the file, a few
+// more deserialize and hash the blocks, and the caller feeds them through
+// ProcessBlock in file order.  Blocks connect through the batched index
+// writes, as during the initial download.
+
+static const unsigned int IMPORT_MAX_IN_FLIGHT = 256;
+static const unsigned int IMPORT_READ_BUFFER = 4 * 1024 * 1024;
+
+class CBlockImport
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable condRead;     // room for the reader
+    boost::condition_variable condRaw;      // raw blocks for the decoders
+    boost::condition_variable condDecoded;  // decoded blocks for the caller
+    deque<pair<unsigned int, boost::shared_ptr<CDataStream> > > queueRaw;
+    map<unsigned int, boost::shared_ptr<CBlock> > mapDecoded;
+    unsigned int nRead;
+    unsigned int nConsumed;
+    bool fReadDone;
+    bool fAbort;
+
+    CBlockImport()
+    {
+        nRead = 0;
+        nConsumed = 0;
+        fReadDone = false;
+        fAbort = false;
+    }
+};
+
+void static ThreadImportRead(CBlockImport* pimport, FILE* file)
+{
+    setvbuf(file, NULL, _IOFBF, IMPORT_READ_BUFFER);
+    CAutoFile filein = file;
+    try
+    {
+        while (!fShutdown && ScanMessageStart(filein))
+        {
+            unsigned int nSize;
+            filein >> nSize;
+            if (nSize < 80 || nSize > MAX_SIZE)
+                continue;
+            boost::shared_ptr<CDataStream> pss(new CDataStream(SER_DISK));
+            pss->resize(nSize);
+            filein.read(&(*pss)[0], nSize);
+
+            boost::unique_lock<boost::mutex> lock(pimport->mutex);
+            while (pimport->nRead - pimport->nConsumed >= IMPORT_MAX_IN_FLIGHT && !pimport->fAbort)
+                pimport->condRead.wait(lock);
+            if (pimport->fAbort)
+                break;
+            pimport->queueRaw.push_back(make_pair(pimport->nRead++, pss));
+            pimport->condRaw.notify_one();
+        }
+    }
+    catch (std::exception& e)
+    {
+        printf("ThreadImportRead() : %s\n", e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(pimport->mutex);
+    pimport->fReadDone = true;
+    pimport->condRaw.notify_all();
+    pimport->condDecoded.notify_all();
+}
+
+void static ThreadImportDecode(CBlockImport* pimport)
+{
+    loop
+    {
+        unsigned int nSeq;
+        boost::shared_ptr<CDataStream> pss;
+        {
+            boost::unique_lock<boost::mutex> lock(pimport->mutex);
+            while (pimport->queueRaw.empty() && !pimport->fReadDone && !pimport->fAbort)
+                pimport->condRaw.wait(lock);
+            if (pimport->queueRaw.empty() || pimport->fAbort)
+                return;
+            nSeq = pimport->queueRaw.front().first;
+            pss = pimport->queueRaw.front().second;
+            pimport->queueRaw.pop_front();
+        }
+
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        try
+        {
+            *pss >> *pblock;
+            // Fills the transaction hash caches while we're off the main
+            // thread.  The decoders already run side by side, so hash here
+            // rather than in BuildMerkleTree's threads, and add to the hash
+            // count once per block instead of once per transaction.
+            int nHashed = 0;
+            BOOST_FOREACH(const CTransaction& tx, pblock->vtx)
+                if (tx.CacheHash())
+                    nHashed++;
+            AddTransactionHashes(nHashed);
+            pblock->BuildMerkleTree();
+            pblock->GetHash();
+        }
+        catch (std::exception& e)
+        {
+            printf("ThreadImportDecode() : %s\n", e.what());
+            pblock.reset();
+        }
+
+        boost::unique_lock<boost::mutex> lock(pimport->mutex);
+        pimport->mapDecoded[nSeq] = pblock;
+        pimport->condDecoded.notify_all();
+    }
+}
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64 nStart = GetTimeMillis();
+    int nLoaded = 0;
+    unsigned int nRecords = 0;
+    fImporting = true;
+
+    CBlockImport import;
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(ThreadImportRead, &import, fileIn));
+    unsigned int nThreads = max(1, (int)boost::thread::hardware_concurrency() - 1);
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(ThreadImportDecode, &import));
+
+    loop
+    {
+        boost::shared_ptr<CBlock> pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(import.mutex);
+            while (!import.mapDecoded.count(import.nConsumed) && !(import.fReadDone && import.nConsumed >= import.nRead))
+                import.condDecoded.wait(lock);
+            if (!import.mapDecoded.count(import.nConsumed))
+                break;
+            pblock = import.mapDecoded[import.nConsumed];
+            import.mapDecoded.erase(import.nConsumed++);
+            import.condRead.notify_one();
+        }
+        nRecords++;
+
+        if (pblock)
+        {
+            CRITICAL_BLOCK(cs_main)
+                if (!mapBlockIndex.count(pblock->GetHash()) && ProcessBlock(NULL, pblock.get()))
+                    nLoaded++;
+        }
+        if (fShutdown)
+            break;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(import.mutex);
+        import.fAbort = true;
+        import.condRead.notify_all();
+        import.condRaw.notify_all();
+    }
+    threads.join_all();
+    fImporting = false;
+
+    CRITICAL_BLOCK(cs_main)
+        FlushBlockIndexBatch();
+
+    int64 nElapsed = max((int64)1, GetTimeMillis() - nStart);
+    printf("Loaded %d of %u blocks from external file in %"PRI64d"ms, %.1f blocks/s\n", nLoaded, nRecords, nElapsed, nLoaded * 1000.0 / nElapsed);
+    return nLoaded > 0;
+}
+
 bool CheckDiskSpace(uint64 nAdditionalBytes)
 {
     uint64 nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
@@ -1792,7 +3191,7 @@ bool LoadBlockIndex(bool fAllowNew)
             printf("testnet original hashGenesisBlock assigned for ver 2.20.0 \n");
         }
         //bnProofOfWorkLimit = CBigNum(~uint256(0) >> 28);
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> GetArgIntxx(28,"-ProofOfWorkLimit"));
+        nProofOfWorkLimit = ~uint256(0) >> GetArgIntxx(28,"-ProofOfWorkLimit");
         pchMessageStart[0] = GetCharArg(0xfa,"-pscMessageStart0");
         pchMessageStart[1] = GetCharArg(0xbf,"-pscMessageStart1");
         pchMessageStart[2] = GetCharArg(0xb5,"-pscMessageStart2");
@@ -1913,7 +3312,7 @@ bool LoadBlockIndex(bool fAllowNew)
        {       
            // This will figure out a valid hash and Nonce if you're
            // creating a different genesis block:
-           uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+           uint256 hashTarget = uint256().SetCompact(block.nBits);
            while (block.GetHash() > hashTarget)
            {
                ++block.nNonce;
@@ -2064,7 +3463,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = "WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.";
@@ -2156,7 +3555,7 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
     {
-    case MSG_TX:    return mapTransactions.count(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
+    case MSG_TX:    return mempool.Exists(inv.hash) || HaveOrphanTx(inv.hash) || txdb.ContainsTx(inv.hash);
     case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
@@ -2172,6 +3571,55 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 char pchMessageStart[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
 
 
+void static ProcessGetData(CNode* pfrom)
+{
+    // Stop once the replies pass SendBufferPauseSize(), the rest is served
+    // from ProcessMessages after the socket thread drains vSend
+    while (!pfrom->vRecvGetData.empty() && pfrom->GetSendSize() < SendBufferPauseSize())
+    {
+        if (fShutdown)
+            return;
+        const CInv inv = pfrom->vRecvGetData.front();
+        pfrom->vRecvGetData.pop_front();
+        printf("received getdata for: %s\n", inv.ToString().c_str());
+
+        if (inv.type == MSG_BLOCK)
+        {
+            // Send block from disk
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+            if (mi != mapBlockIndex.end())
+            {
+                CBlock block;
+                block.ReadFromDisk((*mi).second);
+                pfrom->PushMessage("block", block);
+
+                // Trigger them to send a getblocks request for the next batch of inventory
+                if (inv.hash == pfrom->hashContinue)
+                {
+                    // Bypass PushInventory, this must send even if redundant,
+                    // and we want it right after the last block so they don't
+                    // wait for other stuff first.
+                    vector<CInv> vInv;
+                    vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                    pfrom->PushMessage("inv", vInv);
+                    pfrom->hashContinue = 0;
+                }
+            }
+        }
+        else if (inv.IsKnownType())
+        {
+            // Send stream from relay memory
+            CRelayBufferRef pbuf = relaycache.Get(inv);
+            if (pbuf)
+                pfrom->PushRelayMessage(pbuf);
+        }
+
+        // Track requests for our stuff
+        Inventory(inv.hash);
+    }
+}
+
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<unsigned int, vector<unsigned char> > mapReuseKey;
@@ -2255,7 +3703,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Ask the first connected node for block updates
         static int nAskedForBlocks;
-        if (!pfrom->fClient && (nAskedForBlocks < 1 || vNodes.size() <= 1))
+        if (IsHeadersFirst())
+            RequestHeaders(pfrom);
+        else if (!pfrom->fClient && (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
             nAskedForBlocks++;
             pfrom->PushGetBlocks(pindexBest, uint256(0));
@@ -2364,9 +3814,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
-                pfrom->AskFor(inv);
+                downloadscheduler.Announce(pfrom->id, inv, GetTimeMillis());
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(inv.hash));
 
             // Track requests for our stuff
             Inventory(inv.hash);
@@ -2381,49 +3831,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (vInv.size() > 50000)
             return error("message getdata size() = %d", vInv.size());
 
-        BOOST_FOREACH(const CInv& inv, vInv)
-        {
-            if (fShutdown)
-                return true;
-            printf("received getdata for: %s\n", inv.ToString().c_str());
-
-            if (inv.type == MSG_BLOCK)
-            {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
-                {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
-            }
-            else if (inv.IsKnownType())
-            {
-                // Send stream from relay memory
-                CRITICAL_BLOCK(cs_mapRelay)
-                {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                }
-            }
-
-            // Track requests for our stuff
-            Inventory(inv.hash);
-        }
+        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+        ProcessGetData(pfrom);
     }
 
 
@@ -2502,6 +3911,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > 50000)
+            return error("message headers size() = %d", vHeaders.size());
+        if (IsHeadersFirst())
+            ProcessHeaders(pfrom, vHeaders);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -2512,35 +3932,44 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Whether it was a duplicate falls out of accepting it, which
+        // looks in the pool and the txindex anyway
         bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(true, &fMissingInputs))
+        bool fAlreadyHave = false;
+        bool fOrphan = HaveOrphanTx(inv.hash);
+        bool fAccepted = tx.AcceptToMemoryPool(true, &fMissingInputs, &fAlreadyHave);
+        downloadscheduler.Received(pfrom->id, inv, GetTimeMillis(), fAlreadyHave || fOrphan);
+
+        if (fAccepted)
         {
             SyncWithWallets(tx, NULL, true);
             RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
 
             // Recursively process any orphan transactions that depended on this one
             for (int i = 0; i < vWorkQueue.size(); i++)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
-                     mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
-                     ++mi)
+                vector<CTransaction> vOrphans;
+                GetOrphansSpending(vWorkQueue[i], vOrphans);
+                BOOST_FOREACH(CTransaction& txOrphan, vOrphans)
                 {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
+                    CInv inv(MSG_TX, txOrphan.GetHash());
+                    bool fMissingInputs2 = false;
 
-                    if (tx.AcceptToMemoryPool(true))
+                    if (txOrphan.AcceptToMemoryPool(true, &fMissingInputs2))
                     {
                         printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
+                        SyncWithWallets(txOrphan, NULL, true);
+                        RelayMessage(inv, txOrphan);
+                        downloadscheduler.Forget(inv);
                         vWorkQueue.push_back(inv.hash);
                     }
+                    else if (!fMissingInputs2)
+                    {
+                        // Invalid or a double spend, it's never getting in
+                        EraseOrphanTx(inv.hash);
+                        printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
+                    }
                 }
             }
 
@@ -2549,8 +3978,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         else if (fMissingInputs)
         {
-            printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-            AddOrphanTx(vMsg);
+            if (AddOrphanTx(tx, pfrom->id))
+                printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
+
+            unsigned int nEvicted = LimitOrphanTxSize(max((int64)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS)));
+            if (nEvicted > 0)
+                printf("mapOrphanTransactions overflow, removed %u tx\n", nEvicted);
         }
     }
 
@@ -2565,9 +3998,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        MarkBlockReceived(inv.hash);
+        downloadscheduler.Received(pfrom->id, inv, GetTimeMillis(), mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash));
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
+        ProcessBlock(pfrom, &block);
     }
 
 
@@ -2680,6 +4114,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool ProcessMessages(CNode* pfrom)
 {
+    // Finish serving the last getdata first.  Nothing else is read from this
+    // peer while that is paused, so replies keep their order and a slow peer
+    // fills its receive buffer instead of our send buffer.
+    if (!pfrom->vRecvGetData.empty())
+    {
+        try
+        {
+            CRITICAL_BLOCK(cs_main)
+                ProcessGetData(pfrom);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ProcessGetData()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ProcessGetData()");
+        }
+        if (!pfrom->vRecvGetData.empty())
+            return true;
+    }
+
     CDataStream& vRecv = pfrom->vRecv;
     if (vRecv.empty())
         return true;
@@ -2697,6 +4150,10 @@ bool ProcessMessages(CNode* pfrom)
 
     loop
     {
+        // Leave the rest until a paused getdata is done
+        if (!pfrom->vRecvGetData.empty())
+            break;
+
         // Scan for message start
         CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
         int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
@@ -2752,6 +4209,8 @@ bool ProcessMessages(CNode* pfrom)
             }
         }
 
+        pfrom->RecordRecvMessage(strCommand, nHeaderSize + nMessageSize);
+
         // Copy message to its own buffer
         CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
         vRecv.ignore(nMessageSize);
@@ -2797,7 +4256,7 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+bool SendMessages(CNode* pto)
 {
     CRITICAL_BLOCK(cs_main)
     {
@@ -2806,7 +4265,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             return true;
 
         // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->IsSendEmpty())
             pto->PushMessage("ping");
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -2867,8 +4326,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle)
+        int64 nNow = GetTimeMillis();
+        if (nNow >= pto->nNextAddrSend)
         {
+            pto->nNextAddrSend = PoissonNextSend(nNow, ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -2895,47 +4356,38 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         CRITICAL_BLOCK(pto->cs_inventory)
         {
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            // Blocks go out right away
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        RAND_bytes((unsigned char*)&hashSalt, sizeof(hashSalt));
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
+            }
+            pto->vInventoryToSend.clear();
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+            // Txs wait for the peer's next batch, which hides the order and
+            // timing they reached us in better than trickling them one by one
+            if (nNow >= pto->nNextInvSend)
+            {
+                pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+                unsigned int nSent = 0;
+                while (!pto->vInventoryTxToSend.empty() && nSent < INVENTORY_BROADCAST_MAX)
                 {
-                    vInv.push_back(inv);
+                    uint256 hash = pto->vInventoryTxToSend.front();
+                    pto->vInventoryTxToSend.pop_front();
+                    if (pto->filterInventoryKnown.contains(hash))
+                        continue;
+                    pto->filterInventoryKnown.insert(hash);
+                    vInv.push_back(CInv(MSG_TX, hash));
+                    nSent++;
                     if (vInv.size() >= 1000)
                     {
                         pto->PushMessage("inv", vInv);
@@ -2943,7 +4395,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -2953,26 +4404,39 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
-        int64 nNow = GetTime() * 1000000;
+        vector<CInv> vRequest;
+        downloadscheduler.GetRequests(pto->id, nNow, vRequest);
         CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+        BOOST_FOREACH(const CInv& inv, vRequest)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(txdb, inv))
+            // Arrived some other way meanwhile, or the headers-first
+            // download has already asked for the block
+            if (AlreadyHave(txdb, inv) || (inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
             {
-                printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
-                if (vGetData.size() >= 1000)
-                {
-                    pto->PushMessage("getdata", vGetData);
-                    vGetData.clear();
-                }
+                downloadscheduler.Forget(inv);
+                continue;
+            }
+            printf("sending getdata: %s\n", inv.ToString().c_str());
+            downloadscheduler.MarkRequested(pto->id, inv, nNow);
+            vGetData.push_back(inv);
+            if (vGetData.size() >= 1000)
+            {
+                pto->PushMessage("getdata", vGetData);
+                vGetData.clear();
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        //
+        // Message: getheaders and getdata, headers-first download
+        //
+        if (IsHeadersFirst())
+        {
+            RequestHeaders(pto);
+            RequestBlocks(pto);
+        }
+
     }
     return true;
 }
@@ -3058,11 +4522,11 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     set<uint256> setDependsOn;
     double dPriority;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTransaction* ptxIn)
     {
         ptx = ptxIn;
         dPriority = 0;
@@ -3111,17 +4575,17 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
     // Collect memory pool transactions into the block
     int64 nFees = 0;
     CRITICAL_BLOCK(cs_main)
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         CTxDB txdb("r");
 
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
-        multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        multimap<double, const CTransaction*> mapPriority;
+        for (CTxMemPool::MapTx::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
-            CTransaction& tx = (*mi).second;
+            const CTransaction& tx = *(*mi).second.ptx;
             if (tx.IsCoinBase() || !tx.IsFinal())
                 continue;
 
@@ -3162,7 +4626,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             if (porphan)
                 porphan->dPriority = dPriority;
             else
-                mapPriority.insert(make_pair(-dPriority, &(*mi).second));
+                mapPriority.insert(make_pair(-dPriority, &tx));
 
             if (fDebug && GetBoolArg("-printpriority"))
             {
@@ -3181,7 +4645,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         {
             // Take highest priority transaction off priority queue
             double dPriority = -(*mapPriority.begin()).first;
-            CTransaction& tx = *(*mapPriority.begin()).second;
+            const CTransaction& tx = *(*mapPriority.begin()).second;
             mapPriority.erase(mapPriority.begin());
 
             // Size limits
@@ -3225,6 +4689,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         }
     }
     pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    pblock->vtx[0].InvalidateHash();
 
     // Fill in header
     pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -3247,7 +4712,8 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         nPrevTime = nNow;
     }
     pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(nExtraNonce);
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->vtx[0].InvalidateHash();
+    pblock->hashMerkleRoot = pblock->UpdateMerkleCoinbase();
 }
 
 // Create coinbase with auxiliary data, for multichain mining
@@ -3300,7 +4766,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     CAuxPow *auxpow = pblock->auxpow.get();
 
@@ -3414,7 +4880,7 @@ void static BitcoinMiner(CWallet *pwallet)
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         uint256 hashbuf[2];
         uint256& hash = *alignup<16>(hashbuf);
         loop
@@ -12,6 +12,7 @@
 
 #include <list>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 class CBlock;
 class CBlockIndex;
@@ -42,6 +43,21 @@ static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int64 MIN_TX_FEE = 50000;
 static const int64 MIN_RELAY_TX_FEE = 10000;
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 32;
+static const int64 MEMPOOL_MINFEE_HALFLIFE = 12 * 60 * 60;
+static const unsigned int MEMPOOL_MAX_ANCESTORS = 25;
+static const unsigned int MEMPOOL_MAX_ANCESTOR_SIZE = 101000;
+static const unsigned int MEMPOOL_MAX_DESCENDANTS = 25;
+static const unsigned int MEMPOOL_MAX_DESCENDANT_SIZE = 101000;
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_PER_PEER = 25;
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 1100;
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCK_SIZE = 128;
+static const unsigned int MAX_ORPHAN_BLOCK_MEMORY = 4000000;
+static const unsigned int DEFAULT_DB_BATCH_BLOCKS = 500;
+static const unsigned int DEFAULT_DB_BATCH_SIZE = 16;
 static const int64 MAX_MONEY = 21000000 * COIN;
 inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= GetMaxMoney()); }
 static const int COINBASE_MATURITY = 100;
@@ -59,17 +75,18 @@ static const int fHaveUPnP = false;
 extern CCriticalSection cs_main;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern uint256 hashGenesisBlock;
-extern CBigNum bnProofOfWorkLimit;
+extern uint256 nProofOfWorkLimit;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
-extern CBigNum bnBestChainWork;
-extern CBigNum bnBestInvalidWork;
+extern uint256 nBestChainWork;
+extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
 extern double dHashesPerSec;
 extern int64 nHPSTimerStart;
 extern int64 nTimeBestReceived;
+extern bool fImporting;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 
@@ -94,12 +111,20 @@ class CTxIndex;
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
+int64 GetTransactionHashCount();
+void AddTransactionHashes(int nHashes);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
-bool SendMessages(CNode* pto, bool fSendTrickle);
+void EraseOrphansFor(int nPeerId);
+int GetBestHeaderHeight();
+bool AcceptBlockHeader(const CBlock& header);
+void FinishHeadersFirst();
+void GetOrphanBlockStats(unsigned int& nCountRet, uint64& nBytesRet, uint64& nMemoryRet);
+unsigned int GetOrphanTxCount();
+bool SendMessages(CNode* pto);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime);
@@ -109,6 +134,8 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 int GetTotalBlocksEstimate();
 bool IsInitialBlockDownload();
+bool FlushBlockIndexBatch();
+bool LoadExternalBlockFile(FILE* fileIn);
 std::string GetWarnings(std::string strFor);
 
 
@@ -194,11 +221,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = -1; }
     bool IsNull() const { return (ptx == NULL && n == -1); }
 };
@@ -408,7 +435,15 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+private:
+    // memory only
+    // GetHash is worked out once and kept until the transaction is read
+    // again or changed.  Anything that modifies vin, vout, nVersion or
+    // nLockTime after the hash may have been taken must call InvalidateHash().
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
 
+public:
     CTransaction()
     {
         SetNull();
@@ -416,6 +451,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            fHashCached = false;
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(vin);
@@ -429,6 +466,7 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -436,9 +474,32 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    // Fills the hash cache, returns true if it had to hash.  Not counted in
+    // GetTransactionHashCount, callers tally it themselves.
+    bool CacheHash() const
+    {
+        if (fHashCached)
+            return false;
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+        return true;
+    }
+
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        if (CacheHash())
+            AddTransactionHashes(1);
+        return hashCached;
+    }
+
+    bool IsHashCached() const
+    {
+        return fHashCached;
+    }
+
+    void InvalidateHash()
+    {
+        fHashCached = false;
     }
 
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
@@ -639,13 +700,14 @@ public:
     bool ReadFromDisk(COutPoint prevout);
     bool DisconnectInputs(CTxDB& txdb);
     bool ConnectInputs(CTxDB& txdb, std::map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
-                       CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+                       CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0,
+                       std::vector<CSigCheck>* pvChecks=NULL) const;
     bool ClientConnectInputs();
     bool CheckTransaction() const;
-    bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
-    bool AcceptToMemoryPool(bool fCheckInputs=true, bool* pfMissingInputs=NULL);
+    bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL, bool* pfAlreadyHave=NULL);
+    bool AcceptToMemoryPool(bool fCheckInputs=true, bool* pfMissingInputs=NULL, bool* pfAlreadyHave=NULL);
 protected:
-    bool AddToMemoryPoolUnchecked();
+    bool AddToMemoryPoolUnchecked(int64 nFee=0);
 public:
     bool RemoveFromMemoryPool();
 };
@@ -876,24 +938,12 @@ public:
     }
 
 
-    uint256 BuildMerkleTree() const
-    {
-        vMerkleTree.clear();
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
-        int j = 0;
-        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-        {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
-            j += nSize;
-        }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
-    }
+    uint256 BuildMerkleTree() const;
+
+    // Recompute only the path from vtx[0] to the root, for when nothing but
+    // the coinbase has changed since the last BuildMerkleTree (extra nonce
+    // rolling).  Falls back to a full build if the tree isn't there.
+    uint256 UpdateMerkleCoinbase() const;
 
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
@@ -1036,7 +1086,7 @@ public:
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
-    CBigNum bnChainWork;
+    uint256 nChainWork;
 
     // block header
     int nVersion;
@@ -1057,7 +1107,7 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1067,7 +1117,7 @@ public:
         auxpow.reset();
     }
 
-    CBlockIndex(unsigned int nFileIn, unsigned int nBlockPosIn, CBlock& block)
+    CBlockIndex(unsigned int nFileIn, unsigned int nBlockPosIn, const CBlock& block)
     {
         phashBlock = NULL;
         pprev = NULL;
@@ -1075,7 +1125,7 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1109,13 +1159,17 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        bool fNegative;
+        bool fOverflow;
+        uint256 nTarget;
+        nTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || nTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (nTarget+1) doesn't fit, but it's the same as
+        // (2**256 - nTarget - 1) / (nTarget+1) + 1
+        return (~nTarget / (nTarget + uint256(1))) + uint256(1);
     }
 
     bool IsInMainChain() const
@@ -1598,8 +1652,163 @@ public:
 
 
 
+//
+// Transactions are already uniformly distributed, so the low bits of the
+// hash are as good a bucket index as any
+//
+struct CUint256Hasher
+{
+    size_t operator()(const uint256& hash) const
+    {
+        return (size_t)hash.GetLow64();
+    }
+};
+
+struct COutPointHasher
+{
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return (size_t)(outpoint.hash.GetLow64() ^ ((uint64)outpoint.n * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+
+
+class CTxMemPoolEntry
+{
+public:
+    // Shared and never modified once it's in the pool
+    boost::shared_ptr<const CTransaction> ptx;
+    int64 nFee;
+    unsigned int nTxSize;
+    unsigned int nUsage;
+    int64 nTime;
+
+    // In-pool transactions this one spends from, and ones that spend from it
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+
+    // Totals over this transaction and everything in the pool descending
+    // from it, and the fee per 1000 bytes it's ranked by for eviction
+    int64 nFeesWithDescendants;
+    uint64 nSizeWithDescendants;
+    unsigned int nCountWithDescendants;
+    double dEvictionScore;
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nUsage = 0;
+        nTime = 0;
+        nFeesWithDescendants = 0;
+        nSizeWithDescendants = 0;
+        nCountWithDescendants = 0;
+        dEvictionScore = 0;
+    }
+
+    double GetEvictionScore() const
+    {
+        // A parent paying well isn't dragged down by cheap children, but a
+        // cheap parent is carried by children paying well for both
+        double dOwn = (double)nFee * 1000 / nTxSize;
+        double dPackage = (double)nFeesWithDescendants * 1000 / nSizeWithDescendants;
+        return std::max(dOwn, dPackage);
+    }
+};
+
+
+
+//
+// The memory pool of transactions waiting to get into a block
+//
+class CTxMemPool
+{
+public:
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, CUint256Hasher> MapTx;
+    typedef boost::unordered_map<COutPoint, CInPoint, COutPointHasher> MapNextTx;
+
+    mutable CCriticalSection cs;
+    MapTx mapTx;
+    MapNextTx mapNextTx;
+
+    // Lowest eviction score first
+    std::set<std::pair<double, uint256> > setEvictionScore;
+
+    // Serialized size and estimated memory use of everything in the pool
+    uint64 nBytes;
+    uint64 nUsage;
+    uint64 nMaxUsage;
+
+    // Fee per 1000 bytes needed to get in, raised past whatever was last
+    // evicted and decaying back to nothing once the pool has room
+    mutable int64 nMinFeePerK;
+    mutable int64 nMinFeeUpdated;
+
+    // Running totals since startup; nConflicts counts the removed
+    // transactions that were double spent by a block
+    uint64 nAdded;
+    uint64 nRemoved;
+    uint64 nConflicts;
+    uint64 nEvicted;
+    uint64 nEvictedBytes;
+
+    CTxMemPool()
+    {
+        nBytes = 0;
+        nUsage = 0;
+        nMaxUsage = (uint64)DEFAULT_MAX_MEMPOOL_SIZE * 1000000;
+        nMinFeePerK = 0;
+        nMinFeeUpdated = 0;
+        nAdded = 0;
+        nRemoved = 0;
+        nConflicts = 0;
+        nEvicted = 0;
+        nEvictedBytes = 0;
+    }
+
+    bool AddUnchecked(const CTransaction& tx, int64 nFee);
+    bool Remove(const uint256& hash, bool fRecursive=false);
+    void RemoveConflicts(const CTransaction& tx);
+    void TrimToSize(uint64 nSizeLimit, std::vector<uint256>* pvEvicted=NULL);
+    int64 GetMinFee(unsigned int nBytes) const;
+    bool CheckPackageLimits(const CTransaction& tx, unsigned int nTxSize) const;
+
+    bool Exists(const uint256& hash) const;
+    bool Lookup(const uint256& hash, CTransaction& txRet) const;
+    boost::shared_ptr<const CTransaction> Get(const uint256& hash) const;
+    const CTransaction* GetSpender(const COutPoint& outpoint) const;
+    void QueryHashes(std::vector<uint256>& vHash) const;
+
+    unsigned int Size() const
+    {
+        CRITICAL_BLOCK(cs)
+            return mapTx.size();
+        return 0;
+    }
+
+    static unsigned int GetTxMemoryUsage(const CTransaction& tx);
+
+private:
+    void Link(const uint256& hashParent, const uint256& hashChild);
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors);
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants);
+    void UpdateEvictionScore(const uint256& hash, CTxMemPoolEntry& entry);
+    void UpdatePackage(const uint256& hash, int64 nFee, int64 nSize, int nCount);
+    void RecalculatePackage(const uint256& hash);
+};
+
+
+
+
+
+
+
+
+
+
 
-extern std::map<uint256, CTransaction> mapTransactions;
+extern CTxMemPool mempool;
 extern std::map<uint160, std::vector<unsigned char> > mapPubKeys;
 extern CCriticalSection cs_mapPubKeys;
 
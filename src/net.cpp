@@ -56,12 +56,12 @@ SOCKET hListenSocket = INVALID_SOCKET;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
+int nLastNodeId = 0;
+CCriticalSection cs_nLastNodeId;
 map<vector<unsigned char>, CAddress> mapAddresses;
 CCriticalSection cs_mapAddresses;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
-map<CInv, int64> mapAlreadyAskedFor;
+CRelayCache relaycache;
+CDownloadScheduler downloadscheduler;
 
 // Settings
 int fUseProxy = false;
@@ -93,6 +93,343 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+int64 PoissonNextSend(int64 nNow, int nAverageInterval)
+{
+    // Exponentially distributed gaps, so when a batch goes out says nothing
+    // about when the items in it arrived
+    return nNow + (int64)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageInterval * -1000.0 + 0.5);
+}
+
+static const char* ppszMessageCommand[] =
+{
+    "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders", "headers",
+    "tx", "block", "getaddr", "checkorder", "submitorder", "reply", "ping", "alert",
+};
+
+void CNode::RecordRecvMessage(const std::string& strCommand, unsigned int nSize)
+{
+    // The command comes from the peer, keep anything we don't know under one
+    // entry so the map can't be grown without bound
+    for (unsigned int i = 0; i < ARRAYLEN(ppszMessageCommand); i++)
+    {
+        if (strCommand == ppszMessageCommand[i])
+        {
+            mapRecvStats[strCommand].Add(nSize);
+            return;
+        }
+    }
+    mapRecvStats["*other*"].Add(nSize);
+}
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CRelayCache
+//
+
+void CRelayCache::Add(const CInv& inv, const CDataStream& ss)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        // Expire old relay messages
+        int64 nNow = GetTime();
+        while (!vExpiration.empty() && vExpiration.front().first < nNow)
+        {
+            Erase(vExpiration.front().second);
+            vExpiration.pop_front();
+            nExpired++;
+        }
+
+        // Relayed again, the newer copy replaces the old one but keeps its
+        // expiry, as the first entry in vExpiration would erase it anyway
+        CRelayBufferRef pbuf(new CRelayBuffer(inv, ss));
+        map<CInv, CRelayBufferRef>::iterator mi = mapRelay.find(inv);
+        if (mi != mapRelay.end())
+        {
+            nBytes -= (*mi).second->size();
+            (*mi).second = pbuf;
+        }
+        else
+        {
+            mapRelay[inv] = pbuf;
+            vExpiration.push_back(make_pair(nNow + RELAY_EXPIRY, inv));
+        }
+        nBytes += pbuf->size();
+        nAdded++;
+
+        // Over the cap the oldest go early.  Peers that already queued one
+        // keep their reference until it's sent, they just can't get it again.
+        while (nBytes > nMaxBytes && vExpiration.size() > 1)
+        {
+            Erase(vExpiration.front().second);
+            vExpiration.pop_front();
+            nEvicted++;
+        }
+    }
+}
+
+CRelayBufferRef CRelayCache::Get(const CInv& inv)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CInv, CRelayBufferRef>::iterator mi = mapRelay.find(inv);
+        if (mi != mapRelay.end())
+        {
+            nHits++;
+            return (*mi).second;
+        }
+        nMisses++;
+    }
+    return CRelayBufferRef();
+}
+
+void CRelayCache::Erase(const CInv& inv)
+{
+    map<CInv, CRelayBufferRef>::iterator mi = mapRelay.find(inv);
+    if (mi == mapRelay.end())
+        return;
+    nBytes -= (*mi).second->size();
+    mapRelay.erase(mi);
+}
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CDownloadScheduler
+//
+
+void static UpdateLatency(int64& nAverage, int64 nSample)
+{
+    nAverage = (nAverage < 0 ? nSample : (nAverage * 7 + nSample) / 8);
+}
+
+void CDownloadScheduler::Announce(int nPeerId, const CInv& inv, int64 nNow)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        CPeer& peer = mapPeers[nPeerId];
+        if (peer.setAnnounced.size() >= MAX_PEER_ANNOUNCEMENTS)
+            return;
+        CItem& item = mapItems[inv];
+        if (item.nFirstSeen == 0)
+            item.nFirstSeen = nNow;
+        if (item.nInFlightPeer == nPeerId || item.mapAnnounced.count(nPeerId))
+            return;
+        // Many arrive in the same millisecond, so they're ordered by a
+        // counter rather than the time
+        uint64 nSequence = nAnnounceSequence++;
+        item.mapAnnounced[nPeerId] = nSequence;
+        peer.setAnnounced.insert(make_pair(nSequence, inv));
+    }
+}
+
+void CDownloadScheduler::GetRequests(int nPeerId, int64 nNow, vector<CInv>& vRequestRet)
+{
+    vRequestRet.clear();
+    CRITICAL_BLOCK(cs)
+    {
+        ExpireRequests(nNow);
+        map<int, CPeer>::const_iterator mi = mapPeers.find(nPeerId);
+        if (mi == mapPeers.end())
+            return;
+        const CPeer& peer = (*mi).second;
+
+        // Oldest announcements first, up to the peer's free slots
+        int nSlots = MAX_REQUESTS_IN_FLIGHT_PER_PEER - peer.nInFlight;
+        for (set<pair<uint64, CInv> >::const_iterator it = peer.setAnnounced.begin();
+             it != peer.setAnnounced.end() && (int)vRequestRet.size() < nSlots;
+             ++it)
+        {
+            const CInv& inv = (*it).second;
+            const CItem& item = mapItems[inv];
+
+            // Never ask two peers for the same thing at once
+            if (item.nInFlightPeer != -1)
+                continue;
+
+            // Leave it a moment for a faster peer that has it too
+            if (nNow - item.nFirstSeen < PREFER_FAST_PEER_DELAY && HasFasterPeer(item, nPeerId))
+                continue;
+
+            vRequestRet.push_back(inv);
+        }
+    }
+}
+
+void CDownloadScheduler::MarkRequested(int nPeerId, const CInv& inv, int64 nNow)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CInv, CItem>::iterator mi = mapItems.find(inv);
+        if (mi == mapItems.end())
+            return;
+        CItem& item = (*mi).second;
+        map<int, uint64>::iterator it = item.mapAnnounced.find(nPeerId);
+        if (item.nInFlightPeer != -1 || it == item.mapAnnounced.end())
+            return;
+
+        // Asked once, it's only asked again if it announces it again
+        CPeer& peer = mapPeers[nPeerId];
+        peer.setAnnounced.erase(make_pair((*it).second, inv));
+        item.mapAnnounced.erase(it);
+
+        item.nInFlightPeer = nPeerId;
+        item.nRequestTime = nNow;
+        setInFlight.insert(make_pair(nNow, inv));
+        peer.nInFlight++;
+        peer.nRequested++;
+        nRequested++;
+    }
+}
+
+void CDownloadScheduler::Received(int nPeerId, const CInv& inv, int64 nNow, bool fDuplicate)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (fDuplicate)
+            nDuplicates++;
+        map<CInv, CItem>::iterator mi = mapItems.find(inv);
+        if (mi == mapItems.end())
+            return;
+        CItem& item = (*mi).second;
+        if (item.nInFlightPeer == nPeerId)
+        {
+            CPeer& peer = mapPeers[nPeerId];
+            UpdateLatency(peer.nLatency, nNow - item.nRequestTime);
+            UpdateLatency(nLatency, nNow - item.nRequestTime);
+            peer.nReceived++;
+            nReceived++;
+        }
+
+        // Whoever it came from, nobody needs asking for it now
+        EraseItem(mi);
+    }
+}
+
+void CDownloadScheduler::Forget(const CInv& inv)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CInv, CItem>::iterator mi = mapItems.find(inv);
+        if (mi != mapItems.end())
+            EraseItem(mi);
+    }
+}
+
+void CDownloadScheduler::ForgetPeer(int nPeerId)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<int, CPeer>::iterator mp = mapPeers.find(nPeerId);
+        if (mp == mapPeers.end())
+            return;
+
+        // Its announcements go, and what it was asked for is free for the
+        // others straight away rather than after a timeout
+        vector<CInv> vInv;
+        BOOST_FOREACH(const PAIRTYPE(uint64, CInv)& item, (*mp).second.setAnnounced)
+            vInv.push_back(item.second);
+        BOOST_FOREACH(const PAIRTYPE(int64, CInv)& item, setInFlight)
+            if (mapItems[item.second].nInFlightPeer == nPeerId)
+                vInv.push_back(item.second);
+        BOOST_FOREACH(const CInv& inv, vInv)
+        {
+            map<CInv, CItem>::iterator mi = mapItems.find(inv);
+            if (mi == mapItems.end())
+                continue;
+            CItem& item = (*mi).second;
+            item.mapAnnounced.erase(nPeerId);
+            if (item.nInFlightPeer == nPeerId)
+                ClearInFlight(item, inv);
+            if (item.mapAnnounced.empty() && item.nInFlightPeer == -1)
+                mapItems.erase(mi);
+        }
+        mapPeers.erase(nPeerId);
+    }
+}
+
+bool CDownloadScheduler::IsInFlight(const CInv& inv) const
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CInv, CItem>::const_iterator mi = mapItems.find(inv);
+        return (mi != mapItems.end() && (*mi).second.nInFlightPeer != -1);
+    }
+    return false;
+}
+
+void CDownloadScheduler::ExpireRequests(int64 nNow)
+{
+    while (!setInFlight.empty() && nNow - (*setInFlight.begin()).first > REQUEST_TIMEOUT)
+    {
+        CInv inv = (*setInFlight.begin()).second;
+        map<CInv, CItem>::iterator mi = mapItems.find(inv);
+        CItem& item = (*mi).second;
+        printf("download of %s from peer %d timed out\n", inv.ToString().c_str(), item.nInFlightPeer);
+
+        // Count the timeout against the peer's latency so it loses out to
+        // the ones that answer
+        map<int, CPeer>::iterator mp = mapPeers.find(item.nInFlightPeer);
+        if (mp != mapPeers.end())
+        {
+            UpdateLatency((*mp).second.nLatency, REQUEST_TIMEOUT);
+            (*mp).second.nTimeouts++;
+        }
+        nTimeouts++;
+
+        ClearInFlight(item, inv);
+        if (item.mapAnnounced.empty())
+            mapItems.erase(mi);
+    }
+}
+
+void CDownloadScheduler::ClearInFlight(CItem& item, const CInv& inv)
+{
+    if (item.nInFlightPeer == -1)
+        return;
+    setInFlight.erase(make_pair(item.nRequestTime, inv));
+    map<int, CPeer>::iterator mp = mapPeers.find(item.nInFlightPeer);
+    if (mp != mapPeers.end())
+        (*mp).second.nInFlight--;
+    item.nInFlightPeer = -1;
+}
+
+void CDownloadScheduler::EraseItem(map<CInv, CItem>::iterator mi)
+{
+    const CInv& inv = (*mi).first;
+    CItem& item = (*mi).second;
+    ClearInFlight(item, inv);
+    BOOST_FOREACH(const PAIRTYPE(int, uint64)& announced, item.mapAnnounced)
+    {
+        map<int, CPeer>::iterator mp = mapPeers.find(announced.first);
+        if (mp != mapPeers.end())
+            (*mp).second.setAnnounced.erase(make_pair(announced.second, inv));
+    }
+    mapItems.erase(mi);
+}
+
+bool CDownloadScheduler::HasFasterPeer(const CItem& item, int nPeerId) const
+{
+    map<int, CPeer>::const_iterator mi = mapPeers.find(nPeerId);
+    int64 nLatency = (mi != mapPeers.end() ? (*mi).second.GetLatency() : REQUEST_TIMEOUT);
+    BOOST_FOREACH(const PAIRTYPE(int, uint64)& announced, item.mapAnnounced)
+    {
+        if (announced.first == nPeerId)
+            continue;
+        map<int, CPeer>::const_iterator mp = mapPeers.find(announced.first);
+        if (mp != mapPeers.end() && (*mp).second.nInFlight < MAX_REQUESTS_IN_FLIGHT_PER_PEER &&
+            (*mp).second.GetLatency() < nLatency)
+            return true;
+    }
+    return false;
+}
+
 
 
 
@@ -733,6 +1070,67 @@ void CNode::Cleanup()
 
 
 
+void static SocketSendData(CNode* pnode)
+{
+    // Interleave vSend with the shared relay payloads queued between its
+    // bytes, until everything is sent or the socket won't take more
+    CDataStream& vSend = pnode->vSend;
+    while (!pnode->IsSendEmpty())
+    {
+        bool fRelay = (!pnode->vSendRelay.empty() && pnode->vSendRelay.front().first == pnode->nSendErased);
+        const char* pch;
+        unsigned int nLen;
+        if (fRelay)
+        {
+            const CRelayBuffer& buf = *pnode->vSendRelay.front().second;
+            pch = (buf.vch.empty() ? NULL : &buf.vch[0] + pnode->nSendRelayOffset);
+            nLen = buf.size() - pnode->nSendRelayOffset;
+        }
+        else
+        {
+            pch = &vSend[0];
+            nLen = (pnode->vSendRelay.empty() ? vSend.size() : pnode->vSendRelay.front().first - pnode->nSendErased);
+        }
+
+        int nBytes = (nLen > 0 ? send(pnode->hSocket, pch, nLen, MSG_NOSIGNAL | MSG_DONTWAIT) : 0);
+        if (nBytes < 0)
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                printf("socket send error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+            }
+            return;
+        }
+        if (nBytes > 0)
+        {
+            pnode->nLastSend = GetTime();
+            pnode->nSendBytes += nBytes;
+        }
+
+        if (fRelay)
+        {
+            if ((unsigned int)nBytes == nLen)
+            {
+                pnode->nSendRelaySize -= pnode->vSendRelay.front().second->size();
+                pnode->nSendRelayOffset = 0;
+                pnode->vSendRelay.pop_front();
+            }
+            else
+                pnode->nSendRelayOffset += nBytes;
+        }
+        else
+        {
+            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+            pnode->nSendErased += nBytes;
+        }
+        if ((unsigned int)nBytes < nLen)
+            return;
+    }
+}
+
 void ThreadSocketHandler(void* parg)
 {
     IMPLEMENT_RANDOMIZE_STACK(ThreadSocketHandler(parg));
@@ -770,7 +1168,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->IsSendEmpty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -778,6 +1176,8 @@ void ThreadSocketHandler2(void* parg)
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
                     pnode->Cleanup();
+                    EraseOrphansFor(pnode->id);
+                    downloadscheduler.ForgetPeer(pnode->id);
 
                     // hold in disconnected pool until all refs are released
                     pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
@@ -843,7 +1243,7 @@ void ThreadSocketHandler2(void* parg)
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
+                    if (!pnode->IsSendEmpty())
                         FD_SET(pnode->hSocket, &fdsetSend);
             }
         }
@@ -944,6 +1344,7 @@ void ThreadSocketHandler2(void* parg)
                             vRecv.resize(nPos + nBytes);
                             memcpy(&vRecv[nPos], pchBuf, nBytes);
                             pnode->nLastRecv = GetTime();
+                            pnode->nRecvBytes += nBytes;
                         }
                         else if (nBytes == 0)
                         {
@@ -976,28 +1377,13 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    if (!pnode->IsSendEmpty())
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                        if (vSend.size() > SendBufferSize()) {
+                        SocketSendData(pnode);
+                        unsigned int nSendSize = pnode->GetSendSize();
+                        if (nSendSize > SendBufferSize()) {
                             if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
+                                printf("socket send flood control disconnect (%u bytes)\n", nSendSize);
                             pnode->CloseSocketDisconnect();
                         }
                     }
@@ -1007,7 +1393,7 @@ void ThreadSocketHandler2(void* parg)
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->IsSendEmpty())
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1509,9 +1895,6 @@ void ThreadMessageHandler2(void* parg)
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
@@ -1522,7 +1905,7 @@ void ThreadMessageHandler2(void* parg)
 
             // Send messages
             TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                SendMessages(pnode, pnode == pnodeTrickle);
+                SendMessages(pnode);
             if (fShutdown)
                 return;
         }
@@ -6,6 +6,7 @@
 
 #include <deque>
 #include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef __WXMSW__
@@ -27,9 +28,30 @@ unsigned short GetSendPort();
 
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 10*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 10*1000); }
+inline unsigned int SendBufferPauseSize() { return 1000*GetArg("-pausesendbuffer", GetArg("-maxsendbuffer", 10*1000)/2); }
 
 inline unsigned short GetDefaultPort() { return fTestNet ? 18333 : 8333; }
 static const unsigned int PUBLISH_HOPS = 5;
+
+// Inventory a peer has sent us or we've sent it, remembered per peer
+static const unsigned int INVENTORY_KNOWN_SIZE = 50000;
+// Average seconds between tx inv batches to inbound peers, half that to
+// outbound ones, and the most tx invs sent per batch
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+static const unsigned int INVENTORY_BROADCAST_MAX = 1000;
+// Average seconds between addr messages to each peer
+static const int ADDRESS_BROADCAST_INTERVAL = 30;
+// Relayed messages are kept this long for getdata, up to -maxrelaycache megabytes
+static const int RELAY_EXPIRY = 15 * 60;
+static const unsigned int DEFAULT_MAX_RELAY_CACHE_SIZE = 16;
+// Announced txs and blocks are asked of one peer at a time, at most
+// MAX_REQUESTS_IN_FLIGHT_PER_PEER per peer, and another peer is tried after
+// REQUEST_TIMEOUT milliseconds.  A faster peer that announced the same item
+// gets first go for PREFER_FAST_PEER_DELAY milliseconds.
+static const int MAX_REQUESTS_IN_FLIGHT_PER_PEER = 100;
+static const int64 REQUEST_TIMEOUT = 60 * 1000;
+static const int64 PREFER_FAST_PEER_DELAY = 2 * 1000;
+static const unsigned int MAX_PEER_ANNOUNCEMENTS = 5000;
 enum
 {
     NODE_NETWORK = (1 << 0),
@@ -53,6 +75,7 @@ void DNSAddressSeed();
 bool BindListenPort(std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+int64 PoissonNextSend(int64 nNow, int nAverageInterval);
 
 
 
@@ -450,6 +473,155 @@ public:
 
 
 
+// A relayed message's payload, serialized and checksummed once.  It's never
+// modified, so every peer's send queue can point at the same copy and the
+// socket thread reads it without a lock.
+class CRelayBuffer
+{
+public:
+    const CInv inv;
+    const std::vector<char> vch;
+    unsigned int nChecksum;
+
+    CRelayBuffer(const CInv& invIn, const CDataStream& ss) : inv(invIn), vch(ss.begin(), ss.end())
+    {
+        uint256 hash = Hash(vch.begin(), vch.end());
+        nChecksum = 0;
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
+
+    unsigned int size() const { return vch.size(); }
+};
+
+typedef boost::shared_ptr<const CRelayBuffer> CRelayBufferRef;
+
+class CRelayCache
+{
+public:
+    mutable CCriticalSection cs;
+    std::map<CInv, CRelayBufferRef> mapRelay;
+    std::deque<std::pair<int64, CInv> > vExpiration;
+
+    uint64 nBytes;
+    uint64 nMaxBytes;
+
+    // Counters since startup
+    uint64 nAdded;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nExpired;
+    uint64 nEvicted;
+
+    CRelayCache()
+    {
+        nBytes = 0;
+        nMaxBytes = (uint64)DEFAULT_MAX_RELAY_CACHE_SIZE * 1000000;
+        nAdded = 0;
+        nHits = 0;
+        nMisses = 0;
+        nExpired = 0;
+        nEvicted = 0;
+    }
+
+    void Add(const CInv& inv, const CDataStream& ss);
+    CRelayBufferRef Get(const CInv& inv);
+
+protected:
+    void Erase(const CInv& inv);
+};
+
+
+
+
+
+class CDownloadScheduler
+{
+public:
+    class CItem
+    {
+    public:
+        // Peers that announced it and haven't been asked yet, with the
+        // sequence number of their announcement
+        std::map<int, uint64> mapAnnounced;
+        int nInFlightPeer;
+        int64 nRequestTime;
+        int64 nFirstSeen;
+
+        CItem()
+        {
+            nInFlightPeer = -1;
+            nRequestTime = 0;
+            nFirstSeen = 0;
+        }
+    };
+
+    class CPeer
+    {
+    public:
+        // In the order they were announced
+        std::set<std::pair<uint64, CInv> > setAnnounced;
+        int nInFlight;
+        int64 nLatency;
+        uint64 nRequested;
+        uint64 nReceived;
+        uint64 nTimeouts;
+
+        CPeer()
+        {
+            nInFlight = 0;
+            nLatency = -1;
+            nRequested = 0;
+            nReceived = 0;
+            nTimeouts = 0;
+        }
+
+        // Moving average of how long it takes to answer, in milliseconds,
+        // a peer we haven't heard back from yet counts as middling
+        int64 GetLatency() const { return (nLatency >= 0 ? nLatency : REQUEST_TIMEOUT / 8); }
+    };
+
+    mutable CCriticalSection cs;
+    std::map<CInv, CItem> mapItems;
+    std::map<int, CPeer> mapPeers;
+    std::set<std::pair<int64, CInv> > setInFlight;
+    uint64 nAnnounceSequence;
+
+    // Counters since startup
+    uint64 nRequested;
+    uint64 nReceived;
+    uint64 nDuplicates;
+    uint64 nTimeouts;
+    int64 nLatency;
+
+    CDownloadScheduler()
+    {
+        nAnnounceSequence = 0;
+        nRequested = 0;
+        nReceived = 0;
+        nDuplicates = 0;
+        nTimeouts = 0;
+        nLatency = -1;
+    }
+
+    void Announce(int nPeerId, const CInv& inv, int64 nNow);
+    void GetRequests(int nPeerId, int64 nNow, std::vector<CInv>& vRequestRet);
+    void MarkRequested(int nPeerId, const CInv& inv, int64 nNow);
+    void Received(int nPeerId, const CInv& inv, int64 nNow, bool fDuplicate);
+    void Forget(const CInv& inv);
+    void ForgetPeer(int nPeerId);
+    bool IsInFlight(const CInv& inv) const;
+
+protected:
+    void ExpireRequests(int64 nNow);
+    void ClearInFlight(CItem& item, const CInv& inv);
+    void EraseItem(std::map<CInv, CItem>::iterator mi);
+    bool HasFasterPeer(const CItem& item, int nPeerId) const;
+};
+
+
+
+
+
 class CRequestTracker
 {
 public:
@@ -483,12 +655,12 @@ extern SOCKET hListenSocket;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
+extern int nLastNodeId;
+extern CCriticalSection cs_nLastNodeId;
 extern std::map<std::vector<unsigned char>, CAddress> mapAddresses;
 extern CCriticalSection cs_mapAddresses;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
-extern std::map<CInv, int64> mapAlreadyAskedFor;
+extern CRelayCache relaycache;
+extern CDownloadScheduler downloadscheduler;
 
 // Settings
 extern int fUseProxy;
@@ -499,6 +671,28 @@ extern CAddress addrProxy;
 
 
 
+class CMessageStats
+{
+public:
+    uint64 nMessages;
+    uint64 nBytes;
+
+    CMessageStats()
+    {
+        nMessages = 0;
+        nBytes = 0;
+    }
+
+    void Add(unsigned int nSize)
+    {
+        nMessages++;
+        nBytes += nSize;
+    }
+};
+
+
+
+
 class CNode
 {
 public:
@@ -507,6 +701,13 @@ public:
     SOCKET hSocket;
     CDataStream vSend;
     CDataStream vRecv;
+    // Shared relay payloads go out from vSendRelay instead of being copied
+    // into vSend, each one after the vSend byte at its position, counted in
+    // bytes ever queued to vSend so erasing the front doesn't move them
+    std::deque<std::pair<uint64, CRelayBufferRef> > vSendRelay;
+    uint64 nSendErased;
+    unsigned int nSendRelayOffset;
+    uint64 nSendRelaySize;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
@@ -516,6 +717,7 @@ public:
     unsigned int nHeaderStart;
     unsigned int nMessageStart;
     CAddress addr;
+    int id;
     int nVersion;
     std::string strSubVer;
     bool fClient;
@@ -523,6 +725,16 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    const char* pszSendCommand;
+
+    // bandwidth accounting, send side under cs_vSend and receive side under cs_vRecv
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    std::map<std::string, CMessageStats> mapSendStats;
+    std::map<std::string, CMessageStats> mapRecvStats;
+
+    // getdata requests waiting for vSend to drain below SendBufferPauseSize()
+    std::deque<CInv> vRecvGetData;
 protected:
     int nRefCount;
 public:
@@ -538,24 +750,31 @@ public:
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
     bool fGetAddr;
+    int64 nNextAddrSend;
     std::set<uint256> setKnown;
 
-    // inventory based relay
-    std::set<CInv> setInventoryKnown;
+    // inventory based relay, blocks go out on the next pass and txs in
+    // batches at nNextInvSend, in the order they were queued so parents
+    // go before children and a long backlog drains oldest first
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    std::deque<uint256> vInventoryTxToSend;
+    int64 nNextInvSend;
     CCriticalSection cs_inventory;
-    std::multimap<int64, CInv> mapAskFor;
 
     // publish and subscription
     std::vector<char> vfSubscribe;
 
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) : filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
         vSend.SetType(SER_NETWORK);
         vSend.SetVersion(0);
+        nSendErased = 0;
+        nSendRelayOffset = 0;
+        nSendRelaySize = 0;
         vRecv.SetType(SER_NETWORK);
         vRecv.SetVersion(0);
         // Version 0.2 obsoletes 20 Feb 2012
@@ -571,6 +790,8 @@ public:
         nHeaderStart = -1;
         nMessageStart = -1;
         addr = addrIn;
+        CRITICAL_BLOCK(cs_nLastNodeId)
+            id = nLastNodeId++;
         nVersion = 0;
         strSubVer = "";
         fClient = false; // set by version message
@@ -578,6 +799,9 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        pszSendCommand = NULL;
+        nSendBytes = 0;
+        nRecvBytes = 0;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
@@ -585,6 +809,8 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fGetAddr = false;
+        nNextAddrSend = 0;
+        nNextInvSend = 0;
         vfSubscribe.assign(256, false);
 
         // Be shy and don't send version until we hear
@@ -626,6 +852,18 @@ public:
         nRefCount--;
     }
 
+    bool IsSendEmpty() const
+    {
+        return vSend.empty() && vSendRelay.empty();
+    }
+
+    unsigned int GetSendSize()
+    {
+        CRITICAL_BLOCK(cs_vSend)
+            return vSend.size() + nSendRelaySize - nSendRelayOffset;
+        return 0;
+    }
+
 
 
     void AddAddressKnown(const CAddress& addr)
@@ -646,31 +884,20 @@ public:
     void AddInventoryKnown(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
     }
 
     void PushInventory(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            if (!setInventoryKnown.count(inv))
+        {
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            if (inv.type == MSG_TX)
+                vInventoryTxToSend.push_back(inv.hash);
+            else
                 vInventoryToSend.push_back(inv);
-    }
-
-    void AskFor(const CInv& inv)
-    {
-        // We're using mapAskFor as a priority queue,
-        // the key is the earliest time the request can be sent
-        int64& nRequestTime = mapAlreadyAskedFor[inv];
-        printf("askfor %s   %"PRI64d"\n", inv.ToString().c_str(), nRequestTime);
-
-        // Make sure not to reuse time indexes to keep things in the same order
-        int64 nNow = (GetTime() - 1) * 1000000;
-        static int64 nLastTime;
-        nLastTime = nNow = std::max(nNow, ++nLastTime);
-
-        // Each retry is 2 minutes after the last
-        nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-        mapAskFor.insert(std::make_pair(nRequestTime, inv));
+        }
     }
 
 
@@ -681,6 +908,7 @@ public:
         if (nHeaderStart != -1)
             AbortMessage();
         nHeaderStart = vSend.size();
+        pszSendCommand = pszCommand;
         vSend << CMessageHeader(pszCommand, 0);
         nMessageStart = vSend.size();
         if (fDebug)
@@ -728,6 +956,27 @@ public:
         printf("(%d bytes) ", nSize);
         printf("\n");
 
+        mapSendStats[pszSendCommand].Add(vSend.size() - nHeaderStart);
+
+        nHeaderStart = -1;
+        nMessageStart = -1;
+        cs_vSend.Leave();
+    }
+
+    void PushRelayMessage(const CRelayBufferRef& pbuf)
+    {
+        // Only the header goes into vSend, the payload is queued by reference
+        BeginMessage(pbuf->inv.GetCommand());
+        unsigned int nSize = pbuf->size();
+        memcpy((char*)&vSend[nHeaderStart] + offsetof(CMessageHeader, nMessageSize), &nSize, sizeof(nSize));
+        if (vSend.GetVersion() >= 209)
+            memcpy((char*)&vSend[nHeaderStart] + offsetof(CMessageHeader, nChecksum), &pbuf->nChecksum, sizeof(pbuf->nChecksum));
+        vSendRelay.push_back(std::make_pair(nSendErased + vSend.size(), pbuf));
+        nSendRelaySize += nSize;
+
+        printf("(%d bytes, shared)\n", nSize);
+        mapSendStats[pszSendCommand].Add(vSend.size() - nHeaderStart + nSize);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         cs_vSend.Leave();
@@ -960,6 +1209,7 @@ public:
 
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void RecordRecvMessage(const std::string& strCommand, unsigned int nSize);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
@@ -996,20 +1246,8 @@ void RelayMessage(const CInv& inv, const T& a)
 template<>
 inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
 {
-    CRITICAL_BLOCK(cs_mapRelay)
-    {
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay[inv] = ss;
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
-
+    // Save original serialized message so newer versions are preserved
+    relaycache.Add(inv, ss);
     RelayInventory(inv);
 }
 
@@ -202,6 +202,91 @@ Value getconnectioncount(const Array& params, bool fHelp)
 }
 
 
+Object MessageStatsToJSON(const map<string, CMessageStats>& mapStats)
+{
+    Object obj;
+    BOOST_FOREACH(const PAIRTYPE(string, CMessageStats)& item, mapStats)
+    {
+        Object entry;
+        entry.push_back(Pair("messages",    (boost::int64_t)item.second.nMessages));
+        entry.push_back(Pair("bytes",       (boost::int64_t)item.second.nBytes));
+        obj.push_back(Pair(item.first, entry));
+    }
+    return obj;
+}
+
+Value getpeerinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getpeerinfo\n"
+            "Returns data about each connected node, including the bytes and\n"
+            "messages sent to and received from it by command.");
+
+    // Take references and let go of cs_vNodes before locking the nodes,
+    // the message handler locks them the other way round
+    vector<CNode*> vNodesCopy;
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+
+    Array ret;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        Object obj;
+        obj.push_back(Pair("id",                pnode->id));
+        obj.push_back(Pair("addr",              pnode->addr.ToString()));
+        obj.push_back(Pair("services",          strprintf("%08"PRI64x, pnode->nServices)));
+        obj.push_back(Pair("inbound",           pnode->fInbound));
+        obj.push_back(Pair("version",           pnode->nVersion));
+        obj.push_back(Pair("subver",            pnode->strSubVer));
+        obj.push_back(Pair("startingheight",    pnode->nStartingHeight));
+        obj.push_back(Pair("conntime",          (boost::int64_t)pnode->nTimeConnected));
+        obj.push_back(Pair("lastsend",          (boost::int64_t)pnode->nLastSend));
+        obj.push_back(Pair("lastrecv",          (boost::int64_t)pnode->nLastRecv));
+        CRITICAL_BLOCK(pnode->cs_vSend)
+        {
+            obj.push_back(Pair("bytessent",         (boost::int64_t)pnode->nSendBytes));
+            obj.push_back(Pair("sendbuffer",        (int)pnode->GetSendSize()));
+            obj.push_back(Pair("sendshared",        (int)pnode->vSendRelay.size()));
+            obj.push_back(Pair("sent",              MessageStatsToJSON(pnode->mapSendStats)));
+        }
+        CRITICAL_BLOCK(pnode->cs_vRecv)
+        {
+            obj.push_back(Pair("bytesrecv",         (boost::int64_t)pnode->nRecvBytes));
+            obj.push_back(Pair("recvbuffer",        (int)pnode->vRecv.size()));
+            obj.push_back(Pair("getdatapaused",     (int)pnode->vRecvGetData.size()));
+            obj.push_back(Pair("received",          MessageStatsToJSON(pnode->mapRecvStats)));
+        }
+        CRITICAL_BLOCK(downloadscheduler.cs)
+        {
+            map<int, CDownloadScheduler::CPeer>::iterator mi = downloadscheduler.mapPeers.find(pnode->id);
+            if (mi != downloadscheduler.mapPeers.end())
+            {
+                const CDownloadScheduler::CPeer& peer = (*mi).second;
+                obj.push_back(Pair("announced",         (int)peer.setAnnounced.size()));
+                obj.push_back(Pair("inflight",          peer.nInFlight));
+                obj.push_back(Pair("requested",         (boost::int64_t)peer.nRequested));
+                obj.push_back(Pair("delivered",         (boost::int64_t)peer.nReceived));
+                obj.push_back(Pair("timeouts",          (boost::int64_t)peer.nTimeouts));
+                obj.push_back(Pair("latencyms",         (boost::int64_t)peer.nLatency));
+            }
+        }
+        ret.push_back(obj);
+    }
+
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+    return ret;
+}
+
+
 double GetDifficulty()
 {
     // Floating point number that is a multiple of the minimum difficulty,
@@ -302,6 +387,13 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("version",       (int)VERSION));
     obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
     obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("headers",       GetBestHeaderHeight()));
+    unsigned int nOrphanBlocks;
+    uint64 nOrphanBlockBytes, nOrphanBlockMemory;
+    GetOrphanBlockStats(nOrphanBlocks, nOrphanBlockBytes, nOrphanBlockMemory);
+    obj.push_back(Pair("orphanblocks",  (int)nOrphanBlocks));
+    obj.push_back(Pair("orphanbytes",   (boost::int64_t)nOrphanBlockBytes));
+    obj.push_back(Pair("orphanmemory",  (boost::int64_t)nOrphanBlockMemory));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (fUseProxy ? addrProxy.ToStringIPPort() : string())));
     obj.push_back(Pair("generate",      (bool)fGenerateBitcoins));
@@ -316,6 +408,33 @@ Value getinfo(const Array& params, bool fHelp)
 }
 
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns an object containing memory pool statistics.");
+
+    Object obj;
+    CRITICAL_BLOCK(mempool.cs)
+    {
+        obj.push_back(Pair("size",          (int)mempool.mapTx.size()));
+        obj.push_back(Pair("bytes",         (boost::int64_t)mempool.nBytes));
+        obj.push_back(Pair("usage",         (boost::int64_t)mempool.nUsage));
+        obj.push_back(Pair("maxmempool",    (boost::int64_t)mempool.nMaxUsage));
+        obj.push_back(Pair("minfee",        ValueFromAmount(mempool.GetMinFee(1000))));
+        obj.push_back(Pair("outpoints",     (int)mempool.mapNextTx.size()));
+        obj.push_back(Pair("added",         (boost::int64_t)mempool.nAdded));
+        obj.push_back(Pair("removed",       (boost::int64_t)mempool.nRemoved));
+        obj.push_back(Pair("conflicts",     (boost::int64_t)mempool.nConflicts));
+        obj.push_back(Pair("evicted",       (boost::int64_t)mempool.nEvicted));
+        obj.push_back(Pair("evictedbytes",  (boost::int64_t)mempool.nEvictedBytes));
+    }
+    obj.push_back(Pair("orphans",       (int)GetOrphanTxCount()));
+    return obj;
+}
+
+
 Value getnewaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -334,8 +453,7 @@ Value getnewaddress(const Array& params, bool fHelp)
     string strAddress = PubKeyToAddress(pwalletMain->GetKeyFromKeyPool());
 
     // This could be done in the same main CS as GetKeyFromKeyPool.
-    CRITICAL_BLOCK(pwalletMain->cs_mapAddressBook)
-       pwalletMain->SetAddressBookName(strAddress, strAccount);
+    pwalletMain->SetAddressBookName(strAddress, strAccount);
 
     return strAddress;
 }
@@ -635,6 +753,11 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
+    int nConf;
+    if (pwalletMain->GetReceivedByHash160(scriptPubKey.GetBitcoinAddressHash160(), nMinDepth, nAmount, nConf))
+        return ValueFromAmount(nAmount);
+
+    // minconf deeper than the wallet's received index keeps
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
@@ -656,21 +779,13 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
 void GetAccountPubKeys(string strAccount, set<CScript>& setPubKey)
 {
-    CRITICAL_BLOCK(pwalletMain->cs_mapAddressBook)
+    set<uint160> setAddress;
+    pwalletMain->GetAccountAddresses(strAccount, setAddress);
+    BOOST_FOREACH(const uint160& hash160, setAddress)
     {
-        BOOST_FOREACH(const PAIRTYPE(string, string)& item, pwalletMain->mapAddressBook)
-        {
-            const string& strAddress = item.first;
-            const string& strName = item.second;
-            if (strName == strAccount)
-            {
-                // We're only counting our own valid bitcoin addresses and not ip addresses
-                CScript scriptPubKey;
-                if (scriptPubKey.SetBitcoinAddress(strAddress))
-                    if (IsMine(*pwalletMain,scriptPubKey))
-                        setPubKey.insert(scriptPubKey);
-            }
-        }
+        CScript scriptPubKey;
+        scriptPubKey.SetBitcoinAddress(hash160);
+        setPubKey.insert(scriptPubKey);
     }
 }
 
@@ -687,13 +802,28 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
     if (params.size() > 1)
         nMinDepth = params[1].get_int();
 
-    // Get the set of pub keys that have the label
+    // Get the set of addresses that have the label
     string strAccount = AccountFromValue(params[0]);
-    set<CScript> setPubKey;
-    GetAccountPubKeys(strAccount, setPubKey);
+    set<uint160> setAddress;
+    pwalletMain->GetAccountAddresses(strAccount, setAddress);
 
     // Tally
     int64 nAmount = 0;
+    if (nMinDepth <= LEDGER_SETTLED_DEPTH)
+    {
+        BOOST_FOREACH(const uint160& hash160, setAddress)
+        {
+            int64 nReceived;
+            int nConf;
+            pwalletMain->GetReceivedByHash160(hash160, nMinDepth, nReceived, nConf);
+            nAmount += nReceived;
+        }
+        return (double)nAmount / (double)COIN;
+    }
+
+    // minconf deeper than the wallet's received index keeps
+    set<CScript> setPubKey;
+    GetAccountPubKeys(strAccount, setPubKey);
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
@@ -716,6 +846,10 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinDepth)
 {
     int64 nBalance = 0;
+    if (pwalletMain->GetAccountBalance(strAccount, nMinDepth, nBalance))
+        return nBalance;
+
+    // minconf deeper than the wallet's account ledger keeps
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         // Tally wallet transactions
@@ -829,7 +963,7 @@ Value movecmd(const Array& params, bool fHelp)
         debit.nTime = nNow;
         debit.strOtherAccount = strTo;
         debit.strComment = strComment;
-        walletdb.WriteAccountingEntry(debit);
+        bool fWritten = walletdb.WriteAccountingEntry(debit);
 
         // Credit
         CAccountingEntry credit;
@@ -838,9 +972,19 @@ Value movecmd(const Array& params, bool fHelp)
         credit.nTime = nNow;
         credit.strOtherAccount = strFrom;
         credit.strComment = strComment;
-        walletdb.WriteAccountingEntry(credit);
+        fWritten = walletdb.WriteAccountingEntry(credit) && fWritten;
 
-        walletdb.TxnCommit();
+        if (!fWritten)
+        {
+            walletdb.TxnAbort();
+            throw JSONRPCError(-4, "Database error");
+        }
+        if (!walletdb.TxnCommit())
+            throw JSONRPCError(-4, "Database error");
+
+        // Only index the entries once they're safely on disk
+        pwalletMain->AddAccountingEntry(debit);
+        pwalletMain->AddAccountingEntry(credit);
     }
     return true;
 }
@@ -975,7 +1119,29 @@ Value ListReceived(const Array& params, bool fByAccounts)
 
     // Tally
     map<uint160, tallyitem> mapTally;
-    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+    if (nMinDepth <= LEDGER_SETTLED_DEPTH)
+    {
+        // Only address book entries are reported, so only look those up
+        CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+        CRITICAL_BLOCK(pwalletMain->cs_mapAddressBook)
+        {
+            BOOST_FOREACH(const PAIRTYPE(string, string)& item, pwalletMain->mapAddressBook)
+            {
+                uint160 hash160;
+                if (!AddressToHash160(item.first, hash160) || !mapPubKeys.count(hash160)) // IsMine
+                    continue;
+                int64 nAmount;
+                int nConf;
+                pwalletMain->GetReceivedByHash160(hash160, nMinDepth, nAmount, nConf);
+                if (nConf == INT_MAX)
+                    continue;
+                tallyitem& tally = mapTally[hash160];
+                tally.nAmount = nAmount;
+                tally.nConf = nConf;
+            }
+        }
+    }
+    else CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
         {
@@ -1198,37 +1364,28 @@ Value listtransactions(const Array& params, bool fHelp)
     int nFrom = 0;
     if (params.size() > 2)
         nFrom = params[2].get_int();
+    if (nFrom < 0)
+        nFrom = 0;
 
     Array ret;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
+    bool fAllAccounts = (strAccount == string("*"));
 
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
-        // Firs: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap:
-        typedef pair<CWalletTx*, CAccountingEntry*> TxPair;
-        typedef multimap<int64, TxPair > TxItems;
-        TxItems txByTime;
-
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            CWalletTx* wtx = &((*it).second);
-            txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
-        }
-        list<CAccountingEntry> acentries;
-        walletdb.ListAccountCreditDebit(strAccount, acentries);
-        BOOST_FOREACH(CAccountingEntry& entry, acentries)
+        // wtxOrdered is sorted by time, so the page starts at a position found
+        // with a few binary searches.  Walk backwards from there until we have
+        // nCount items to return.  Accounting entries of other accounts don't
+        // count towards nFrom.
+        const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+        for (unsigned int i = pwalletMain->GetOrderedPosition(strAccount, nFrom); i > 0; i--)
         {
-            txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
-        }
+            CWalletTx *const pwtx = txOrdered[i-1].second.first;
+            CAccountingEntry *const pacentry = txOrdered[i-1].second.second;
+            if (pacentry != 0 && !fAllAccounts && pacentry->strAccount != strAccount)
+                continue;
 
-        // Now: iterate backwards until we have nCount items to return:
-        TxItems::reverse_iterator it = txByTime.rbegin();
-        for (std::advance(it, nFrom); it != txByTime.rend(); ++it)
-        {
-            CWalletTx *const pwtx = (*it).second.first;
             if (pwtx != 0)
                 ListTransactions(*pwtx, strAccount, 0, true, ret);
-            CAccountingEntry *const pacentry = (*it).second.second;
             if (pacentry != 0)
                 AcentryToJSON(*pacentry, strAccount, ret);
 
@@ -1269,34 +1426,42 @@ Value listaccounts(const Array& params, bool fHelp)
             if(AddressToHash160(entry.first, hash160) && mapPubKeys.count(hash160)) // This address belongs to me
                 mapAccountBalances[entry.second] = 0;
         }
+    }
 
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    if (!pwalletMain->GetAccountBalances(nMinDepth, mapAccountBalances))
+    {
+        // minconf deeper than the wallet's account ledger keeps
+        CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+        CRITICAL_BLOCK(pwalletMain->cs_mapAddressBook)
         {
-            const CWalletTx& wtx = (*it).second;
-            int64 nGeneratedImmature, nGeneratedMature, nFee;
-            string strSentAccount;
-            list<pair<string, int64> > listReceived;
-            list<pair<string, int64> > listSent;
-            wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
-            mapAccountBalances[strSentAccount] -= nFee;
-            BOOST_FOREACH(const PAIRTYPE(string, int64)& s, listSent)
-                mapAccountBalances[strSentAccount] -= s.second;
-            if (wtx.GetDepthInMainChain() >= nMinDepth)
+            for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
             {
-                mapAccountBalances[""] += nGeneratedMature;
-                BOOST_FOREACH(const PAIRTYPE(string, int64)& r, listReceived)
-                    if (pwalletMain->mapAddressBook.count(r.first))
-                        mapAccountBalances[pwalletMain->mapAddressBook[r.first]] += r.second;
-                    else
-                        mapAccountBalances[""] += r.second;
+                const CWalletTx& wtx = (*it).second;
+                int64 nGeneratedImmature, nGeneratedMature, nFee;
+                string strSentAccount;
+                list<pair<string, int64> > listReceived;
+                list<pair<string, int64> > listSent;
+                wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
+                mapAccountBalances[strSentAccount] -= nFee;
+                BOOST_FOREACH(const PAIRTYPE(string, int64)& s, listSent)
+                    mapAccountBalances[strSentAccount] -= s.second;
+                if (wtx.GetDepthInMainChain() >= nMinDepth)
+                {
+                    mapAccountBalances[""] += nGeneratedMature;
+                    BOOST_FOREACH(const PAIRTYPE(string, int64)& r, listReceived)
+                        if (pwalletMain->mapAddressBook.count(r.first))
+                            mapAccountBalances[pwalletMain->mapAddressBook[r.first]] += r.second;
+                        else
+                            mapAccountBalances[""] += r.second;
+                }
             }
         }
-    }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
-        mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
+        list<CAccountingEntry> acentries;
+        CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
+        BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+            mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
+    }
 
     Object ret;
     BOOST_FOREACH(const PAIRTYPE(string, int64)& accountBalance, mapAccountBalances) {
@@ -1455,7 +1620,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -1485,7 +1650,8 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(nExtraNonce);
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->vtx[0].InvalidateHash();
+        pblock->hashMerkleRoot = pblock->UpdateMerkleCoinbase();
 
         return CheckWork(pblock, *pwalletMain, reservekey);
     }
@@ -1578,7 +1744,7 @@ Value getworkaux(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -1626,7 +1792,8 @@ Value getworkaux(const Array& params, bool fHelp)
         RemoveMergedMiningHeader(vchAux);
 
         pblock->vtx[0].vin[0].scriptSig = MakeCoinbaseWithAux(pblock->nBits, nExtraNonce, vchAux);
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->vtx[0].InvalidateHash();
+        pblock->hashMerkleRoot = pblock->UpdateMerkleCoinbase();
 
         if (params.size() > 2)
         {
@@ -1721,7 +1888,8 @@ Value getauxblock(const Array& params, bool fHelp)
 
             // Push OP_2 just in case we want versioning later
             pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(1) << OP_2;
-            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+            pblock->vtx[0].InvalidateHash();
+            pblock->hashMerkleRoot = pblock->UpdateMerkleCoinbase();
 
             // Sets the version
             pblock->SetAuxPow(new CAuxPow());
@@ -1734,7 +1902,7 @@ Value getauxblock(const Array& params, bool fHelp)
             vNewBlock.push_back(pblock);
         }
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
@@ -1812,6 +1980,67 @@ Value buildmerkletree(const Array& params, bool fHelp)
 
 
 
+Value getrelayinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrelayinfo\n"
+            "Returns an object containing relay cache statistics.");
+
+    Object obj;
+    CRITICAL_BLOCK(relaycache.cs)
+    {
+        // Entries some peer's send queue still points at
+        int nQueued = 0;
+        uint64 nQueuedBytes = 0;
+        BOOST_FOREACH(const PAIRTYPE(CInv, CRelayBufferRef)& item, relaycache.mapRelay)
+        {
+            if (item.second.use_count() > 1)
+            {
+                nQueued++;
+                nQueuedBytes += item.second->size();
+            }
+        }
+
+        obj.push_back(Pair("size",          (int)relaycache.mapRelay.size()));
+        obj.push_back(Pair("bytes",         (boost::int64_t)relaycache.nBytes));
+        obj.push_back(Pair("maxbytes",      (boost::int64_t)relaycache.nMaxBytes));
+        obj.push_back(Pair("queued",        nQueued));
+        obj.push_back(Pair("queuedbytes",   (boost::int64_t)nQueuedBytes));
+        obj.push_back(Pair("added",         (boost::int64_t)relaycache.nAdded));
+        obj.push_back(Pair("hits",          (boost::int64_t)relaycache.nHits));
+        obj.push_back(Pair("misses",        (boost::int64_t)relaycache.nMisses));
+        obj.push_back(Pair("expired",       (boost::int64_t)relaycache.nExpired));
+        obj.push_back(Pair("evicted",       (boost::int64_t)relaycache.nEvicted));
+    }
+    return obj;
+}
+
+
+Value getdownloadinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdownloadinfo\n"
+            "Returns an object containing statistics on announced transactions\n"
+            "and blocks being fetched from peers.");
+
+    Object obj;
+    CRITICAL_BLOCK(downloadscheduler.cs)
+    {
+        obj.push_back(Pair("tracked",       (int)downloadscheduler.mapItems.size()));
+        obj.push_back(Pair("inflight",      (int)downloadscheduler.setInFlight.size()));
+        obj.push_back(Pair("peers",         (int)downloadscheduler.mapPeers.size()));
+        obj.push_back(Pair("requested",     (boost::int64_t)downloadscheduler.nRequested));
+        obj.push_back(Pair("delivered",     (boost::int64_t)downloadscheduler.nReceived));
+        obj.push_back(Pair("duplicates",    (boost::int64_t)downloadscheduler.nDuplicates));
+        obj.push_back(Pair("timeouts",      (boost::int64_t)downloadscheduler.nTimeouts));
+        obj.push_back(Pair("latencyms",     (boost::int64_t)downloadscheduler.nLatency));
+    }
+    return obj;
+}
+
+
 //
 // Call Table
 //
@@ -1823,11 +2052,15 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("getblockcount",         &getblockcount),
     make_pair("getblocknumber",        &getblocknumber),
     make_pair("getconnectioncount",    &getconnectioncount),
+    make_pair("getpeerinfo",           &getpeerinfo),
     make_pair("getdifficulty",         &getdifficulty),
     make_pair("getgenerate",           &getgenerate),
     make_pair("setgenerate",           &setgenerate),
     make_pair("gethashespersec",       &gethashespersec),
     make_pair("getinfo",               &getinfo),
+    make_pair("getmempoolinfo",        &getmempoolinfo),
+    make_pair("getrelayinfo",          &getrelayinfo),
+    make_pair("getdownloadinfo",       &getdownloadinfo),
     make_pair("getnewaddress",         &getnewaddress),
     make_pair("getaccountaddress",     &getaccountaddress),
     make_pair("setaccount",            &setaccount),
@@ -1871,11 +2104,15 @@ string pAllowInSafeMode[] =
     "getblockcount",
     "getblocknumber",
     "getconnectioncount",
+    "getpeerinfo",
     "getdifficulty",
     "getgenerate",
     "setgenerate",
     "gethashespersec",
     "getinfo",
+    "getmempoolinfo",
+    "getrelayinfo",
+    "getdownloadinfo",
     "getnewaddress",
     "getaccountaddress",
     "setlabel",
@@ -11,13 +11,6 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
 
 typedef vector<unsigned char> valtype;
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
 static const size_t nMaxNumSize = 4;
 
 
@@ -59,66 +52,282 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 // Script is a stack machine (like Forth) that evaluates a predicate
 // returning a bool indicating valid or not.  There are no loops.
 //
-#define stacktop(i)  (stack.at(stack.size()+(i)))
-#define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+// The script is decoded once up front, and stack entries only point at
+// their bytes: in the script itself, in a small arena for computed values,
+// or at constants.  Nothing on the stack is ever changed in place (every op
+// that would is disabled), so copying an entry is copying a pointer and a
+// size, and normal scripts run without touching the heap.
+//
+
+// Vector of plain data that keeps its first N elements inside the object
+template<typename T, unsigned int N>
+class CInlineVector
 {
-    if (stack.empty())
-        throw runtime_error("popstack() : stack empty");
-    stack.pop_back();
+private:
+    T buf[N];
+    T* p;
+    unsigned int nSize;
+    unsigned int nCapacity;
+
+    CInlineVector(const CInlineVector&);
+    void operator=(const CInlineVector&);
+
+    void grow()
+    {
+        T* pNew = new T[nCapacity * 2];
+        memcpy(pNew, p, nSize * sizeof(T));
+        if (p != buf)
+            delete[] p;
+        p = pNew;
+        nCapacity *= 2;
+    }
+
+public:
+    CInlineVector() : p(buf), nSize(0), nCapacity(N) { }
+    ~CInlineVector() { if (p != buf) delete[] p; }
+
+    unsigned int size() const         { return nSize; }
+    bool empty() const                { return nSize == 0; }
+    void clear()                      { nSize = 0; }
+    T& operator[](unsigned int i)     { return p[i]; }
+    const T& operator[](unsigned int i) const { return p[i]; }
+    T& back()                         { return p[nSize-1]; }
+    void pop_back()                   { nSize--; }
+
+    void push_back(const T& x)
+    {
+        T tmp = x;
+        if (nSize == nCapacity)
+            grow();
+        p[nSize++] = tmp;
+    }
+
+    void insert(unsigned int i, const T& x)
+    {
+        T tmp = x;
+        if (nSize == nCapacity)
+            grow();
+        memmove(p + i + 1, p + i, (nSize - i) * sizeof(T));
+        p[i] = tmp;
+        nSize++;
+    }
+
+    void erase(unsigned int i, unsigned int n=1)
+    {
+        memmove(p + i, p + i + n, (nSize - i - n) * sizeof(T));
+        nSize -= n;
+    }
+};
+
+class CScriptValue
+{
+public:
+    const unsigned char* pch;
+    unsigned int nSize;
+
+    bool operator==(const CScriptValue& b) const
+    {
+        return nSize == b.nSize && (nSize == 0 || memcmp(pch, b.pch, nSize) == 0);
+    }
+
+    valtype ToVch() const { return valtype(pch, pch + nSize); }
+};
+
+static const unsigned char pchTrue[1] = { 1 };
+static const CScriptValue valueFalse = { pchTrue, 0 };
+static const CScriptValue valueTrue = { pchTrue, 1 };
+
+// Storage for values computed while running a script, none bigger than a hash
+class CScriptArena
+{
+private:
+    enum { CHUNK_SIZE = 4096 };
+    unsigned char buf[512];
+    unsigned char* pchChunk;
+    unsigned int nChunkSize;
+    unsigned int nUsed;
+    std::vector<unsigned char*> vChunks;
+
+    CScriptArena(const CScriptArena&);
+    void operator=(const CScriptArena&);
+
+public:
+    CScriptArena() : pchChunk(buf), nChunkSize(sizeof(buf)), nUsed(0) { }
+
+    ~CScriptArena()
+    {
+        BOOST_FOREACH(unsigned char* pch, vChunks)
+            delete[] pch;
+    }
+
+    unsigned char* Alloc(unsigned int n)
+    {
+        if (nUsed + n > nChunkSize)
+        {
+            pchChunk = new unsigned char[CHUNK_SIZE];
+            vChunks.push_back(pchChunk);
+            nChunkSize = CHUNK_SIZE;
+            nUsed = 0;
+        }
+        unsigned char* pch = pchChunk + nUsed;
+        nUsed += n;
+        return pch;
+    }
+};
+
+class CScriptOp
+{
+public:
+    unsigned char opcode;
+    unsigned short nData;     // offset of the pushed data
+    unsigned short nSize;     // size of the pushed data
+    unsigned short nNext;     // offset of the next op
+    unsigned short nOpCount;  // counted ops up to and including this one
+};
+
+typedef CInlineVector<CScriptValue, 32> CScriptStack;
+
+bool static CastToBool(const CScriptValue& value)
+{
+    for (unsigned int i = 0; i < value.nSize; i++)
+    {
+        if (value.pch[i] != 0)
+        {
+            // Can be negative zero
+            if (i == value.nSize-1 && value.pch[i] == 0x80)
+                return false;
+            return true;
+        }
+    }
+    return false;
 }
 
+bool static CastToInt(const CScriptValue& value, int64& nRet)
+{
+    // Same range and sign-magnitude encoding as CastToBigNum
+    if (value.nSize > nMaxNumSize)
+        return false;
+    uint64 n = 0;
+    for (unsigned int i = 0; i < value.nSize; i++)
+        n |= (uint64)value.pch[i] << (8 * i);
+    if (value.nSize > 0 && (value.pch[value.nSize-1] & 0x80))
+        nRet = -(int64)(n & ~((uint64)0x80 << (8 * (value.nSize-1))));
+    else
+        nRet = (int64)n;
+    return true;
+}
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+CScriptValue static MakeValue(CScriptArena& arena, int64 n)
 {
-    CAutoBN_CTX pctx;
-    CScript::const_iterator pc = script.begin();
-    CScript::const_iterator pend = script.end();
-    CScript::const_iterator pbegincodehash = script.begin();
-    opcodetype opcode;
-    valtype vchPushValue;
-    vector<bool> vfExec;
-    vector<valtype> altstack;
+    // Encoded the way CBigNum::getvch does it
+    CScriptValue value;
+    value.pch = pchTrue;
+    value.nSize = 0;
+    if (n == 0)
+        return value;
+    bool fNegative = (n < 0);
+    uint64 nAbs = fNegative ? -(uint64)n : (uint64)n;
+    unsigned char pch[9];
+    unsigned int nSize = 0;
+    while (nAbs)
+    {
+        pch[nSize++] = nAbs & 0xff;
+        nAbs >>= 8;
+    }
+    if (pch[nSize-1] & 0x80)
+        pch[nSize++] = fNegative ? 0x80 : 0;
+    else if (fNegative)
+        pch[nSize-1] |= 0x80;
+    unsigned char* pchValue = arena.Alloc(nSize);
+    memcpy(pchValue, pch, nSize);
+    value.pch = pchValue;
+    value.nSize = nSize;
+    return value;
+}
+
+bool static DecodeScript(const CScript& script, CInlineVector<CScriptOp, 64>& vOps)
+{
+    // Everything that fails a script wherever it appears, executed or not,
+    // is caught here
     if (script.size() > 10000)
         return false;
+    CScript::const_iterator pc = script.begin();
+    CScript::const_iterator pend = script.end();
     int nOpCount = 0;
+    while (pc < pend)
+    {
+        unsigned int nBegin = pc - script.begin();
+        opcodetype opcode;
+        if (!script.GetOp2(pc, opcode, NULL))
+            return false;
 
+        CScriptOp op;
+        op.opcode = opcode;
+        op.nNext = pc - script.begin();
+        op.nData = op.nNext;
+        if (opcode <= OP_PUSHDATA4)
+        {
+            op.nData = nBegin + 1;
+            if (opcode == OP_PUSHDATA1)
+                op.nData += 1;
+            else if (opcode == OP_PUSHDATA2)
+                op.nData += 2;
+            else if (opcode == OP_PUSHDATA4)
+                op.nData += 4;
+        }
+        op.nSize = op.nNext - op.nData;
+        if (op.nSize > 520)
+            return false;
+        if (opcode > OP_16 && ++nOpCount > 201)
+            return false;
+        op.nOpCount = nOpCount;
 
-    try
-    {
-        while (pc < pend)
+        switch (opcode)
         {
-            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+        case OP_CAT: case OP_SUBSTR: case OP_LEFT: case OP_RIGHT:
+        case OP_INVERT: case OP_AND: case OP_OR: case OP_XOR:
+        case OP_2MUL: case OP_2DIV: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_LSHIFT: case OP_RSHIFT:
+            return false;
+        default:
+            break;
+        }
+        vOps.push_back(op);
+    }
+    return true;
+}
 
-            //
-            // Read instruction
-            //
-            if (!script.GetOp(pc, opcode, vchPushValue))
-                return false;
-            if (vchPushValue.size() > 520)
-                return false;
-            if (opcode > OP_16 && ++nOpCount > 201)
-                return false;
+#define stacktop(i)  (stack[stack.size()+(i)])
+#define altstacktop(i)  (altstack[altstack.size()+(i)])
 
-            if (opcode == OP_CAT ||
-                opcode == OP_SUBSTR ||
-                opcode == OP_LEFT ||
-                opcode == OP_RIGHT ||
-                opcode == OP_INVERT ||
-                opcode == OP_AND ||
-                opcode == OP_OR ||
-                opcode == OP_XOR ||
-                opcode == OP_2MUL ||
-                opcode == OP_2DIV ||
-                opcode == OP_MUL ||
-                opcode == OP_DIV ||
-                opcode == OP_MOD ||
-                opcode == OP_LSHIFT ||
-                opcode == OP_RSHIFT)
+bool static EvalScript(CScriptStack& stack, CScriptArena& arena, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CInlineVector<CScriptOp, 64> vOps;
+    if (!DecodeScript(script, vOps))
+        return false;
+    CInlineVector<bool, 16> vfExec;
+    unsigned int nExecFalse = 0;
+    CScriptStack altstack;
+    unsigned int nBeginCodeHash = 0;
+    int nOpCountKeys = 0;
+
+    try
+    {
+        for (unsigned int iop = 0; iop < vOps.size(); iop++)
+        {
+            const CScriptOp& op = vOps[iop];
+            opcodetype opcode = (opcodetype)op.opcode;
+            bool fExec = (nExecFalse == 0);
+            if (opcode > OP_16 && op.nOpCount + nOpCountKeys > 201)
                 return false;
 
-            if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+            if (fExec && opcode <= OP_PUSHDATA4)
+            {
+                CScriptValue value;
+                value.pch = &script[0] + op.nData;
+                value.nSize = op.nSize;
+                stack.push_back(value);
+            }
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -144,8 +353,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    stack.push_back(MakeValue(arena, (int)opcode - (int)(OP_1 - 1)));
                 }
                 break;
 
@@ -167,13 +375,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
-                        fValue = CastToBool(vch);
+                        fValue = CastToBool(stacktop(-1));
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
-                        popstack(stack);
+                        stack.pop_back();
                     }
                     vfExec.push_back(fValue);
+                    if (!fValue)
+                        nExecFalse++;
                 }
                 break;
 
@@ -182,6 +391,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (vfExec.empty())
                         return false;
                     vfExec.back() = !vfExec.back();
+                    if (vfExec.back())
+                        nExecFalse--;
+                    else
+                        nExecFalse++;
                 }
                 break;
 
@@ -189,6 +402,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
+                    if (!vfExec.back())
+                        nExecFalse--;
                     vfExec.pop_back();
                 }
                 break;
@@ -199,11 +414,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (false -- false) and return
                     if (stack.size() < 1)
                         return false;
-                    bool fValue = CastToBool(stacktop(-1));
-                    if (fValue)
-                        popstack(stack);
-                    else
+                    if (!CastToBool(stacktop(-1)))
                         return false;
+                    stack.pop_back();
                 }
                 break;
 
@@ -222,7 +435,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 1)
                         return false;
                     altstack.push_back(stacktop(-1));
-                    popstack(stack);
+                    stack.pop_back();
                 }
                 break;
 
@@ -231,7 +444,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (altstack.size() < 1)
                         return false;
                     stack.push_back(altstacktop(-1));
-                    popstack(altstack);
+                    altstack.pop_back();
                 }
                 break;
 
@@ -240,8 +453,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- )
                     if (stack.size() < 2)
                         return false;
-                    popstack(stack);
-                    popstack(stack);
+                    stack.pop_back();
+                    stack.pop_back();
                 }
                 break;
 
@@ -250,10 +463,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    CScriptValue value1 = stacktop(-2);
+                    CScriptValue value2 = stacktop(-1);
+                    stack.push_back(value1);
+                    stack.push_back(value2);
                 }
                 break;
 
@@ -262,12 +475,12 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    CScriptValue value1 = stacktop(-3);
+                    CScriptValue value2 = stacktop(-2);
+                    CScriptValue value3 = stacktop(-1);
+                    stack.push_back(value1);
+                    stack.push_back(value2);
+                    stack.push_back(value3);
                 }
                 break;
 
@@ -276,10 +489,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    CScriptValue value1 = stacktop(-4);
+                    CScriptValue value2 = stacktop(-3);
+                    stack.push_back(value1);
+                    stack.push_back(value2);
                 }
                 break;
 
@@ -288,11 +501,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
-                    stack.erase(stack.end()-6, stack.end()-4);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    CScriptValue value1 = stacktop(-6);
+                    CScriptValue value2 = stacktop(-5);
+                    stack.erase(stack.size()-6, 2);
+                    stack.push_back(value1);
+                    stack.push_back(value2);
                 }
                 break;
 
@@ -311,17 +524,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    CScriptValue value = stacktop(-1);
+                    if (CastToBool(value))
+                        stack.push_back(value);
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(MakeValue(arena, stack.size()));
                 }
                 break;
 
@@ -330,7 +542,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- )
                     if (stack.size() < 1)
                         return false;
-                    popstack(stack);
+                    stack.pop_back();
                 }
                 break;
 
@@ -339,8 +551,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-1));
                 }
                 break;
 
@@ -349,7 +560,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2)
                     if (stack.size() < 2)
                         return false;
-                    stack.erase(stack.end() - 2);
+                    stack.erase(stack.size()-2);
                 }
                 break;
 
@@ -358,8 +569,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -370,14 +580,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
-                    popstack(stack);
+                    int64 n;
+                    if (!CastToInt(stacktop(-1), n))
+                        return false;
+                    stack.pop_back();
                     if (n < 0 || n >= stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CScriptValue value = stacktop(-n-1);
                     if (opcode == OP_ROLL)
-                        stack.erase(stack.end()-n-1);
-                    stack.push_back(vch);
+                        stack.erase(stack.size()-n-1);
+                    stack.push_back(value);
                 }
                 break;
 
@@ -407,8 +619,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.insert(stack.end()-2, vch);
+                    stack.insert(stack.size()-2, stacktop(-1));
                 }
                 break;
 
@@ -416,68 +627,12 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 // Splice ops
                 //
-                case OP_CAT:
-                {
-                    // (x1 x2 -- out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
-                    popstack(stack);
-                    if (stacktop(-1).size() > 520)
-                        return false;
-                }
-                break;
-
-                case OP_SUBSTR:
-                {
-                    // (in begin size -- out)
-                    if (stack.size() < 3)
-                        return false;
-                    valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
-                    if (nBegin < 0 || nEnd < nBegin)
-                        return false;
-                    if (nBegin > vch.size())
-                        nBegin = vch.size();
-                    if (nEnd > vch.size())
-                        nEnd = vch.size();
-                    vch.erase(vch.begin() + nEnd, vch.end());
-                    vch.erase(vch.begin(), vch.begin() + nBegin);
-                    popstack(stack);
-                    popstack(stack);
-                }
-                break;
-
-                case OP_LEFT:
-                case OP_RIGHT:
-                {
-                    // (in size -- out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
-                    if (nSize < 0)
-                        return false;
-                    if (nSize > vch.size())
-                        nSize = vch.size();
-                    if (opcode == OP_LEFT)
-                        vch.erase(vch.begin() + nSize, vch.end());
-                    else
-                        vch.erase(vch.begin(), vch.end() - nSize);
-                    popstack(stack);
-                }
-                break;
-
                 case OP_SIZE:
                 {
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(MakeValue(arena, stacktop(-1).nSize));
                 }
                 break;
 
@@ -485,46 +640,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 // Bitwise logic
                 //
-                case OP_INVERT:
-                {
-                    // (in - out)
-                    if (stack.size() < 1)
-                        return false;
-                    valtype& vch = stacktop(-1);
-                    for (int i = 0; i < vch.size(); i++)
-                        vch[i] = ~vch[i];
-                }
-                break;
-
-                case OP_AND:
-                case OP_OR:
-                case OP_XOR:
-                {
-                    // (x1 x2 - out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    MakeSameSize(vch1, vch2);
-                    if (opcode == OP_AND)
-                    {
-                        for (int i = 0; i < vch1.size(); i++)
-                            vch1[i] &= vch2[i];
-                    }
-                    else if (opcode == OP_OR)
-                    {
-                        for (int i = 0; i < vch1.size(); i++)
-                            vch1[i] |= vch2[i];
-                    }
-                    else if (opcode == OP_XOR)
-                    {
-                        for (int i = 0; i < vch1.size(); i++)
-                            vch1[i] ^= vch2[i];
-                    }
-                    popstack(stack);
-                }
-                break;
-
                 case OP_EQUAL:
                 case OP_EQUALVERIFY:
                 //case OP_NOTEQUAL: // use OP_NUMNOTEQUAL
@@ -532,21 +647,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    bool fEqual = (vch1 == vch2);
-                    // OP_NOTEQUAL is disabled because it would be too easy to say
-                    // something like n != 1 and have some wiseguy pass in 1 with extra
-                    // zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
-                    //if (opcode == OP_NOTEQUAL)
-                    //    fEqual = !fEqual;
-                    popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    bool fEqual = (stacktop(-2) == stacktop(-1));
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.push_back(fEqual ? valueTrue : valueFalse);
                     if (opcode == OP_EQUALVERIFY)
                     {
                         if (fEqual)
-                            popstack(stack);
+                            stack.pop_back();
                         else
                             return false;
                     }
@@ -559,8 +667,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 case OP_1ADD:
                 case OP_1SUB:
-                case OP_2MUL:
-                case OP_2DIV:
                 case OP_NEGATE:
                 case OP_ABS:
                 case OP_NOT:
@@ -569,30 +675,25 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    int64 n;
+                    if (!CastToInt(stacktop(-1), n))
+                        return false;
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
-                    case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
                     }
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.pop_back();
+                    stack.push_back(MakeValue(arena, n));
                 }
                 break;
 
                 case OP_ADD:
                 case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_MOD:
-                case OP_LSHIFT:
-                case OP_RSHIFT:
                 case OP_BOOLAND:
                 case OP_BOOLOR:
                 case OP_NUMEQUAL:
@@ -608,66 +709,33 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    int64 n1, n2, n;
+                    if (!CastToInt(stacktop(-2), n1) || !CastToInt(stacktop(-1), n2))
+                        return false;
                     switch (opcode)
                     {
-                    case OP_ADD:
-                        bn = bn1 + bn2;
-                        break;
-
-                    case OP_SUB:
-                        bn = bn1 - bn2;
-                        break;
-
-                    case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
-                    case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
-
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    case OP_ADD:                 n = n1 + n2; break;
+                    case OP_SUB:                 n = n1 - n2; break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
                     }
-                    popstack(stack);
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.push_back(MakeValue(arena, n));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
                         if (CastToBool(stacktop(-1)))
-                            popstack(stack);
+                            stack.pop_back();
                         else
                             return false;
                     }
@@ -679,14 +747,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
-                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
-                    popstack(stack);
-                    popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fValue ? vchTrue : vchFalse);
+                    int64 n1, n2, n3;
+                    if (!CastToInt(stacktop(-3), n1) || !CastToInt(stacktop(-2), n2) || !CastToInt(stacktop(-1), n3))
+                        return false;
+                    bool fValue = (n2 <= n1 && n1 < n3);
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.push_back(fValue ? valueTrue : valueFalse);
                 }
                 break;
 
@@ -703,33 +771,35 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CScriptValue& value = stacktop(-1);
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
+                    unsigned char* pchHash = arena.Alloc(nHashSize);
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(value.pch, value.nSize, pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(value.pch, value.nSize, pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(value.pch, value.nSize, pchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint256 hash1;
+                        SHA256(value.pch, value.nSize, (unsigned char*)&hash1);
+                        RIPEMD160((unsigned char*)&hash1, sizeof(hash1), pchHash);
                     }
                     else if (opcode == OP_HASH256)
                     {
-                        uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        uint256 hash = Hash(value.pch, value.pch + value.nSize);
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    value.pch = pchHash;
+                    value.nSize = nHashSize;
                 }
                 break;
 
                 case OP_CODESEPARATOR:
                 {
                     // Hash starts after the code separator
-                    pbegincodehash = pc;
+                    nBeginCodeHash = op.nNext;
                 }
                 break;
 
@@ -740,28 +810,24 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
-
-                    ////// debug print
-                    //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
-                    //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
+                    valtype vchSig    = stacktop(-2).ToVch();
+                    valtype vchPubKey = stacktop(-1).ToVch();
 
                     // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
+                    CScript scriptCode(script.begin() + nBeginCodeHash, script.end());
 
                     // Drop the signature, since there's no way for a signature to sign itself
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
 
-                    popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.push_back(fSuccess ? valueTrue : valueFalse);
                     if (opcode == OP_CHECKSIGVERIFY)
                     {
                         if (fSuccess)
-                            popstack(stack);
+                            stack.pop_back();
                         else
                             return false;
                     }
@@ -777,18 +843,23 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int64 n;
+                    if (!CastToInt(stacktop(-i), n))
+                        return false;
+                    int nKeysCount = (int)n;
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
-                    nOpCount += nKeysCount;
-                    if (nOpCount > 201)
+                    nOpCountKeys += nKeysCount;
+                    if (op.nOpCount + nOpCountKeys > 201)
                         return false;
                     int ikey = ++i;
                     i += nKeysCount;
                     if (stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    if (!CastToInt(stacktop(-i), n))
+                        return false;
+                    int nSigsCount = (int)n;
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -797,23 +868,17 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
+                    CScript scriptCode(script.begin() + nBeginCodeHash, script.end());
 
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
-                    {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
-                    }
+                        scriptCode.FindAndDelete(CScript(stacktop(-isig-k).ToVch()));
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
-
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(stacktop(-isig).ToVch(), stacktop(-ikey).ToVch(), scriptCode, txTo, nIn, nHashType))
                         {
                             isig++;
                             nSigsCount--;
@@ -827,14 +892,13 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                             fSuccess = false;
                     }
 
-                    while (i-- > 0)
-                        popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.erase(stack.size()-i, i);
+                    stack.push_back(fSuccess ? valueTrue : valueFalse);
 
                     if (opcode == OP_CHECKMULTISIGVERIFY)
                     {
                         if (fSuccess)
-                            popstack(stack);
+                            stack.pop_back();
                         else
                             return false;
                     }
@@ -862,6 +926,29 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CScriptArena arena;
+    CScriptStack stackEval;
+    BOOST_FOREACH(const valtype& vch, stack)
+    {
+        CScriptValue value;
+        value.pch = vch.empty() ? pchTrue : &vch[0];
+        value.nSize = vch.size();
+        stackEval.push_back(value);
+    }
+
+    bool fRet = EvalScript(stackEval, arena, script, txTo, nIn, nHashType);
+
+    vector<valtype> stackRet;
+    stackRet.reserve(stackEval.size());
+    for (unsigned int i = 0; i < stackEval.size(); i++)
+        stackRet.push_back(stackEval[i].ToVch());
+    stack.swap(stackRet);
+    return fRet;
+}
+
+
 
 
 
@@ -933,13 +1020,10 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+// Everything in a signature check up to the ECDSA verify
+bool static MakeSigCheck(vector<unsigned char> vchSig, const vector<unsigned char>& vchPubKey, const CScript& scriptCode,
+                         const CTransaction& txTo, unsigned int nIn, int nHashType, CSigCheck& checkRet)
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -949,9 +1033,23 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    return key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig);
+    checkRet.hash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    checkRet.vchSig.swap(vchSig);
+    checkRet.vchPubKey = vchPubKey;
+    return true;
 }
 
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CSigCheck check;
+    if (!MakeSigCheck(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, check))
+        return false;
+    return check.Verify();
+}
+
+
+
 
 
 
@@ -959,10 +1057,133 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Standard templates
+//
+
+// The two standard scripts, matched by their exact byte layout.  Anything
+// that isn't laid out this way, even if it would mean the same thing, is
+// left to Solver's template scan or the interpreter.
+bool static MatchPayToPubKey(const CScript& script, const unsigned char*& pchPubKey, unsigned int& nSize)
+{
+    // <pubkey> OP_CHECKSIG
+    if (script.size() < 35 || script.size() > 77)
+        return false;
+    nSize = script[0];
+    if (nSize < 33 || nSize > 75 || script.size() != nSize + 2 || script[nSize + 1] != OP_CHECKSIG)
+        return false;
+    pchPubKey = &script[1];
+    return true;
+}
+
+bool static MatchPayToPubKeyHash(const CScript& script, const unsigned char*& pchHash)
+{
+    // OP_DUP OP_HASH160 <hash160> OP_EQUALVERIFY OP_CHECKSIG
+    if (script.size() != 25 || script[0] != OP_DUP || script[1] != OP_HASH160 || script[2] != sizeof(uint160) ||
+        script[23] != OP_EQUALVERIFY || script[24] != OP_CHECKSIG)
+        return false;
+    pchHash = &script[3];
+    return true;
+}
+
+// Script made of exactly nCount data pushes
+bool static MatchPushes(const CScript& script, CScriptValue* pvalue, unsigned int nCount)
+{
+    CScript::const_iterator pc = script.begin();
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        unsigned int nBegin = pc - script.begin();
+        opcodetype opcode;
+        if (!script.GetOp2(pc, opcode, NULL) || opcode > OP_PUSHDATA4)
+            return false;
+        unsigned int nData = nBegin + 1;
+        if (opcode == OP_PUSHDATA1)
+            nData += 1;
+        else if (opcode == OP_PUSHDATA2)
+            nData += 2;
+        else if (opcode == OP_PUSHDATA4)
+            nData += 4;
+        pvalue[i].pch = &script[0] + nData;
+        pvalue[i].nSize = (pc - script.begin()) - nData;
+        if (pvalue[i].nSize > 520)
+            return false;
+    }
+    return pc == script.end();
+}
+
+// Spends of the standard scripts go straight to the signature check, doing
+// exactly what the interpreter would have.  Returns false if the pair isn't
+// in standard form and has to be run.  With pvChecks the signature check
+// itself is left there for the caller, and fValidRet only says whether
+// everything else passed.
+bool static VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                                 bool& fValidRet, vector<CSigCheck>* pvChecks)
+{
+    const unsigned char* pch;
+    unsigned int nSize;
+    CScriptValue vvalue[2];
+    valtype vchSig;
+    valtype vchPubKey;
+    if (MatchPayToPubKey(scriptPubKey, pch, nSize))
+    {
+        if (!MatchPushes(scriptSig, vvalue, 1))
+            return false;
+        vchSig = vvalue[0].ToVch();
+        vchPubKey.assign(pch, pch + nSize);
+    }
+    else if (MatchPayToPubKeyHash(scriptPubKey, pch))
+    {
+        if (!MatchPushes(scriptSig, vvalue, 2))
+            return false;
+        vchSig = vvalue[0].ToVch();
+        vchPubKey = vvalue[1].ToVch();
+        uint160 hash160 = Hash160(vchPubKey);
+        if (memcmp(&hash160, pch, sizeof(hash160)) != 0)
+        {
+            fValidRet = false;
+            return true;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    // No code separator, so the whole scriptPubKey less the signature
+    CScript scriptCode(scriptPubKey);
+    scriptCode.FindAndDelete(CScript(vchSig));
+    if (pvChecks)
+    {
+        CSigCheck check;
+        fValidRet = MakeSigCheck(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, check);
+        if (fValidRet)
+            pvChecks->push_back(check);
+    }
+    else
+    {
+        fValidRet = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+    }
+    return true;
+}
 
 
 bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
 {
+    // Standard layouts don't need the template scan
+    const unsigned char* pch;
+    unsigned int nSize;
+    if (MatchPayToPubKey(scriptPubKey, pch, nSize))
+    {
+        vSolutionRet.assign(1, make_pair(OP_PUBKEY, valtype(pch, pch + nSize)));
+        return true;
+    }
+    if (MatchPayToPubKeyHash(scriptPubKey, pch))
+    {
+        vSolutionRet.assign(1, make_pair(OP_PUBKEYHASH, valtype(pch, pch + sizeof(uint160))));
+        return true;
+    }
+
     // Templates
     static vector<CScript> vTemplates;
     if (vTemplates.empty())
@@ -1150,12 +1371,18 @@ bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret)
 }
 
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                  vector<CSigCheck>* pvChecks)
 {
-    vector<vector<unsigned char> > stack;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    bool fValid;
+    if (VerifyStandardScript(scriptSig, scriptPubKey, txTo, nIn, nHashType, fValid, pvChecks))
+        return fValid;
+
+    CScriptArena arena;
+    CScriptStack stack;
+    if (!EvalScript(stack, arena, scriptSig, txTo, nIn, nHashType))
         return false;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, arena, scriptPubKey, txTo, nIn, nHashType))
         return false;
     if (stack.empty())
         return false;
@@ -1178,6 +1405,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
         return false;
 
     txin.scriptSig = scriptPrereq + txin.scriptSig;
+    txTo.InvalidateHash();
 
     // Test solution
     if (scriptPrereq.empty())
@@ -1188,7 +1416,8 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 }
 
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                     vector<CSigCheck>* pvChecks)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1199,7 +1428,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, nHashType))
+    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, nHashType, pvChecks))
         return false;
 
     return true;
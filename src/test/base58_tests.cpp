@@ -0,0 +1,167 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+#include "insecure_rand.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(base58_tests)
+
+//
+// The codec as it was before it stopped using CBigNum, kept as the
+// reference the new one has to agree with
+//
+static string ReferenceEncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
+{
+    CAutoBN_CTX pctx;
+    CBigNum bn58 = 58;
+    CBigNum bn0 = 0;
+
+    vector<unsigned char> vchTmp(pend-pbegin+1, 0);
+    reverse_copy(pbegin, pend, vchTmp.begin());
+
+    CBigNum bn;
+    bn.setvch(vchTmp);
+
+    string str;
+    str.reserve((pend - pbegin) * 138 / 100 + 1);
+    CBigNum dv;
+    CBigNum rem;
+    while (bn > bn0)
+    {
+        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
+            throw bignum_error("EncodeBase58 : BN_div failed");
+        bn = dv;
+        unsigned int c = rem.getulong();
+        str += pszBase58[c];
+    }
+
+    for (const unsigned char* p = pbegin; p < pend && *p == 0; p++)
+        str += pszBase58[0];
+
+    reverse(str.begin(), str.end());
+    return str;
+}
+
+static bool ReferenceDecodeBase58(const char* psz, vector<unsigned char>& vchRet)
+{
+    CAutoBN_CTX pctx;
+    vchRet.clear();
+    CBigNum bn58 = 58;
+    CBigNum bn = 0;
+    CBigNum bnChar;
+    while (isspace(*psz))
+        psz++;
+
+    for (const char* p = psz; *p; p++)
+    {
+        const char* p1 = strchr(pszBase58, *p);
+        if (p1 == NULL)
+        {
+            while (isspace(*p))
+                p++;
+            if (*p != '\0')
+                return false;
+            break;
+        }
+        bnChar.setulong(p1 - pszBase58);
+        if (!BN_mul(&bn, &bn, &bn58, pctx))
+            throw bignum_error("DecodeBase58 : BN_mul failed");
+        bn += bnChar;
+    }
+
+    vector<unsigned char> vchTmp = bn.getvch();
+
+    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
+        vchTmp.erase(vchTmp.end()-1);
+
+    int nLeadingZeros = 0;
+    for (const char* p = psz; *p == pszBase58[0]; p++)
+        nLeadingZeros++;
+    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
+
+    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    return true;
+}
+
+static string ReferenceHash160ToAddress(uint160 hash160)
+{
+    vector<unsigned char> vch(1, uAddressVersion);
+    vch.insert(vch.end(), UBEGIN(hash160), UEND(hash160));
+    uint256 hash = Hash(vch.begin(), vch.end());
+    vch.insert(vch.end(), (unsigned char*)&hash, (unsigned char*)&hash + 4);
+    return ReferenceEncodeBase58(&vch[0], &vch[0] + vch.size());
+}
+
+BOOST_AUTO_TEST_CASE(known_addresses)
+{
+    // The genesis block's coinbase pays to this address on the main chain
+    uint160 hash160;
+    vector<unsigned char> vch = ParseHex("0062e907b15cbf27d5425399ebf6f0fb50ebb88f18");
+    memcpy(&hash160, &vch[1], sizeof(hash160));
+    BOOST_CHECK_EQUAL(EncodeBase58Check(vch), "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa");
+
+    vector<unsigned char> vchDecoded;
+    BOOST_CHECK(DecodeBase58Check("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa", vchDecoded));
+    BOOST_CHECK(vchDecoded == vch);
+    BOOST_CHECK(!DecodeBase58Check("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNb", vchDecoded));
+    BOOST_CHECK(!DecodeBase58Check("1A1zP1eP5QGefi2DMPTfTL5SLmv7Divf0a", vchDecoded));
+
+    BOOST_CHECK_EQUAL(EncodeBase58((const unsigned char*)"", (const unsigned char*)""), "");
+    BOOST_CHECK(DecodeBase58("", vchDecoded) && vchDecoded.empty());
+    BOOST_CHECK(DecodeBase58(" \t\n ", vchDecoded) && vchDecoded.empty());
+    BOOST_CHECK(DecodeBase58(" 111 ", vchDecoded) && vchDecoded == vector<unsigned char>(3, 0));
+}
+
+BOOST_AUTO_TEST_CASE(matches_reference)
+{
+    for (int n = 0; n < 3000; n++)
+    {
+        // Random bytes, now and then with leading zeros, out past the stack buffer
+        vector<unsigned char> vch(InsecureRand(n % 10 == 0 ? 200 : 40));
+        for (unsigned int i = 0; i < vch.size(); i++)
+            vch[i] = InsecureRand(256);
+        for (unsigned int i = 0; i < vch.size() && InsecureRand(3) == 0; i++)
+            vch[i] = 0;
+        const unsigned char* pbegin = vch.empty() ? NULL : &vch[0];
+
+        string str = EncodeBase58(pbegin, pbegin + vch.size());
+        BOOST_CHECK_EQUAL(str, ReferenceEncodeBase58(pbegin, pbegin + vch.size()));
+
+        vector<unsigned char> vchDecoded;
+        BOOST_CHECK(DecodeBase58(str, vchDecoded));
+        BOOST_CHECK(vchDecoded == vch);
+
+        // Mangle it and both have to give the same answer
+        static const char pchMangle[] = " \t\n0OIlx1z+";
+        for (int m = 0; m < 3; m++)
+        {
+            string strMangled = str;
+            strMangled.insert(InsecureRand(strMangled.size() + 1), 1, pchMangle[InsecureRand(sizeof(pchMangle) - 1)]);
+            if (InsecureRand(2))
+                strMangled.insert(0, 1, ' ');
+            vector<unsigned char> vchReference;
+            bool fReference = ReferenceDecodeBase58(strMangled.c_str(), vchReference);
+            BOOST_CHECK_EQUAL(DecodeBase58(strMangled, vchDecoded), fReference);
+            BOOST_CHECK(vchDecoded == vchReference);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(addresses_match_reference)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint160 hash160;
+        for (unsigned int j = 0; j < sizeof(hash160); j++)
+            UBEGIN(hash160)[j] = InsecureRand(256);
+        string strAddress = Hash160ToAddress(hash160);
+        BOOST_CHECK_EQUAL(strAddress, ReferenceHash160ToAddress(hash160));
+
+        uint160 hash160Decoded;
+        BOOST_CHECK(AddressToHash160(strAddress, hash160Decoded));
+        BOOST_CHECK(hash160Decoded == hash160);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,80 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+#include "insecure_rand.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(murmurhash3)
+{
+    // Test vectors from the reference implementation
+    static const struct { unsigned int nExpected; unsigned int nSeed; const char* pszHex; } vTests[] =
+    {
+        { 0x00000000, 0x00000000, "" },
+        { 0x6a396f08, 0xFBA4C795, "" },
+        { 0x81f16f39, 0xffffffff, "" },
+        { 0x514e28b7, 0x00000000, "00" },
+        { 0xea3f0b17, 0xFBA4C795, "00" },
+        { 0xfd6cf10d, 0x00000000, "ff" },
+        { 0x16c6b7ab, 0x00000000, "0011" },
+        { 0x8eb51c3d, 0x00000000, "001122" },
+        { 0xb4471bf8, 0x00000000, "00112233" },
+        { 0xe2301fa8, 0x00000000, "0011223344" },
+        { 0xfc2e4a15, 0x00000000, "001122334455" },
+        { 0xb074502c, 0x00000000, "00112233445566" },
+        { 0x8034d2a0, 0x00000000, "0011223344556677" },
+        { 0xb4698def, 0x00000000, "001122334455667788" },
+    };
+    for (unsigned int i = 0; i < ARRAYLEN(vTests); i++)
+    {
+        vector<unsigned char> vch = ParseHex(vTests[i].pszHex);
+        BOOST_CHECK_EQUAL(MurmurHash3(vTests[i].nSeed, vch.empty() ? NULL : &vch[0], vch.size()), vTests[i].nExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rolling_filter)
+{
+    CRollingBloomFilter filter(100, 0.01);
+    unsigned int nMemory = filter.GetMemoryUsage();
+
+    // The last 100 inserted are always there
+    vector<uint256> vHash;
+    for (int i = 0; i < 100; i++)
+    {
+        vHash.push_back(InsecureRandHash());
+        filter.insert(vHash.back());
+    }
+    BOOST_FOREACH(const uint256& hash, vHash)
+        BOOST_CHECK(filter.contains(hash));
+
+    // Three more generations push all of them out, bar false positives
+    for (int i = 0; i < 150; i++)
+        filter.insert(InsecureRandHash());
+    int nStillThere = 0;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        if (filter.contains(hash))
+            nStillThere++;
+    BOOST_CHECK(nStillThere <= 10);
+    BOOST_CHECK_EQUAL(filter.GetMemoryUsage(), nMemory);
+
+    // False positives stay near the rate it was sized for
+    CRollingBloomFilter filterBig(10000, 0.001);
+    for (int i = 0; i < 10000; i++)
+        filterBig.insert(InsecureRandHash());
+    int nFalsePositives = 0;
+    for (int i = 0; i < 100000; i++)
+        if (filterBig.contains(InsecureRandHash()))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 300);
+
+    filterBig.reset();
+    int nAfterReset = 0;
+    for (int i = 0; i < 1000; i++)
+        if (filterBig.contains(InsecureRandHash()))
+            nAfterReset++;
+    BOOST_CHECK_EQUAL(nAfterReset, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,135 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(download_tests)
+
+static CInv TxInv(int n)
+{
+    return CInv(MSG_TX, uint256(n + 1));
+}
+
+static vector<CInv> Request(CDownloadScheduler& scheduler, int nPeerId, int64 nNow)
+{
+    vector<CInv> vRequest;
+    scheduler.GetRequests(nPeerId, nNow, vRequest);
+    BOOST_FOREACH(const CInv& inv, vRequest)
+        scheduler.MarkRequested(nPeerId, inv, nNow);
+    return vRequest;
+}
+
+BOOST_AUTO_TEST_CASE(one_peer_at_a_time)
+{
+    CDownloadScheduler scheduler;
+    CInv inv = TxInv(0);
+    scheduler.Announce(1, inv, 1000);
+    scheduler.Announce(2, inv, 1000);
+
+    BOOST_CHECK_EQUAL(Request(scheduler, 1, 1000).size(), 1);
+    BOOST_CHECK(scheduler.IsInFlight(inv));
+    BOOST_CHECK(Request(scheduler, 2, 1000).empty());
+
+    // Peer 1 never answers, so it goes to peer 2 after the timeout
+    BOOST_CHECK(Request(scheduler, 2, 1000 + REQUEST_TIMEOUT).empty());
+    BOOST_CHECK_EQUAL(Request(scheduler, 2, 1001 + REQUEST_TIMEOUT).size(), 1);
+    BOOST_CHECK_EQUAL(scheduler.nTimeouts, 1);
+    BOOST_CHECK_EQUAL(scheduler.mapPeers[1].nTimeouts, 1);
+    BOOST_CHECK_EQUAL(scheduler.mapPeers[1].nInFlight, 0);
+
+    // Peer 2 delivers, late peer 1 is a duplicate
+    scheduler.Received(2, inv, 1500 + REQUEST_TIMEOUT, false);
+    BOOST_CHECK(!scheduler.IsInFlight(inv));
+    BOOST_CHECK_EQUAL(scheduler.mapPeers[2].nLatency, 499);
+    scheduler.Received(1, inv, 1600 + REQUEST_TIMEOUT, true);
+    BOOST_CHECK_EQUAL(scheduler.nReceived, 1);
+    BOOST_CHECK_EQUAL(scheduler.nDuplicates, 1);
+    BOOST_CHECK(scheduler.mapItems.empty());
+    BOOST_CHECK(scheduler.setInFlight.empty());
+}
+
+BOOST_AUTO_TEST_CASE(in_flight_limit)
+{
+    CDownloadScheduler scheduler;
+    for (int i = 0; i < MAX_REQUESTS_IN_FLIGHT_PER_PEER + 10; i++)
+        scheduler.Announce(1, TxInv(i), 1000 + i);
+
+    // Oldest announcements first, never more than the limit outstanding
+    vector<CInv> vRequest = Request(scheduler, 1, 2000);
+    BOOST_CHECK_EQUAL(vRequest.size(), MAX_REQUESTS_IN_FLIGHT_PER_PEER);
+    BOOST_CHECK(vRequest[0].hash == TxInv(0).hash);
+    BOOST_CHECK(Request(scheduler, 1, 2000).empty());
+
+    scheduler.Received(1, TxInv(0), 2100, false);
+    scheduler.Received(1, TxInv(1), 2100, false);
+    vRequest = Request(scheduler, 1, 2100);
+    BOOST_CHECK_EQUAL(vRequest.size(), 2);
+    BOOST_CHECK(vRequest[0].hash == TxInv(MAX_REQUESTS_IN_FLIGHT_PER_PEER).hash);
+    BOOST_CHECK_EQUAL(scheduler.mapPeers[1].nLatency, 100);
+}
+
+BOOST_AUTO_TEST_CASE(same_time_announcements)
+{
+    // Announced in the same millisecond, against the order of their hashes
+    CDownloadScheduler scheduler;
+    for (int i = 4; i >= 0; i--)
+        scheduler.Announce(1, TxInv(i), 1000);
+
+    vector<CInv> vRequest = Request(scheduler, 1, 1000);
+    BOOST_CHECK_EQUAL(vRequest.size(), 5);
+    for (unsigned int i = 0; i < vRequest.size(); i++)
+        BOOST_CHECK(vRequest[i].hash == TxInv(4 - i).hash);
+}
+
+BOOST_AUTO_TEST_CASE(prefer_fast_peer)
+{
+    CDownloadScheduler scheduler;
+
+    // Peer 1 answers in 50ms, peer 2 in 900ms
+    scheduler.Announce(1, TxInv(0), 0);
+    scheduler.Announce(2, TxInv(1), 0);
+    Request(scheduler, 1, 0);
+    Request(scheduler, 2, 0);
+    scheduler.Received(1, TxInv(0), 50, false);
+    scheduler.Received(2, TxInv(1), 900, false);
+
+    // Peer 2 gets the turn first but leaves it to peer 1
+    CInv inv = TxInv(2);
+    scheduler.Announce(2, inv, 1000);
+    scheduler.Announce(1, inv, 1001);
+    BOOST_CHECK(Request(scheduler, 2, 1010).empty());
+    BOOST_CHECK_EQUAL(Request(scheduler, 1, 1010).size(), 1);
+
+    // Not for longer than PREFER_FAST_PEER_DELAY though
+    inv = TxInv(3);
+    scheduler.Announce(2, inv, 2000);
+    scheduler.Announce(1, inv, 2000);
+    BOOST_CHECK(Request(scheduler, 2, 2000 + PREFER_FAST_PEER_DELAY - 1).empty());
+    BOOST_CHECK_EQUAL(Request(scheduler, 2, 2000 + PREFER_FAST_PEER_DELAY).size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(forget_peer)
+{
+    CDownloadScheduler scheduler;
+    scheduler.Announce(1, TxInv(0), 0);
+    scheduler.Announce(1, TxInv(1), 0);
+    scheduler.Announce(2, TxInv(0), 0);
+    Request(scheduler, 1, 0);
+
+    // A peer going away frees its requests without waiting for the timeout
+    scheduler.ForgetPeer(1);
+    BOOST_CHECK(!scheduler.mapPeers.count(1));
+    BOOST_CHECK(scheduler.setInFlight.empty());
+    BOOST_CHECK_EQUAL(scheduler.mapItems.size(), 1);
+    vector<CInv> vRequest = Request(scheduler, 2, 10);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1);
+    BOOST_CHECK(vRequest[0].hash == TxInv(0).hash);
+
+    scheduler.Forget(TxInv(0));
+    BOOST_CHECK(scheduler.mapItems.empty());
+    BOOST_CHECK_EQUAL(scheduler.mapPeers[2].nInFlight, 0);
+    BOOST_CHECK(scheduler.mapPeers[2].setAnnounced.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,136 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+
+using namespace std;
+
+//
+// Builds a short chain on a throwaway root block with the proof of work
+// limit opened right up, so headers can be mined on the spot
+//
+struct HeadersFixture
+{
+    uint256 nProofOfWorkLimitSaved;
+    bool fTestNetSaved;
+    CBlockIndex* pindexBestSaved;
+    CBlock root;
+    CBlockIndex* pindexRoot;
+
+    HeadersFixture()
+    {
+        nProofOfWorkLimitSaved = nProofOfWorkLimit;
+        fTestNetSaved = fTestNet;
+        pindexBestSaved = pindexBest;
+        nProofOfWorkLimit = ~uint256(0) >> 1;
+        fTestNet = false;
+
+        root.nVersion = 1;
+        root.nTime = GetAdjustedTime() - 100 * 24 * 60 * 60;
+        root.nBits = nProofOfWorkLimit.GetCompact();
+        pindexRoot = new CBlockIndex(0, 0, root);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(root.GetHash(), pindexRoot)).first;
+        pindexRoot->phashBlock = &((*mi).first);
+        pindexRoot->nChainWork = pindexRoot->GetBlockWork();
+        pindexBest = pindexRoot;
+    }
+
+    ~HeadersFixture()
+    {
+        CRITICAL_BLOCK(cs_main)
+            FinishHeadersFirst();
+        mapBlockIndex.erase(root.GetHash());
+        delete pindexRoot;
+        pindexBest = pindexBestSaved;
+        fTestNet = fTestNetSaved;
+        nProofOfWorkLimit = nProofOfWorkLimitSaved;
+    }
+};
+
+static CBlock MineHeader(const CBlock& prev, unsigned int nBits)
+{
+    CBlock header;
+    header.nVersion = 1;
+    header.hashPrevBlock = prev.GetHash();
+    header.nTime = prev.nTime + 10 * 60;
+    header.nBits = nBits;
+    uint256 hashTarget = uint256().SetCompact(nBits);
+    while (header.GetHash() > hashTarget)
+        header.nNonce++;
+    return header;
+}
+
+static bool AcceptHeaders(const CBlock& start, int nCount, CBlock& lastRet)
+{
+    lastRet = start;
+    for (int i = 0; i < nCount; i++)
+    {
+        lastRet = MineHeader(lastRet, start.nBits);
+        bool fAccepted = false;
+        CRITICAL_BLOCK(cs_main)
+            fAccepted = AcceptBlockHeader(lastRet);
+        if (!fAccepted)
+            return false;
+    }
+    return true;
+}
+
+BOOST_FIXTURE_TEST_SUITE(headers_tests, HeadersFixture)
+
+BOOST_AUTO_TEST_CASE(header_chain)
+{
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), 0);
+
+    CBlock tip;
+    BOOST_CHECK(AcceptHeaders(root, 10, tip));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), 10);
+
+    // Already known headers are fine to get again
+    CRITICAL_BLOCK(cs_main)
+        BOOST_CHECK(AcceptBlockHeader(tip));
+
+    // A shorter fork doesn't take over
+    CBlock fork;
+    BOOST_CHECK(AcceptHeaders(root, 5, fork));
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), 10);
+
+    // Caught up, the header index is thrown away
+    CRITICAL_BLOCK(cs_main)
+        FinishHeadersFirst();
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(bad_headers)
+{
+    CBlock tip;
+    BOOST_CHECK(AcceptHeaders(root, 3, tip));
+
+    CRITICAL_BLOCK(cs_main)
+    {
+        // Nothing to connect to
+        CBlock orphan = MineHeader(tip, tip.nBits);
+        orphan.hashPrevBlock = 1;
+        BOOST_CHECK(!AcceptBlockHeader(orphan));
+
+        // Harder than the chain asks for is still wrong
+        CBlock harder = MineHeader(tip, (nProofOfWorkLimit >> 1).GetCompact());
+        BOOST_CHECK(!AcceptBlockHeader(harder));
+
+        // Not solved
+        CBlock unsolved = MineHeader(tip, tip.nBits);
+        while (unsolved.GetHash() <= uint256().SetCompact(unsolved.nBits))
+            unsolved.nNonce++;
+        BOOST_CHECK(!AcceptBlockHeader(unsolved));
+
+        // Too early
+        CBlock early = tip;
+        early.hashPrevBlock = tip.GetHash();
+        early.nTime = root.nTime;
+        early.nNonce = 0;
+        while (early.GetHash() > uint256().SetCompact(early.nBits))
+            early.nNonce++;
+        BOOST_CHECK(!AcceptBlockHeader(early));
+    }
+    BOOST_CHECK_EQUAL(GetBestHeaderHeight(), 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
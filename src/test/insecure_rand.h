@@ -0,0 +1,25 @@
+#ifndef BITCOIN_TEST_INSECURE_RAND_H
+#define BITCOIN_TEST_INSECURE_RAND_H
+
+//
+// Quick, repeatable pseudo-random numbers for the tests and benchmarks.
+// Never for anything that has to be unpredictable.  Only the high bits are
+// used, the low bits of this generator repeat within a few thousand hashes.
+//
+static unsigned int nInsecureRandState = 1;
+
+static inline unsigned int InsecureRand(unsigned int nMax)
+{
+    nInsecureRandState = nInsecureRandState * 1103515245 + 12345;
+    return (nInsecureRandState >> 16) % nMax;
+}
+
+static inline uint256 InsecureRandHash()
+{
+    uint256 hash;
+    for (unsigned char* p = (unsigned char*)&hash; p < (unsigned char*)&hash + sizeof(hash); p++)
+        *p = InsecureRand(256);
+    return hash;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(key_tests)
+
+static vector<unsigned char> CompressPubKey(const vector<unsigned char>& vchPubKey)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char* pbegin = &vchPubKey[0];
+    BOOST_CHECK(o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()));
+    EC_KEY_set_conv_form(pkey, POINT_CONVERSION_COMPRESSED);
+    vector<unsigned char> vchRet(i2o_ECPublicKey(pkey, NULL));
+    unsigned char* pch = &vchRet[0];
+    i2o_ECPublicKey(pkey, &pch);
+    EC_KEY_free(pkey);
+    return vchRet;
+}
+
+BOOST_AUTO_TEST_CASE(pubkey_cache)
+{
+    CKey key;
+    key.MakeNewKey();
+    vector<unsigned char> vchPubKey = key.GetPubKey();
+    uint256 hash = Hash(vchPubKey.begin(), vchPubKey.end());
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    // Same answers as a freshly decoded key, the second time from the cache
+    for (int i = 0; i < 2; i++)
+    {
+        BOOST_CHECK(CKey::Verify(vchPubKey, hash, vchSig));
+        BOOST_CHECK(CKey::Verify(CompressPubKey(vchPubKey), hash, vchSig));
+        BOOST_CHECK(!CKey::Verify(vchPubKey, hash + 1, vchSig));
+    }
+    vector<unsigned char> vchBad = vchPubKey;
+    vchBad[10] ^= 1;
+    BOOST_CHECK(!CKey::Verify(vchBad, hash, vchSig));
+    BOOST_CHECK(!CKey::Verify(vector<unsigned char>(), hash, vchSig));
+
+    // Least recently used goes first, keys that don't decode never go in
+    CPubKeyCache cache(2);
+    vector<vector<unsigned char> > vchKeys;
+    for (int i = 0; i < 3; i++)
+    {
+        CKey keyNew;
+        keyNew.MakeNewKey();
+        vchKeys.push_back(keyNew.GetPubKey());
+    }
+    EC_KEY_free(cache.Get(vchKeys[0]));
+    EC_KEY_free(cache.Get(vchKeys[1]));
+    EC_KEY_free(cache.Get(vchKeys[0]));
+    EC_KEY_free(cache.Get(vchKeys[2]));
+    BOOST_CHECK(cache.Get(vchBad) == NULL);
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK_EQUAL(cache.nHits, 1U);
+    BOOST_CHECK_EQUAL(cache.nMisses, 4U);
+    EC_KEY_free(cache.Get(vchKeys[0]));
+    EC_KEY_free(cache.Get(vchKeys[2]));
+    BOOST_CHECK_EQUAL(cache.nHits, 3U);
+    EC_KEY_free(cache.Get(vchKeys[1]));
+    BOOST_CHECK_EQUAL(cache.nMisses, 5U);
+
+    // A key handed out stays good after it's evicted
+    EC_KEY* pkey = cache.Get(vchPubKey);
+    cache.Clear();
+    BOOST_CHECK(ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1);
+    EC_KEY_free(pkey);
+}
+
+BOOST_AUTO_TEST_CASE(verify_batch)
+{
+    vector<CSigCheck> vChecks;
+    for (int i = 0; i < 8; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        for (int j = 0; j < 25; j++)
+        {
+            CSigCheck check;
+            check.hash = Hash(BEGIN(i), END(i), BEGIN(j), END(j));
+            check.vchPubKey = key.GetPubKey();
+            BOOST_CHECK(key.Sign(check.hash, check.vchSig));
+            vChecks.push_back(check);
+        }
+    }
+
+    vector<unsigned char> vfValid;
+    BOOST_CHECK(CKey::VerifyBatch(vector<CSigCheck>(), vfValid));
+    BOOST_CHECK(vfValid.empty());
+
+    BOOST_CHECK(CKey::VerifyBatch(vChecks, vfValid));
+    BOOST_CHECK_EQUAL(vfValid.size(), vChecks.size());
+    BOOST_FOREACH(const CSigCheck& check, vChecks)
+        BOOST_CHECK(check.Verify());
+
+    // Results line up with the checks they belong to
+    vChecks[3].hash = vChecks[3].hash + 1;
+    vChecks[77].vchSig[10] ^= 1;
+    vChecks[199].vchPubKey = vChecks[0].vchPubKey;
+    BOOST_CHECK(!CKey::VerifyBatch(vChecks, vfValid));
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+        BOOST_CHECK_EQUAL((bool)vfValid[i], (i != 3 && i != 77 && i != 199));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,1412 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+#include "insecure_rand.h"
+
+using namespace std;
+
+extern CBigNum CastToBigNum(const vector<unsigned char>& vch);
+extern bool CastToBool(const vector<unsigned char>& vch);
+extern void MakeSameSize(vector<unsigned char>& vch1, vector<unsigned char>& vch2);
+extern bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, vector<unsigned char> > >& vSolutionRet);
+
+BOOST_AUTO_TEST_SUITE(script_tests)
+
+//
+// The interpreter as it was before scripts were decoded up front, kept as
+// the reference EvalScript has to agree with
+//
+typedef vector<unsigned char> valtype;
+static const valtype vchFalse(0);
+static const valtype vchTrue(1, 1);
+static const CBigNum bnZero(0);
+static const CBigNum bnOne(1);
+
+#define stacktop(i)  (stack.at(stack.size()+(i)))
+#define altstacktop(i)  (altstack.at(altstack.size()+(i)))
+static inline void popstack(vector<valtype>& stack)
+{
+    if (stack.empty())
+        throw runtime_error("popstack() : stack empty");
+    stack.pop_back();
+}
+
+bool static ReferenceEvalScript(vector<valtype>& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CAutoBN_CTX pctx;
+    CScript::const_iterator pc = script.begin();
+    CScript::const_iterator pend = script.end();
+    CScript::const_iterator pbegincodehash = script.begin();
+    opcodetype opcode;
+    valtype vchPushValue;
+    vector<bool> vfExec;
+    vector<valtype> altstack;
+    if (script.size() > 10000)
+        return false;
+    int nOpCount = 0;
+
+
+    try
+    {
+        while (pc < pend)
+        {
+            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+
+            //
+            // Read instruction
+            //
+            if (!script.GetOp(pc, opcode, vchPushValue))
+                return false;
+            if (vchPushValue.size() > 520)
+                return false;
+            if (opcode > OP_16 && ++nOpCount > 201)
+                return false;
+
+            if (opcode == OP_CAT ||
+                opcode == OP_SUBSTR ||
+                opcode == OP_LEFT ||
+                opcode == OP_RIGHT ||
+                opcode == OP_INVERT ||
+                opcode == OP_AND ||
+                opcode == OP_OR ||
+                opcode == OP_XOR ||
+                opcode == OP_2MUL ||
+                opcode == OP_2DIV ||
+                opcode == OP_MUL ||
+                opcode == OP_DIV ||
+                opcode == OP_MOD ||
+                opcode == OP_LSHIFT ||
+                opcode == OP_RSHIFT)
+                return false;
+
+            if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
+                stack.push_back(vchPushValue);
+            else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
+            switch (opcode)
+            {
+                //
+                // Push value
+                //
+                case OP_1NEGATE:
+                case OP_1:
+                case OP_2:
+                case OP_3:
+                case OP_4:
+                case OP_5:
+                case OP_6:
+                case OP_7:
+                case OP_8:
+                case OP_9:
+                case OP_10:
+                case OP_11:
+                case OP_12:
+                case OP_13:
+                case OP_14:
+                case OP_15:
+                case OP_16:
+                {
+                    // ( -- value)
+                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+
+                //
+                // Control
+                //
+                case OP_NOP:
+                case OP_NOP1: case OP_NOP2: case OP_NOP3: case OP_NOP4: case OP_NOP5:
+                case OP_NOP6: case OP_NOP7: case OP_NOP8: case OP_NOP9: case OP_NOP10:
+                break;
+
+                case OP_IF:
+                case OP_NOTIF:
+                {
+                    // <expression> if [statements] [else [statements]] endif
+                    bool fValue = false;
+                    if (fExec)
+                    {
+                        if (stack.size() < 1)
+                            return false;
+                        valtype& vch = stacktop(-1);
+                        fValue = CastToBool(vch);
+                        if (opcode == OP_NOTIF)
+                            fValue = !fValue;
+                        popstack(stack);
+                    }
+                    vfExec.push_back(fValue);
+                }
+                break;
+
+                case OP_ELSE:
+                {
+                    if (vfExec.empty())
+                        return false;
+                    vfExec.back() = !vfExec.back();
+                }
+                break;
+
+                case OP_ENDIF:
+                {
+                    if (vfExec.empty())
+                        return false;
+                    vfExec.pop_back();
+                }
+                break;
+
+                case OP_VERIFY:
+                {
+                    // (true -- ) or
+                    // (false -- false) and return
+                    if (stack.size() < 1)
+                        return false;
+                    bool fValue = CastToBool(stacktop(-1));
+                    if (fValue)
+                        popstack(stack);
+                    else
+                        return false;
+                }
+                break;
+
+                case OP_RETURN:
+                {
+                    return false;
+                }
+                break;
+
+
+                //
+                // Stack ops
+                //
+                case OP_TOALTSTACK:
+                {
+                    if (stack.size() < 1)
+                        return false;
+                    altstack.push_back(stacktop(-1));
+                    popstack(stack);
+                }
+                break;
+
+                case OP_FROMALTSTACK:
+                {
+                    if (altstack.size() < 1)
+                        return false;
+                    stack.push_back(altstacktop(-1));
+                    popstack(altstack);
+                }
+                break;
+
+                case OP_2DROP:
+                {
+                    // (x1 x2 -- )
+                    if (stack.size() < 2)
+                        return false;
+                    popstack(stack);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_2DUP:
+                {
+                    // (x1 x2 -- x1 x2 x1 x2)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch1 = stacktop(-2);
+                    valtype vch2 = stacktop(-1);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_3DUP:
+                {
+                    // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
+                    if (stack.size() < 3)
+                        return false;
+                    valtype vch1 = stacktop(-3);
+                    valtype vch2 = stacktop(-2);
+                    valtype vch3 = stacktop(-1);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                    stack.push_back(vch3);
+                }
+                break;
+
+                case OP_2OVER:
+                {
+                    // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
+                    if (stack.size() < 4)
+                        return false;
+                    valtype vch1 = stacktop(-4);
+                    valtype vch2 = stacktop(-3);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_2ROT:
+                {
+                    // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
+                    if (stack.size() < 6)
+                        return false;
+                    valtype vch1 = stacktop(-6);
+                    valtype vch2 = stacktop(-5);
+                    stack.erase(stack.end()-6, stack.end()-4);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_2SWAP:
+                {
+                    // (x1 x2 x3 x4 -- x3 x4 x1 x2)
+                    if (stack.size() < 4)
+                        return false;
+                    swap(stacktop(-4), stacktop(-2));
+                    swap(stacktop(-3), stacktop(-1));
+                }
+                break;
+
+                case OP_IFDUP:
+                {
+                    // (x - 0 | x x)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    if (CastToBool(vch))
+                        stack.push_back(vch);
+                }
+                break;
+
+                case OP_DEPTH:
+                {
+                    // -- stacksize
+                    CBigNum bn(stack.size());
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+                case OP_DROP:
+                {
+                    // (x -- )
+                    if (stack.size() < 1)
+                        return false;
+                    popstack(stack);
+                }
+                break;
+
+                case OP_DUP:
+                {
+                    // (x -- x x)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_NIP:
+                {
+                    // (x1 x2 -- x2)
+                    if (stack.size() < 2)
+                        return false;
+                    stack.erase(stack.end() - 2);
+                }
+                break;
+
+                case OP_OVER:
+                {
+                    // (x1 x2 -- x1 x2 x1)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch = stacktop(-2);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_PICK:
+                case OP_ROLL:
+                {
+                    // (xn ... x2 x1 x0 n - xn ... x2 x1 x0 xn)
+                    // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
+                    if (stack.size() < 2)
+                        return false;
+                    int n = CastToBigNum(stacktop(-1)).getint();
+                    popstack(stack);
+                    if (n < 0 || n >= stack.size())
+                        return false;
+                    valtype vch = stacktop(-n-1);
+                    if (opcode == OP_ROLL)
+                        stack.erase(stack.end()-n-1);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_ROT:
+                {
+                    // (x1 x2 x3 -- x2 x3 x1)
+                    //  x2 x1 x3  after first swap
+                    //  x2 x3 x1  after second swap
+                    if (stack.size() < 3)
+                        return false;
+                    swap(stacktop(-3), stacktop(-2));
+                    swap(stacktop(-2), stacktop(-1));
+                }
+                break;
+
+                case OP_SWAP:
+                {
+                    // (x1 x2 -- x2 x1)
+                    if (stack.size() < 2)
+                        return false;
+                    swap(stacktop(-2), stacktop(-1));
+                }
+                break;
+
+                case OP_TUCK:
+                {
+                    // (x1 x2 -- x2 x1 x2)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    stack.insert(stack.end()-2, vch);
+                }
+                break;
+
+
+                //
+                // Splice ops
+                //
+                case OP_CAT:
+                {
+                    // (x1 x2 -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
+                    popstack(stack);
+                    if (stacktop(-1).size() > 520)
+                        return false;
+                }
+                break;
+
+                case OP_SUBSTR:
+                {
+                    // (in begin size -- out)
+                    if (stack.size() < 3)
+                        return false;
+                    valtype& vch = stacktop(-3);
+                    int nBegin = CastToBigNum(stacktop(-2)).getint();
+                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    if (nBegin < 0 || nEnd < nBegin)
+                        return false;
+                    if (nBegin > vch.size())
+                        nBegin = vch.size();
+                    if (nEnd > vch.size())
+                        nEnd = vch.size();
+                    vch.erase(vch.begin() + nEnd, vch.end());
+                    vch.erase(vch.begin(), vch.begin() + nBegin);
+                    popstack(stack);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_LEFT:
+                case OP_RIGHT:
+                {
+                    // (in size -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch = stacktop(-2);
+                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    if (nSize < 0)
+                        return false;
+                    if (nSize > vch.size())
+                        nSize = vch.size();
+                    if (opcode == OP_LEFT)
+                        vch.erase(vch.begin() + nSize, vch.end());
+                    else
+                        vch.erase(vch.begin(), vch.end() - nSize);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_SIZE:
+                {
+                    // (in -- in size)
+                    if (stack.size() < 1)
+                        return false;
+                    CBigNum bn(stacktop(-1).size());
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+
+                //
+                // Bitwise logic
+                //
+                case OP_INVERT:
+                {
+                    // (in - out)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype& vch = stacktop(-1);
+                    for (int i = 0; i < vch.size(); i++)
+                        vch[i] = ~vch[i];
+                }
+                break;
+
+                case OP_AND:
+                case OP_OR:
+                case OP_XOR:
+                {
+                    // (x1 x2 - out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    MakeSameSize(vch1, vch2);
+                    if (opcode == OP_AND)
+                    {
+                        for (int i = 0; i < vch1.size(); i++)
+                            vch1[i] &= vch2[i];
+                    }
+                    else if (opcode == OP_OR)
+                    {
+                        for (int i = 0; i < vch1.size(); i++)
+                            vch1[i] |= vch2[i];
+                    }
+                    else if (opcode == OP_XOR)
+                    {
+                        for (int i = 0; i < vch1.size(); i++)
+                            vch1[i] ^= vch2[i];
+                    }
+                    popstack(stack);
+                }
+                break;
+
+                case OP_EQUAL:
+                case OP_EQUALVERIFY:
+                //case OP_NOTEQUAL: // use OP_NUMNOTEQUAL
+                {
+                    // (x1 x2 - bool)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    bool fEqual = (vch1 == vch2);
+                    // OP_NOTEQUAL is disabled because it would be too easy to say
+                    // something like n != 1 and have some wiseguy pass in 1 with extra
+                    // zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
+                    //if (opcode == OP_NOTEQUAL)
+                    //    fEqual = !fEqual;
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    if (opcode == OP_EQUALVERIFY)
+                    {
+                        if (fEqual)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+
+                //
+                // Numeric
+                //
+                case OP_1ADD:
+                case OP_1SUB:
+                case OP_2MUL:
+                case OP_2DIV:
+                case OP_NEGATE:
+                case OP_ABS:
+                case OP_NOT:
+                case OP_0NOTEQUAL:
+                {
+                    // (in -- out)
+                    if (stack.size() < 1)
+                        return false;
+                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       bn += bnOne; break;
+                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_2MUL:       bn <<= 1; break;
+                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_NEGATE:     bn = -bn; break;
+                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    }
+                    popstack(stack);
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_MOD:
+                case OP_LSHIFT:
+                case OP_RSHIFT:
+                case OP_BOOLAND:
+                case OP_BOOLOR:
+                case OP_NUMEQUAL:
+                case OP_NUMEQUALVERIFY:
+                case OP_NUMNOTEQUAL:
+                case OP_LESSTHAN:
+                case OP_GREATERTHAN:
+                case OP_LESSTHANOREQUAL:
+                case OP_GREATERTHANOREQUAL:
+                case OP_MIN:
+                case OP_MAX:
+                {
+                    // (x1 x2 -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    CBigNum bn1 = CastToBigNum(stacktop(-2));
+                    CBigNum bn2 = CastToBigNum(stacktop(-1));
+                    CBigNum bn;
+                    switch (opcode)
+                    {
+                    case OP_ADD:
+                        bn = bn1 + bn2;
+                        break;
+
+                    case OP_SUB:
+                        bn = bn1 - bn2;
+                        break;
+
+                    case OP_MUL:
+                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_DIV:
+                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_MOD:
+                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+
+                    case OP_LSHIFT:
+                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                            return false;
+                        bn = bn1 << bn2.getulong();
+                        break;
+
+                    case OP_RSHIFT:
+                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                            return false;
+                        bn = bn1 >> bn2.getulong();
+                        break;
+
+                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    }
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(bn.getvch());
+
+                    if (opcode == OP_NUMEQUALVERIFY)
+                    {
+                        if (CastToBool(stacktop(-1)))
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                case OP_WITHIN:
+                {
+                    // (x min max -- out)
+                    if (stack.size() < 3)
+                        return false;
+                    CBigNum bn1 = CastToBigNum(stacktop(-3));
+                    CBigNum bn2 = CastToBigNum(stacktop(-2));
+                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    popstack(stack);
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fValue ? vchTrue : vchFalse);
+                }
+                break;
+
+
+                //
+                // Crypto
+                //
+                case OP_RIPEMD160:
+                case OP_SHA1:
+                case OP_SHA256:
+                case OP_HASH160:
+                case OP_HASH256:
+                {
+                    // (in -- hash)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype& vch = stacktop(-1);
+                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    if (opcode == OP_RIPEMD160)
+                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_SHA1)
+                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_SHA256)
+                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_HASH160)
+                    {
+                        uint160 hash160 = Hash160(vch);
+                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                    }
+                    else if (opcode == OP_HASH256)
+                    {
+                        uint256 hash = Hash(vch.begin(), vch.end());
+                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                    }
+                    popstack(stack);
+                    stack.push_back(vchHash);
+                }
+                break;
+
+                case OP_CODESEPARATOR:
+                {
+                    // Hash starts after the code separator
+                    pbegincodehash = pc;
+                }
+                break;
+
+                case OP_CHECKSIG:
+                case OP_CHECKSIGVERIFY:
+                {
+                    // (sig pubkey -- bool)
+                    if (stack.size() < 2)
+                        return false;
+
+                    valtype& vchSig    = stacktop(-2);
+                    valtype& vchPubKey = stacktop(-1);
+
+                    ////// debug print
+                    //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
+                    //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
+
+                    // Subset of script starting at the most recent codeseparator
+                    CScript scriptCode(pbegincodehash, pend);
+
+                    // Drop the signature, since there's no way for a signature to sign itself
+                    scriptCode.FindAndDelete(CScript(vchSig));
+
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    if (opcode == OP_CHECKSIGVERIFY)
+                    {
+                        if (fSuccess)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                case OP_CHECKMULTISIG:
+                case OP_CHECKMULTISIGVERIFY:
+                {
+                    // ([sig ...] num_of_signatures [pubkey ...] num_of_pubkeys -- bool)
+
+                    int i = 1;
+                    if (stack.size() < i)
+                        return false;
+
+                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    if (nKeysCount < 0 || nKeysCount > 20)
+                        return false;
+                    nOpCount += nKeysCount;
+                    if (nOpCount > 201)
+                        return false;
+                    int ikey = ++i;
+                    i += nKeysCount;
+                    if (stack.size() < i)
+                        return false;
+
+                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    if (nSigsCount < 0 || nSigsCount > nKeysCount)
+                        return false;
+                    int isig = ++i;
+                    i += nSigsCount;
+                    if (stack.size() < i)
+                        return false;
+
+                    // Subset of script starting at the most recent codeseparator
+                    CScript scriptCode(pbegincodehash, pend);
+
+                    // Drop the signatures, since there's no way for a signature to sign itself
+                    for (int k = 0; k < nSigsCount; k++)
+                    {
+                        valtype& vchSig = stacktop(-isig-k);
+                        scriptCode.FindAndDelete(CScript(vchSig));
+                    }
+
+                    bool fSuccess = true;
+                    while (fSuccess && nSigsCount > 0)
+                    {
+                        valtype& vchSig    = stacktop(-isig);
+                        valtype& vchPubKey = stacktop(-ikey);
+
+                        // Check signature
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        {
+                            isig++;
+                            nSigsCount--;
+                        }
+                        ikey++;
+                        nKeysCount--;
+
+                        // If there are more signatures left than keys left,
+                        // then too many signatures have failed
+                        if (nSigsCount > nKeysCount)
+                            fSuccess = false;
+                    }
+
+                    while (i-- > 0)
+                        popstack(stack);
+                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+
+                    if (opcode == OP_CHECKMULTISIGVERIFY)
+                    {
+                        if (fSuccess)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                default:
+                    return false;
+            }
+
+            // Size limits
+            if (stack.size() + altstack.size() > 1000)
+                return false;
+        }
+    }
+    catch (...)
+    {
+        return false;
+    }
+
+
+    if (!vfExec.empty())
+        return false;
+
+    return true;
+}
+
+#undef stacktop
+#undef altstacktop
+
+static bool ReferenceVerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    vector<valtype> stack;
+    if (!ReferenceEvalScript(stack, scriptSig, txTo, nIn, nHashType))
+        return false;
+    if (!ReferenceEvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+        return false;
+    if (stack.empty())
+        return false;
+    return CastToBool(stack.back());
+}
+
+// Runs both scripts through the interpreter, without VerifyScript's
+// shortcut for the standard templates
+static bool InterpretScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    vector<valtype> stack;
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+        return false;
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+        return false;
+    if (stack.empty())
+        return false;
+    return CastToBool(stack.back());
+}
+
+// Scripts in the notation the vectors below are written in: numbers,
+// 0x followed by raw bytes, 'strings' to push, and opcode names with or
+// without the OP_
+static CScript ParseScript(const string& str)
+{
+    static map<string, opcodetype> mapOpNames;
+    if (mapOpNames.empty())
+    {
+        for (int op = OP_PUSHDATA1; op <= 0xff; op++)
+        {
+            string strName = GetOpName((opcodetype)op);
+            if (strName.substr(0, 3) != "OP_" || strName == "OP_UNKNOWN")
+                continue;
+            mapOpNames[strName] = (opcodetype)op;
+            mapOpNames[strName.substr(3)] = (opcodetype)op;
+        }
+    }
+
+    CScript script;
+    istringstream stream(str);
+    string strWord;
+    while (stream >> strWord)
+    {
+        if (strWord.find_first_not_of("-0123456789") == string::npos && strWord != "-")
+        {
+            script << atoi64(strWord);
+        }
+        else if (strWord.size() > 2 && strWord.substr(0, 2) == "0x")
+        {
+            valtype vch = ParseHex(strWord.substr(2));
+            script.insert(script.end(), vch.begin(), vch.end());
+        }
+        else if (strWord.size() >= 2 && strWord[0] == '\'' && strWord[strWord.size()-1] == '\'')
+        {
+            script << valtype(strWord.begin() + 1, strWord.end() - 1);
+        }
+        else if (mapOpNames.count(strWord))
+        {
+            script << mapOpNames[strWord];
+        }
+        else
+        {
+            BOOST_ERROR("ParseScript() : unknown word " + strWord);
+        }
+    }
+    return script;
+}
+
+static valtype RandomValue()
+{
+    // Mostly things that decode as numbers, some that don't
+    static const unsigned char pchSpecial[][5] = {
+        {0x80}, {0x00, 0x80}, {0xff, 0xff, 0xff, 0x7f}, {0xff, 0xff, 0xff, 0xff}, {0x00, 0x00, 0x00, 0x80}, {0x01, 0x00, 0x00, 0x00, 0x01}
+    };
+    static const unsigned int nSpecialSize[] = { 1, 2, 4, 4, 4, 5 };
+    unsigned int n = InsecureRand(10);
+    if (n < 6)
+        return valtype(pchSpecial[n], pchSpecial[n] + nSpecialSize[n]);
+    valtype vch(InsecureRand(n == 9 ? 80 : 4));
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = InsecureRand(256);
+    return vch;
+}
+
+static CScript RandomScript(unsigned int nOps)
+{
+    static const opcodetype opcodes[] = {
+        OP_0, OP_1NEGATE, OP_1, OP_2, OP_3, OP_16, OP_NOP, OP_IF, OP_NOTIF, OP_ELSE, OP_ENDIF,
+        OP_VERIF, OP_VERIFY, OP_RETURN, OP_TOALTSTACK, OP_FROMALTSTACK, OP_2DROP, OP_2DUP, OP_3DUP,
+        OP_2OVER, OP_2ROT, OP_2SWAP, OP_IFDUP, OP_DEPTH, OP_DROP, OP_DUP, OP_NIP, OP_OVER, OP_PICK,
+        OP_ROLL, OP_ROT, OP_SWAP, OP_TUCK, OP_SIZE, OP_EQUAL, OP_EQUALVERIFY, OP_1ADD, OP_1SUB,
+        OP_NEGATE, OP_ABS, OP_NOT, OP_0NOTEQUAL, OP_ADD, OP_SUB, OP_BOOLAND, OP_BOOLOR, OP_NUMEQUAL,
+        OP_NUMEQUALVERIFY, OP_NUMNOTEQUAL, OP_LESSTHAN, OP_GREATERTHAN, OP_LESSTHANOREQUAL,
+        OP_GREATERTHANOREQUAL, OP_MIN, OP_MAX, OP_WITHIN, OP_RIPEMD160, OP_SHA1, OP_SHA256,
+        OP_HASH160, OP_HASH256, OP_CODESEPARATOR, OP_CHECKSIG, OP_CHECKMULTISIG, OP_RESERVED,
+        OP_VER, OP_CAT, OP_MUL, OP_NOP1, OP_INVALIDOPCODE
+    };
+    CScript script;
+    for (unsigned int i = 0; i < nOps; i++)
+    {
+        unsigned int n = InsecureRand(3 * sizeof(opcodes) / sizeof(opcodes[0]));
+        if (n < sizeof(opcodes) / sizeof(opcodes[0]))
+            script << opcodes[n];
+        else if (n % 7 == 0)
+            script << OP_0 << OP_IF;  // keeps some branches from executing
+        else
+            script << RandomValue();
+    }
+    // Now and then a push that runs off the end
+    if (InsecureRand(50) == 0)
+        script.push_back(OP_PUSHDATA1);
+    return script;
+}
+
+//
+// Known results, the same before and after scripts were decoded up front:
+// scriptSig, scriptPubKey, and whether the pair verifies
+//
+static const char* pszScriptVectors[][3] = {
+    // Pushes and numbers
+    { "1 2", "ADD 3 EQUAL", "valid" },
+    { "0x4c 0x01 0x07", "7 EQUAL", "valid" },
+    { "0x4d 0x0100 0x07", "7 EQUAL", "valid" },
+    { "1", "0x4c 0x05 0x01", "invalid" },
+    { "0x04 0xffffff7f", "1ADD 0x05 0x0000008000 EQUAL", "valid" },
+    { "0x05 0x0100000000", "1ADD", "invalid" },
+    { "0x01 0x80", "NOT", "valid" },
+    { "0x01 0x80", "", "invalid" },
+    { "0", "", "invalid" },
+
+    // Flow control
+    { "0", "IF 0 ELSE 1 ENDIF", "valid" },
+    { "1", "IF 1 ELSE 0 ENDIF", "valid" },
+    { "0", "NOTIF 1 ENDIF", "valid" },
+    { "1 1", "IF IF 1 ELSE 0 ENDIF ENDIF", "valid" },
+    { "1", "IF 1", "invalid" },
+    { "1", "ENDIF 1", "invalid" },
+    { "1", "ELSE 1 ENDIF", "invalid" },
+    { "1", "IF", "invalid" },
+    { "1", "VERIFY 1", "valid" },
+    { "0", "VERIFY 1", "invalid" },
+    { "1", "RETURN", "invalid" },
+    { "0", "IF RETURN ENDIF 1", "valid" },
+    { "1", "NOP NOP1 NOP10 CODESEPARATOR", "valid" },
+
+    // Opcodes that fail only when run, and ones that fail anywhere
+    { "0", "IF RESERVED ELSE 1 ENDIF", "valid" },
+    { "1", "IF RESERVED ELSE 1 ENDIF", "invalid" },
+    { "0", "IF VER ENDIF 1", "valid" },
+    { "1", "VER", "invalid" },
+    { "0", "IF VERIF ELSE 1 ENDIF", "invalid" },
+    { "0", "IF CAT ELSE 1 ENDIF", "invalid" },
+    { "0", "IF MUL ELSE 1 ENDIF", "invalid" },
+    { "0", "IF LSHIFT ELSE 1 ENDIF", "invalid" },
+
+    // Stack
+    { "1 2", "TOALTSTACK 1 EQUALVERIFY FROMALTSTACK 2 EQUAL", "valid" },
+    { "1", "FROMALTSTACK", "invalid" },
+    { "0", "IFDUP DEPTH 1 EQUAL", "valid" },
+    { "1", "IFDUP DEPTH 2 EQUAL", "valid" },
+    { "", "DEPTH 0 EQUAL", "valid" },
+    { "1 2", "2DROP DEPTH 0 EQUAL", "valid" },
+    { "1", "2DROP 1", "invalid" },
+    { "1 2", "2DUP 2 EQUALVERIFY 1 EQUALVERIFY 2 EQUAL", "valid" },
+    { "1 2 3", "3DUP DEPTH 6 EQUAL", "valid" },
+    { "1 2 3 4", "2OVER 2 EQUALVERIFY 1 EQUAL", "valid" },
+    { "1 2 3 4 5 6", "2ROT 2 EQUALVERIFY 1 EQUALVERIFY 6 EQUAL", "valid" },
+    { "1 2 3 4", "2SWAP 2 EQUALVERIFY 1 EQUALVERIFY 4 EQUALVERIFY 3 EQUAL", "valid" },
+    { "1 2", "NIP 2 EQUAL", "valid" },
+    { "1 2", "OVER 1 EQUALVERIFY 2 EQUALVERIFY 1 EQUAL", "valid" },
+    { "1 2 3", "2 PICK 1 EQUALVERIFY DEPTH 3 EQUAL", "valid" },
+    { "1 2 3", "2 ROLL 1 EQUALVERIFY 3 EQUALVERIFY 2 EQUAL", "valid" },
+    { "1", "3 PICK", "invalid" },
+    { "1", "-1 ROLL", "invalid" },
+    { "1 2 3", "ROT 1 EQUALVERIFY 3 EQUALVERIFY 2 EQUAL", "valid" },
+    { "1 2", "SWAP 1 EQUALVERIFY 2 EQUAL", "valid" },
+    { "1 2", "TUCK DEPTH 3 EQUALVERIFY 2 EQUALVERIFY 1 EQUALVERIFY 2 EQUAL", "valid" },
+    { "0x03 0x616263", "SIZE 3 EQUALVERIFY 'abc' EQUAL", "valid" },
+
+    // Arithmetic
+    { "5", "1ADD 6 EQUAL", "valid" },
+    { "5", "1SUB 4 EQUAL", "valid" },
+    { "5", "NEGATE -5 EQUAL", "valid" },
+    { "-5", "ABS 5 EQUAL", "valid" },
+    { "0", "NOT", "valid" },
+    { "2", "0NOTEQUAL", "valid" },
+    { "1 2", "SUB -1 EQUAL", "valid" },
+    { "0 1", "BOOLOR", "valid" },
+    { "0 1", "BOOLAND", "invalid" },
+    { "1 1", "NUMEQUALVERIFY 1", "valid" },
+    { "1 2", "NUMNOTEQUAL", "valid" },
+    { "1 2", "LESSTHAN", "valid" },
+    { "2 1", "GREATERTHAN", "valid" },
+    { "2 2", "LESSTHANOREQUAL", "valid" },
+    { "1 2", "GREATERTHANOREQUAL", "invalid" },
+    { "3 5", "MIN 3 EQUAL", "valid" },
+    { "3 5", "MAX 5 EQUAL", "valid" },
+    { "2 1 3", "WITHIN", "valid" },
+    { "3 1 3", "WITHIN", "invalid" },
+
+    // Hashes of the empty string
+    { "0", "RIPEMD160 0x14 0x9c1185a5c5e9fc54612808977ee8f548b2258d31 EQUAL", "valid" },
+    { "0", "SHA1 0x14 0xda39a3ee5e6b4b0d3255bfef95601890afd80709 EQUAL", "valid" },
+    { "0", "SHA256 0x20 0xe3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 EQUAL", "valid" },
+    { "0", "HASH160 0x14 0xb472a266d0bd89c13706a4132ccfb16f7c3b9fcb EQUAL", "valid" },
+    { "0", "HASH256 0x20 0x5df6e0e2761359d30a8275058e299fcc0381534545f55cf43e41983f5d4c9456 EQUAL", "valid" },
+
+    // Signature ops without a signature
+    { "0 0", "CHECKSIG NOT", "valid" },
+    { "0 0", "CHECKSIGVERIFY 1", "invalid" },
+    { "0 0 0", "CHECKMULTISIG", "valid" },
+    { "0 0", "CHECKMULTISIG", "invalid" },
+    { "0 0 0", "1 CHECKMULTISIG", "valid" },
+    { "0 0", "1 CHECKMULTISIG", "invalid" },
+};
+
+BOOST_AUTO_TEST_CASE(eval_matches_reference)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+
+    int nTrue = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        CScript scriptSig = RandomScript(InsecureRand(8));
+        CScript scriptPubKey = RandomScript(InsecureRand(24));
+
+        vector<valtype> stack;
+        vector<valtype> stackRef;
+        bool fRet = EvalScript(stack, scriptSig, txTo, 0, 0);
+        bool fRetRef = ReferenceEvalScript(stackRef, scriptSig, txTo, 0, 0);
+        BOOST_CHECK_EQUAL(fRet, fRetRef);
+        if (fRet && fRetRef)
+        {
+            BOOST_CHECK(stack == stackRef);
+            fRet = EvalScript(stack, scriptPubKey, txTo, 0, 0);
+            fRetRef = ReferenceEvalScript(stackRef, scriptPubKey, txTo, 0, 0);
+            BOOST_CHECK_EQUAL(fRet, fRetRef);
+            if (fRet && fRetRef)
+                BOOST_CHECK(stack == stackRef);
+        }
+
+        bool fVerify = VerifyScript(scriptSig, scriptPubKey, txTo, 0, 0);
+        BOOST_CHECK_EQUAL(fVerify, ReferenceVerifyScript(scriptSig, scriptPubKey, txTo, 0, 0));
+        if (fVerify)
+            nTrue++;
+    }
+    // Make sure the scripts weren't all just failing
+    BOOST_CHECK(nTrue > 100);
+}
+
+BOOST_AUTO_TEST_CASE(eval_vectors)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+
+    for (unsigned int i = 0; i < sizeof(pszScriptVectors) / sizeof(pszScriptVectors[0]); i++)
+    {
+        CScript scriptSig = ParseScript(pszScriptVectors[i][0]);
+        CScript scriptPubKey = ParseScript(pszScriptVectors[i][1]);
+        bool fValid = (strcmp(pszScriptVectors[i][2], "valid") == 0);
+        BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, txTo, 0, 0) == fValid,
+                            strprintf("\"%s\" \"%s\" should be %s", pszScriptVectors[i][0], pszScriptVectors[i][1], pszScriptVectors[i][2]));
+        BOOST_CHECK_MESSAGE(ReferenceVerifyScript(scriptSig, scriptPubKey, txTo, 0, 0) == fValid,
+                            strprintf("reference: \"%s\" \"%s\" should be %s", pszScriptVectors[i][0], pszScriptVectors[i][1], pszScriptVectors[i][2]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(eval_limits)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+
+    // 201 counted ops, wherever they are
+    CScript script;
+    for (int i = 0; i < 201; i++)
+        script << OP_NOP;
+    BOOST_CHECK(VerifyScript(CScript() << OP_1, script, txTo, 0, 0));
+    BOOST_CHECK(!VerifyScript(CScript() << OP_1, CScript(script) << OP_NOP, txTo, 0, 0));
+    BOOST_CHECK(!VerifyScript(CScript() << OP_1, CScript() << OP_0 << OP_IF << OP_NOP << OP_ENDIF << script, txTo, 0, 0));
+
+    // Public keys count towards it when a multisig runs
+    CScript scriptTen, scriptEleven;
+    for (int i = 0; i < 190; i++)
+        scriptTen << OP_NOP;
+    scriptEleven = scriptTen;
+    for (int i = 0; i < 10; i++)
+    {
+        scriptTen << OP_0;
+        scriptEleven << OP_0;
+    }
+    scriptTen << OP_10 << OP_CHECKMULTISIG;
+    scriptEleven << OP_0 << OP_11 << OP_CHECKMULTISIG;
+    BOOST_CHECK(VerifyScript(CScript() << OP_0 << OP_0, scriptTen, txTo, 0, 0));
+    BOOST_CHECK(!VerifyScript(CScript() << OP_0 << OP_0, scriptEleven, txTo, 0, 0));
+
+    // Pushes up to 520 bytes
+    BOOST_CHECK(VerifyScript(CScript() << valtype(520, 1), CScript() << OP_SIZE << 520 << OP_EQUAL, txTo, 0, 0));
+    BOOST_CHECK(!VerifyScript(CScript() << valtype(521, 1), CScript() << OP_SIZE << 521 << OP_EQUAL, txTo, 0, 0));
+
+    // No more than 1000 items on the two stacks together
+    script = CScript();
+    for (int i = 0; i < 1000; i++)
+        script << OP_1;
+    BOOST_CHECK(VerifyScript(CScript(), script, txTo, 0, 0));
+    BOOST_CHECK(!VerifyScript(CScript() << OP_1, script, txTo, 0, 0));
+    BOOST_CHECK(VerifyScript(CScript(), CScript(script) << OP_TOALTSTACK, txTo, 0, 0));
+    BOOST_CHECK(!VerifyScript(CScript(), CScript(script) << OP_TOALTSTACK << OP_1, txTo, 0, 0));
+}
+
+BOOST_AUTO_TEST_CASE(eval_signatures)
+{
+    CKey key;
+    key.MakeNewKey();
+
+    CTransaction txFrom;
+    txFrom.vout.resize(2);
+    txFrom.vout[0].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    txFrom.vout[1].scriptPubKey << OP_DUP << OP_HASH160 << Hash160(key.GetPubKey()) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    for (int i = 0; i < 2; i++)
+    {
+        CTransaction txTo;
+        txTo.vin.resize(1);
+        txTo.vout.resize(1);
+        txTo.vin[0].prevout.hash = txFrom.GetHash();
+        txTo.vin[0].prevout.n = i;
+
+        uint256 hash = SignatureHash(txFrom.vout[i].scriptPubKey, txTo, 0, SIGHASH_ALL);
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        txTo.vin[0].scriptSig << vchSig;
+        if (i == 1)
+            txTo.vin[0].scriptSig << key.GetPubKey();
+        txTo.InvalidateHash();
+
+        const CScript& scriptPubKey = txFrom.vout[i].scriptPubKey;
+        BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, 0));
+        BOOST_CHECK(InterpretScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, 0));
+
+        // A signature over something else fails both ways
+        txTo.vout[0].nValue = 1;
+        txTo.InvalidateHash();
+        BOOST_CHECK(!VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, 0));
+        BOOST_CHECK(!InterpretScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, 0));
+    }
+}
+
+//
+// Solver's template scan as it was before the standard layouts were matched
+// by their bytes
+//
+static bool ReferenceSolver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+{
+    static vector<CScript> vTemplates;
+    if (vTemplates.empty())
+    {
+        vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+        vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
+    }
+
+    const CScript& script1 = scriptPubKey;
+    BOOST_FOREACH(const CScript& script2, vTemplates)
+    {
+        vSolutionRet.clear();
+        opcodetype opcode1, opcode2;
+        vector<unsigned char> vch1, vch2;
+
+        CScript::const_iterator pc1 = script1.begin();
+        CScript::const_iterator pc2 = script2.begin();
+        loop
+        {
+            if (pc1 == script1.end() && pc2 == script2.end())
+            {
+                reverse(vSolutionRet.begin(), vSolutionRet.end());
+                return true;
+            }
+            if (!script1.GetOp(pc1, opcode1, vch1))
+                break;
+            if (!script2.GetOp(pc2, opcode2, vch2))
+                break;
+            if (opcode2 == OP_PUBKEY)
+            {
+                if (vch1.size() < 33 || vch1.size() > 120)
+                    break;
+                vSolutionRet.push_back(make_pair(opcode2, vch1));
+            }
+            else if (opcode2 == OP_PUBKEYHASH)
+            {
+                if (vch1.size() != sizeof(uint160))
+                    break;
+                vSolutionRet.push_back(make_pair(opcode2, vch1));
+            }
+            else if (opcode1 != opcode2 || vch1 != vch2)
+            {
+                break;
+            }
+        }
+    }
+
+    vSolutionRet.clear();
+    return false;
+}
+
+static CScript PayToPubKey(const valtype& vchPubKey)
+{
+    return CScript() << vchPubKey << OP_CHECKSIG;
+}
+
+static CScript PayToPubKeyHash(const valtype& vchPubKey)
+{
+    return CScript() << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+// A one-input spend of scriptPubKey signed the way the wallet signs
+static CTransaction MakeSpend(CKey& key, const CScript& scriptPubKey, int nHashType)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(2);
+    txTo.vin[0].prevout.hash = Hash(scriptPubKey.begin(), scriptPubKey.end());
+    txTo.vin[0].prevout.n = 0;
+    txTo.vout[0].nValue = 50 * COIN;
+    txTo.vout[0].scriptPubKey = scriptPubKey;
+    txTo.vout[1].nValue = COIN;
+    txTo.vout[1].scriptPubKey = scriptPubKey;
+
+    valtype vchSig;
+    BOOST_CHECK(key.Sign(SignatureHash(scriptPubKey, txTo, 0, nHashType), vchSig));
+    vchSig.push_back((unsigned char)nHashType);
+    txTo.vin[0].scriptSig << vchSig;
+    if (scriptPubKey[0] == OP_DUP)
+        txTo.vin[0].scriptSig << key.GetPubKey();
+    txTo.InvalidateHash();
+    return txTo;
+}
+
+// Same pushes with the first one spelled out as OP_PUSHDATA1
+static CScript WithPushData1(const CScript& script)
+{
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valtype vch;
+    BOOST_CHECK(script.GetOp(pc, opcode, vch));
+    CScript scriptRet;
+    scriptRet.push_back(OP_PUSHDATA1);
+    scriptRet.push_back((unsigned char)vch.size());
+    scriptRet.insert(scriptRet.end(), vch.begin(), vch.end());
+    scriptRet.insert(scriptRet.end(), pc, script.end());
+    return scriptRet;
+}
+
+BOOST_AUTO_TEST_CASE(standard_matches_interpreter)
+{
+    CKey key;
+    key.MakeNewKey();
+    CKey keyOther;
+    keyOther.MakeNewKey();
+
+    static const int nHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY };
+    for (int t = 0; t < 4; t++)
+    {
+        CScript scriptPubKey = (t % 2 == 0 ? PayToPubKey(key.GetPubKey()) : PayToPubKeyHash(key.GetPubKey()));
+        if (t >= 2)
+            scriptPubKey = WithPushData1(scriptPubKey.size() == 25 ? CScript(scriptPubKey.begin() + 2, scriptPubKey.end()) : scriptPubKey);
+        if (t == 3)
+            scriptPubKey = (CScript() << OP_DUP << OP_HASH160) + scriptPubKey;
+
+        for (int h = 0; h < 3; h++)
+        {
+            CTransaction txTo = MakeSpend(key, scriptPubKey, nHashTypes[h]);
+            const CScript scriptSig = txTo.vin[0].scriptSig;
+            CScript::const_iterator pc = scriptSig.begin();
+            opcodetype opcode;
+            valtype vchSig;
+            BOOST_CHECK(scriptSig.GetOp(pc, opcode, vchSig));
+            CScript scriptRest(pc, scriptSig.end());
+
+            vector<CScript> vScriptSig;
+            vScriptSig.push_back(scriptSig);
+            valtype vchBad = vchSig;
+            vchBad[10] ^= 1;
+            vScriptSig.push_back((CScript() << vchBad) + scriptRest);
+            vchBad = vchSig;
+            vchBad.back() ^= SIGHASH_ANYONECANPAY;
+            vScriptSig.push_back((CScript() << vchBad) + scriptRest);
+            vScriptSig.push_back((CScript() << OP_0) + scriptRest);
+            vScriptSig.push_back((CScript() << OP_0) + scriptSig);
+            vScriptSig.push_back(CScript(scriptSig) << key.GetPubKey());
+            vScriptSig.push_back(CScript() << vchSig << keyOther.GetPubKey());
+            vScriptSig.push_back(WithPushData1(scriptSig));
+            vScriptSig.push_back(CScript(scriptSig) << OP_NOP);
+            vScriptSig.push_back(CScript());
+
+            for (unsigned int i = 0; i < vScriptSig.size(); i++)
+            {
+                int nCheckTypes[] = { 0, nHashTypes[h], SIGHASH_ALL };
+                for (int c = 0; c < 3; c++)
+                {
+                    bool fValid = VerifyScript(vScriptSig[i], scriptPubKey, txTo, 0, nCheckTypes[c]);
+                    BOOST_CHECK_MESSAGE(fValid == InterpretScript(vScriptSig[i], scriptPubKey, txTo, 0, nCheckTypes[c]),
+                                        strprintf("template %d hashtype %d variant %u check %d", t, nHashTypes[h], i, nCheckTypes[c]));
+                    BOOST_CHECK_MESSAGE(fValid == ReferenceVerifyScript(vScriptSig[i], scriptPubKey, txTo, 0, nCheckTypes[c]),
+                                        strprintf("reference: template %d hashtype %d variant %u check %d", t, nHashTypes[h], i, nCheckTypes[c]));
+                    if (i == 0 && c != 2)
+                        BOOST_CHECK(fValid);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(solver_matches_reference)
+{
+    CKey key;
+    key.MakeNewKey();
+    valtype vchPubKey = key.GetPubKey();
+
+    vector<CScript> vScripts;
+    vScripts.push_back(PayToPubKey(vchPubKey));
+    vScripts.push_back(PayToPubKeyHash(vchPubKey));
+    vScripts.push_back(WithPushData1(PayToPubKey(vchPubKey)));
+    vScripts.push_back(PayToPubKey(valtype(vchPubKey.begin(), vchPubKey.begin() + 33)));
+    vScripts.push_back(PayToPubKey(valtype(vchPubKey.begin(), vchPubKey.begin() + 32)));
+    vScripts.push_back(PayToPubKey(valtype(76, 4)));
+    vScripts.push_back(PayToPubKeyHash(vchPubKey) << OP_NOP);
+    vScripts.push_back(CScript() << OP_DUP << OP_HASH160 << valtype(21, 1) << OP_EQUALVERIFY << OP_CHECKSIG);
+    vScripts.push_back(CScript() << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUAL << OP_CHECKSIG);
+    vScripts.push_back(CScript() << vchPubKey << OP_CHECKSIGVERIFY);
+    for (int i = 0; i < 5000; i++)
+        vScripts.push_back(RandomScript(1 + InsecureRand(6)));
+
+    BOOST_FOREACH(const CScript& script, vScripts)
+    {
+        vector<pair<opcodetype, valtype> > vSolution, vSolutionReference;
+        BOOST_CHECK_EQUAL(Solver(script, vSolution), ReferenceSolver(script, vSolutionReference));
+        BOOST_CHECK(vSolution == vSolutionReference);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(standard_deferred_check)
+{
+    CKey key;
+    key.MakeNewKey();
+    CScript scriptPubKey = PayToPubKeyHash(key.GetPubKey());
+    CTransaction txTo = MakeSpend(key, scriptPubKey, SIGHASH_ALL);
+
+    // A standard spend leaves its signature for later, and nothing else does
+    vector<CSigCheck> vChecks;
+    BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, 0, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+    BOOST_CHECK(vChecks[0].Verify());
+    CScript scriptRun = WithPushData1(PayToPubKey(key.GetPubKey()));
+    CTransaction txRun = MakeSpend(key, scriptRun, SIGHASH_ALL);
+    BOOST_CHECK(VerifyScript(txRun.vin[0].scriptSig, scriptRun, txRun, 0, 0, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+    // Failures that don't need the signature show up straight away
+    BOOST_CHECK(!VerifyScript(CScript() << OP_0 << key.GetPubKey(), scriptPubKey, txTo, 0, 0, &vChecks));
+    BOOST_CHECK(!VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, SIGHASH_NONE, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+    // A bad signature only shows up when the check runs
+    txTo.vout[0].nValue++;
+    txTo.InvalidateHash();
+    BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptPubKey, txTo, 0, 0, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 2U);
+    BOOST_CHECK(!vChecks[1].Verify());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
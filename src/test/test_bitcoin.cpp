@@ -5,6 +5,13 @@
 
 #include "uint160_tests.cpp"
 #include "uint256_tests.cpp"
+#include "transaction_tests.cpp"
+#include "script_tests.cpp"
+#include "key_tests.cpp"
+#include "base58_tests.cpp"
+#include "bloom_tests.cpp"
+#include "download_tests.cpp"
+#include "headers_tests.cpp"
 
 #include "wallet_tests.cpp"
 
@@ -0,0 +1,260 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(transaction_tests)
+
+BOOST_AUTO_TEST_CASE(cached_hash)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 50 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    // Hashed once, however often it's asked for
+    int64 nStart = GetTransactionHashCount();
+    uint256 hash = tx.GetHash();
+    BOOST_CHECK(hash == SerializeHash(tx));
+    BOOST_CHECK(tx.GetHash() == hash);
+    BOOST_CHECK(tx.GetHash() == hash);
+    BOOST_CHECK(GetTransactionHashCount() - nStart == 1);
+
+    // Copies keep the hash
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.GetHash() == hash);
+    CMerkleTx txMerkle(tx);
+    BOOST_CHECK(txMerkle.GetHash() == hash);
+    BOOST_CHECK(GetTransactionHashCount() - nStart == 1);
+
+    // Changing it and calling InvalidateHash gives the new hash
+    tx.vin[0].scriptSig = CScript() << 486604799 << CBigNum(5);
+    tx.InvalidateHash();
+    BOOST_CHECK(!tx.IsHashCached());
+    uint256 hash2 = tx.GetHash();
+    BOOST_CHECK(tx.IsHashCached());
+    BOOST_CHECK(hash2 != hash);
+    BOOST_CHECK(hash2 == SerializeHash(tx));
+    BOOST_CHECK(txCopy.GetHash() == hash);
+
+    // Reading over an existing transaction drops the old hash
+    CDataStream ss;
+    ss << txCopy;
+    ss >> tx;
+    BOOST_CHECK(tx.GetHash() == hash);
+
+    tx.SetNull();
+    BOOST_CHECK(tx.GetHash() == SerializeHash(CTransaction()));
+}
+
+BOOST_AUTO_TEST_CASE(merkle_tree)
+{
+    // Sizes either side of the parallel threshold, odd and even
+    int nSizes[] = { 1, 2, 3, 7, 8, 1001 };
+    BOOST_FOREACH(int nTx, nSizes)
+    {
+        CBlock block;
+        block.vtx.resize(nTx);
+        for (int i = 0; i < nTx; i++)
+        {
+            block.vtx[i].vin.resize(1);
+            block.vtx[i].vin[0].scriptSig = CScript() << i;
+            block.vtx[i].vout.resize(1);
+            block.vtx[i].vout[0].nValue = i;
+        }
+
+        // Reference root worked out the long way
+        vector<uint256> vLevel;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vLevel.push_back(SerializeHash(tx));
+        while (vLevel.size() > 1)
+        {
+            vector<uint256> vNext;
+            for (int i = 0; i < vLevel.size(); i += 2)
+            {
+                int i2 = min(i+1, (int)vLevel.size()-1);
+                vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(vLevel[i2]), END(vLevel[i2])));
+            }
+            vLevel.swap(vNext);
+        }
+        BOOST_CHECK(block.BuildMerkleTree() == vLevel[0]);
+
+        // Rolling the coinbase matches a full rebuild
+        for (int nExtraNonce = 1; nExtraNonce < 4; nExtraNonce++)
+        {
+            block.vtx[0].vin[0].scriptSig = CScript() << 486604799 << CBigNum(nExtraNonce);
+            block.vtx[0].InvalidateHash();
+            uint256 hashRoot = block.UpdateMerkleCoinbase();
+            CBlock blockCopy(block);
+            BOOST_CHECK(hashRoot == blockCopy.BuildMerkleTree());
+            BOOST_CHECK(block.vMerkleTree == blockCopy.vMerkleTree);
+            if (nTx > 1)
+                BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[nTx-1].GetHash(), block.GetMerkleBranch(nTx-1), nTx-1) == hashRoot);
+        }
+    }
+
+    // Without a tree to update it builds one
+    CBlock block;
+    block.vtx.resize(3);
+    for (int i = 0; i < 3; i++)
+        block.vtx[i].nLockTime = i;
+    CBlock blockCopy(block);
+    BOOST_CHECK(block.UpdateMerkleCoinbase() == blockCopy.BuildMerkleTree());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_links)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(1, 0);
+    txParent.vout.resize(2);
+    txParent.vout[0].nValue = 1 * COIN;
+    txParent.vout[1].nValue = 2 * COIN;
+    uint256 hashParent = txParent.GetHash();
+
+    CTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].prevout = COutPoint(hashParent, 0);
+    txChild.vin[1].prevout = COutPoint(hashParent, 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 3 * COIN;
+    uint256 hashChild = txChild.GetHash();
+
+    // Child first, as a reorg can do
+    BOOST_CHECK(pool.AddUnchecked(txChild, 0));
+    BOOST_CHECK(pool.AddUnchecked(txParent, 1000));
+    BOOST_CHECK(!pool.AddUnchecked(txParent, 1000));
+    BOOST_CHECK(pool.Size() == 2);
+    BOOST_CHECK(pool.mapTx[hashParent].setChildren.count(hashChild));
+    BOOST_CHECK(pool.mapTx[hashChild].setParents.count(hashParent));
+    BOOST_CHECK(pool.GetSpender(COutPoint(hashParent, 1)) == pool.Get(hashChild).get());
+    BOOST_CHECK(pool.GetSpender(COutPoint(hashChild, 0)) == NULL);
+    BOOST_CHECK(pool.nBytes == ::GetSerializeSize(txParent, SER_NETWORK) + ::GetSerializeSize(txChild, SER_NETWORK));
+
+    CTransaction tx;
+    BOOST_CHECK(pool.Lookup(hashChild, tx) && tx.GetHash() == hashChild);
+
+    // Taking the parent alone leaves the child unlinked
+    BOOST_CHECK(pool.Remove(hashParent));
+    BOOST_CHECK(!pool.Exists(hashParent));
+    BOOST_CHECK(pool.mapTx[hashChild].setParents.empty());
+    BOOST_CHECK(pool.AddUnchecked(txParent, 1000));
+
+    // A double spend of the parent's input takes both out
+    CTransaction txDoubleSpend(txParent);
+    txDoubleSpend.vout[0].nValue = 0;
+    txDoubleSpend.InvalidateHash();
+    pool.RemoveConflicts(txDoubleSpend);
+    BOOST_CHECK(pool.Size() == 0);
+    BOOST_CHECK(pool.mapNextTx.empty());
+    BOOST_CHECK(pool.nConflicts == 2);
+    BOOST_CHECK(pool.nBytes == 0);
+    BOOST_CHECK(pool.nUsage == 0);
+}
+
+static CTransaction MakeSpend(const uint256& hashPrev, unsigned int n, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_eviction)
+{
+    CTxMemPool pool;
+
+    // A cheap parent carried by a child paying well, and two loners
+    CTransaction txA = MakeSpend(1, 0, 1 * COIN);
+    CTransaction txB = MakeSpend(txA.GetHash(), 0, 1 * COIN);
+    CTransaction txC = MakeSpend(2, 0, 1 * COIN);
+    CTransaction txD = MakeSpend(3, 0, 1 * COIN);
+    pool.AddUnchecked(txA, 1000);
+    pool.AddUnchecked(txB, 100000);
+    pool.AddUnchecked(txC, 5000);
+    pool.AddUnchecked(txD, 2000);
+
+    const CTxMemPoolEntry& entryA = pool.mapTx[txA.GetHash()];
+    BOOST_CHECK(entryA.nFeesWithDescendants == 101000);
+    BOOST_CHECK(entryA.nSizeWithDescendants == entryA.nTxSize + pool.mapTx[txB.GetHash()].nTxSize);
+    BOOST_CHECK(pool.GetMinFee(1000) == 0);
+
+    // Lowest fee rate goes first
+    double dRateD = pool.mapTx[txD.GetHash()].dEvictionScore;
+    vector<uint256> vEvicted;
+    pool.TrimToSize(pool.nUsage - 1, &vEvicted);
+    BOOST_CHECK(vEvicted.size() == 1 && vEvicted[0] == txD.GetHash());
+    BOOST_CHECK(pool.Size() == 3);
+    BOOST_CHECK(pool.nEvicted == 1);
+    BOOST_CHECK(pool.GetMinFee(1000) == (int64)dRateD + MIN_RELAY_TX_FEE);
+
+    // Then C, then A together with its child
+    vEvicted.clear();
+    pool.TrimToSize(pool.nUsage - 1, &vEvicted);
+    BOOST_CHECK(vEvicted.size() == 1 && vEvicted[0] == txC.GetHash());
+    vEvicted.clear();
+    pool.TrimToSize(0, &vEvicted);
+    BOOST_CHECK(vEvicted.size() == 2);
+    BOOST_CHECK(pool.Size() == 0);
+    BOOST_CHECK(pool.setEvictionScore.empty());
+    BOOST_CHECK(pool.nUsage == 0);
+
+    // Mining the parent on its own leaves the child's totals alone
+    pool.AddUnchecked(txA, 1000);
+    pool.AddUnchecked(txB, 100000);
+    pool.Remove(txA.GetHash());
+    const CTxMemPoolEntry& entryB = pool.mapTx[txB.GetHash()];
+    BOOST_CHECK(entryB.nFeesWithDescendants == 100000);
+    BOOST_CHECK(pool.setEvictionScore.size() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+
+    // A chain as long as it's allowed to get
+    vector<CTransaction> vChain;
+    vChain.push_back(MakeSpend(1, 0, 1 * COIN));
+    for (unsigned int i = 1; i < MEMPOOL_MAX_ANCESTORS; i++)
+        vChain.push_back(MakeSpend(vChain.back().GetHash(), 0, 1 * COIN));
+    for (unsigned int i = 0; i < vChain.size(); i++)
+    {
+        unsigned int nSize = ::GetSerializeSize(vChain[i], SER_NETWORK);
+        BOOST_CHECK(pool.CheckPackageLimits(vChain[i], nSize));
+        pool.AddUnchecked(vChain[i], 1000);
+    }
+    BOOST_CHECK(pool.mapTx[vChain[0].GetHash()].nCountWithDescendants == MEMPOOL_MAX_ANCESTORS);
+
+    // One more on the end is too many ancestors, one more off the first
+    // is too many descendants for it
+    CTransaction txTail = MakeSpend(vChain.back().GetHash(), 0, 1 * COIN);
+    BOOST_CHECK(!pool.CheckPackageLimits(txTail, ::GetSerializeSize(txTail, SER_NETWORK)));
+    CTransaction txSide = MakeSpend(vChain[0].GetHash(), 1, 1 * COIN);
+    BOOST_CHECK(!pool.CheckPackageLimits(txSide, ::GetSerializeSize(txSide, SER_NETWORK)));
+    CTransaction txLoner = MakeSpend(2, 0, 1 * COIN);
+    BOOST_CHECK(pool.CheckPackageLimits(txLoner, ::GetSerializeSize(txLoner, SER_NETWORK)));
+
+    // Mining the first makes room again
+    pool.Remove(vChain[0].GetHash());
+    BOOST_CHECK(pool.mapTx[vChain[1].GetHash()].nCountWithDescendants == MEMPOOL_MAX_ANCESTORS - 1);
+    BOOST_CHECK(pool.CheckPackageLimits(txTail, ::GetSerializeSize(txTail, SER_NETWORK)));
+
+    // Size counts as well as number
+    CTransaction txBig = MakeSpend(3, 0, 1 * COIN);
+    txBig.vout[0].scriptPubKey = CScript() << vector<unsigned char>(MEMPOOL_MAX_ANCESTOR_SIZE / 2, 0);
+    pool.AddUnchecked(txBig, 1000);
+    CTransaction txBigChild(txBig);
+    txBigChild.vin[0].prevout = COutPoint(txBig.GetHash(), 0);
+    txBigChild.InvalidateHash();
+    BOOST_CHECK(!pool.CheckPackageLimits(txBigChild, ::GetSerializeSize(txBigChild, SER_NETWORK)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
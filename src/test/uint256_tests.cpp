@@ -1,4 +1,8 @@
 #include "../uint256.h"
+#include "../headers.h"
+#include "insecure_rand.h"
+
+using namespace std;
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -13,4 +17,93 @@ BOOST_AUTO_TEST_CASE(equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+// Random number with a random number of significant bits
+static uint256 RandomUint256()
+{
+    uint256 n;
+    for (int i = 0; i < 8; i++)
+        n = (n << 32) | uint256(InsecureRand(65536) << 16 | InsecureRand(65536));
+    return n >> InsecureRand(257);
+}
+
+BOOST_AUTO_TEST_CASE(mul_div_match_bignum)
+{
+    CBigNum bn256 = CBigNum(1) << 256;
+    for (int i = 0; i < 2000; i++)
+    {
+        uint256 a = RandomUint256();
+        uint256 b = RandomUint256();
+        unsigned int n32 = InsecureRand(65536) << 16 | InsecureRand(65536);
+
+        CBigNum bnProduct = (CBigNum(a) * CBigNum(b)) % bn256;
+        BOOST_CHECK(a * b == bnProduct.getuint256());
+        bnProduct = (CBigNum(a) * CBigNum((uint64)n32)) % bn256;
+        BOOST_CHECK(a * n32 == bnProduct.getuint256());
+        if (b != 0)
+        {
+            CBigNum bnQuotient = CBigNum(a) / CBigNum(b);
+            BOOST_CHECK(a / b == bnQuotient.getuint256());
+        }
+        CBigNum bnA(a);
+        BOOST_CHECK_EQUAL(a.bits(), (unsigned int)BN_num_bits(&bnA));
+    }
+    BOOST_CHECK_THROW(uint256(1) / uint256(0), uint_error);
+}
+
+BOOST_AUTO_TEST_CASE(compact_matches_bignum)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        // Sizes either side of every edge, with and without the sign bit
+        unsigned int nCompact = InsecureRand(40) << 24 | InsecureRand(256) << 16 | InsecureRand(65536);
+        if (InsecureRand(4) == 0)
+            nCompact &= 0xff00ffff;
+        bool fNegative;
+        bool fOverflow;
+        uint256 n;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        if (fNegative)
+            BOOST_CHECK(bn < 0);
+        else if (fOverflow)
+            BOOST_CHECK(bn >= CBigNum(1) << 256);
+        else
+            BOOST_CHECK(CBigNum(n) == bn);
+
+        uint256 m = RandomUint256();
+        BOOST_CHECK_EQUAL(m.GetCompact(), CBigNum(m).GetCompact());
+    }
+    BOOST_CHECK_EQUAL(uint256().SetCompact(0x1d00ffff).GetHex(), "00000000ffff0000000000000000000000000000000000000000000000000000");
+    BOOST_CHECK_EQUAL((~uint256(0) >> 32).GetCompact(), 0x1d00ffffU);
+}
+
+BOOST_AUTO_TEST_CASE(block_work_matches_bignum)
+{
+    CBlockIndex index;
+    for (int i = 0; i < 5000; i++)
+    {
+        index.nBits = InsecureRand(40) << 24 | InsecureRand(256) << 16 | InsecureRand(65536);
+        CBigNum bnTarget;
+        bnTarget.SetCompact(index.nBits);
+        CBigNum bnWork = 0;
+        if (bnTarget > 0)
+            bnWork = (CBigNum(1)<<256) / (bnTarget+1);
+        BOOST_CHECK(index.GetBlockWork() == bnWork.getuint256());
+    }
+
+    // Adding up the chain work, the way LoadBlockIndex does for every block
+    uint256 nChainWork = 0;
+    CBigNum bnChainWork = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        index.nBits = 0x1c000000 | ((i + 1) * 61);
+        nChainWork = nChainWork + index.GetBlockWork();
+        CBigNum bnTarget;
+        bnTarget.SetCompact(index.nBits);
+        bnChainWork = bnChainWork + (CBigNum(1)<<256) / (bnTarget+1);
+    }
+    BOOST_CHECK(nChainWork == bnChainWork.getuint256());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@ using namespace std;
 extern string MakeMultisignScript(string strAddresses, CScript& scriptPubKey);
 extern bool IsMultisignScript(const CScript& scriptPubKey);
 extern bool ExtractMultisignAddress(const CScript& scriptPubKey, string& address);
+extern bool ScriptMatchesKeys(const CScript& script, const set<uint160>& setKeyHashes);
 
 static void ShutdownAtExit() {
     static bool fDidShutdown = false;
@@ -250,3 +251,172 @@ BOOST_AUTO_TEST_CASE(multisign_redeem_change)
 }
 
 BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+// SelectCoinsFromValues treats a NULL transaction as "no coin", so every
+// test coin gets its own dummy CWalletTx
+static vector<CWalletTx*> vDummyTx;
+
+static void AddCoin(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vCoins, int64 nValue)
+{
+    CWalletTx* pwtx = new CWalletTx();
+    vDummyTx.push_back(pwtx);
+    vCoins.push_back(make_pair(nValue, make_pair((const CWalletTx*)pwtx, (unsigned int)0)));
+}
+
+static void ClearCoins(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vCoins)
+{
+    vCoins.clear();
+    BOOST_FOREACH(CWalletTx* pwtx, vDummyTx)
+        delete pwtx;
+    vDummyTx.clear();
+}
+
+BOOST_AUTO_TEST_CASE(select_coins)
+{
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vCoins;
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64 nValue;
+
+    BOOST_CHECK(!SelectCoinsFromValues(vCoins, COIN, setCoins, nValue));
+
+    AddCoin(vCoins, 2 * CENT);
+    AddCoin(vCoins, 5 * CENT);
+    AddCoin(vCoins, 10 * CENT);
+    AddCoin(vCoins, 20 * CENT);
+    AddCoin(vCoins, 30 * CENT);
+
+    // Not enough
+    BOOST_CHECK(!SelectCoinsFromValues(vCoins, 70 * CENT, setCoins, nValue));
+
+    // Exact single coin
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, 20 * CENT, setCoins, nValue));
+    BOOST_CHECK(nValue == 20 * CENT && setCoins.size() == 1);
+
+    // Exact combinations need no change
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, 37 * CENT, setCoins, nValue));
+    BOOST_CHECK(nValue == 37 * CENT && setCoins.size() == 3);
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, 17 * CENT, setCoins, nValue));
+    BOOST_CHECK(nValue == 17 * CENT);
+
+    // Everything
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, 67 * CENT, setCoins, nValue));
+    BOOST_CHECK(nValue == 67 * CENT && setCoins.size() == 5);
+
+    // A larger coin is used when nothing smaller adds up
+    AddCoin(vCoins, 5 * COIN);
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, 2 * COIN, setCoins, nValue));
+    BOOST_CHECK(nValue == 5 * COIN && setCoins.size() == 1);
+
+    ClearCoins(vCoins);
+}
+
+BOOST_AUTO_TEST_CASE(select_coins_input_limit)
+{
+    // Thousands of dust outputs can't pay for a big send by themselves
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vCoins;
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64 nValue;
+    for (int i = 0; i < 5000; i++)
+        AddCoin(vCoins, CENT / 100);
+    BOOST_CHECK(!SelectCoinsFromValues(vCoins, 40 * CENT, setCoins, nValue));
+
+    AddCoin(vCoins, COIN);
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, 40 * CENT, setCoins, nValue));
+    BOOST_CHECK(nValue == COIN && setCoins.size() == 1);
+
+    BOOST_CHECK(SelectCoinsFromValues(vCoins, CENT / 2, setCoins, nValue));
+    BOOST_CHECK(nValue == CENT / 2 && setCoins.size() == 50);
+
+    ClearCoins(vCoins);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(rescan_tests)
+
+BOOST_AUTO_TEST_CASE(script_matches_keys)
+{
+    CKeyStore keystore;
+    set<uint160> setKeyHashes;
+    vector<unsigned char> vchPubKey = keystore.GenerateNewKey();
+    setKeyHashes.insert(Hash160(vchPubKey));
+    CKey keyOther;
+    keyOther.MakeNewKey();
+    vector<unsigned char> vchOther = keyOther.GetPubKey();
+
+    vector<CScript> vMine;
+    vMine.push_back(CScript() << vchPubKey << OP_CHECKSIG);
+    vMine.push_back(CScript() << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY << OP_CHECKSIG);
+
+    vector<CScript> vNotMine;
+    vNotMine.push_back(CScript() << vchOther << OP_CHECKSIG);
+    vNotMine.push_back(CScript() << OP_DUP << OP_HASH160 << Hash160(vchOther) << OP_EQUALVERIFY << OP_CHECKSIG);
+    vNotMine.push_back(CScript() << OP_RETURN);
+    vNotMine.push_back(CScript());
+
+    // The prefilter may let extra scripts through but never drops one of ours
+    BOOST_FOREACH(const CScript& script, vMine)
+    {
+        BOOST_CHECK(IsMine(keystore, script));
+        BOOST_CHECK(ScriptMatchesKeys(script, setKeyHashes));
+    }
+    BOOST_FOREACH(const CScript& script, vNotMine)
+    {
+        BOOST_CHECK(!IsMine(keystore, script));
+        BOOST_CHECK(!ScriptMatchesKeys(script, setKeyHashes));
+    }
+
+    // Cut off in the middle of a push
+    CScript scriptTruncated = vMine[1];
+    scriptTruncated.resize(10);
+    BOOST_CHECK(!ScriptMatchesKeys(scriptTruncated, setKeyHashes));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(listtransactions_tests)
+
+BOOST_AUTO_TEST_CASE(ordered_position)
+{
+    // Moves for two accounts, some at the same time, added out of order
+    CWallet wallet;
+    vector<string> vAccount;
+    for (int i = 0; i < 40; i++)
+    {
+        CAccountingEntry entry;
+        entry.strAccount = (i % 3 == 0 ? "a" : "b");
+        entry.nCreditDebit = i;
+        entry.nTime = 1000 + (i * 7) % 20;
+        wallet.AddAccountingEntry(entry);
+    }
+    CRITICAL_BLOCK(wallet.cs_mapWallet)
+    {
+        BOOST_CHECK_EQUAL(wallet.wtxOrdered.size(), 40);
+        for (unsigned int i = 1; i < wallet.wtxOrdered.size(); i++)
+            BOOST_CHECK(wallet.wtxOrdered[i-1].first.first <= wallet.wtxOrdered[i].first.first);
+        BOOST_FOREACH(const CWallet::TxItems::value_type& item, wallet.wtxOrdered)
+            vAccount.push_back(item.second.second->strAccount);
+
+        BOOST_CHECK_EQUAL(wallet.GetOrderedPosition("*", 0), 40);
+        BOOST_CHECK_EQUAL(wallet.GetOrderedPosition("*", 15), 25);
+        BOOST_CHECK_EQUAL(wallet.GetOrderedPosition("*", 100), 0);
+
+        // Against counting back from the newest, as listtransactions used to
+        const char* pszAccounts[] = { "a", "b", "c" };
+        for (int a = 0; a < 3; a++)
+        {
+            for (int nFrom = 0; nFrom < 45; nFrom++)
+            {
+                unsigned int nPos = vAccount.size();
+                for (int nSkip = nFrom; nSkip > 0 && nPos > 0; nPos--)
+                    if (vAccount[nPos-1] == pszAccounts[a])
+                        nSkip--;
+                BOOST_CHECK_EQUAL(wallet.GetOrderedPosition(pszAccounts[a], nFrom), nPos);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
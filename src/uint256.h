@@ -7,6 +7,7 @@
 #include "serialize.h"
 
 #include <limits.h>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -25,6 +26,13 @@ typedef unsigned long long  uint64;
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
 
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+
 
 // We have to keep a separate base class without constructors
 // so the compiler will let us use it in a union
@@ -181,6 +189,78 @@ public:
         return *this;
     }
 
+    base_uint& operator*=(unsigned int b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    base_uint& operator*=(const base_uint& b)
+    {
+        // Schoolbook, dropping everything past the top word
+        base_uint a;
+        for (int i = 0; i < WIDTH; i++)
+            a.pn[i] = 0;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            uint64 carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64 n = carry + a.pn[i+j] + (uint64)pn[j] * b.pn[i];
+                a.pn[i+j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        *this = a;
+        return *this;
+    }
+
+    base_uint& operator/=(const base_uint& b)
+    {
+        // Shift and subtract, one quotient bit at a time.  Works on the
+        // words directly, it runs for every block's work.
+        base_uint div = b;
+        base_uint num = *this;
+        *this = 0;
+        int nNumBits = num.bits();
+        int nDivBits = div.bits();
+        if (nDivBits == 0)
+            throw uint_error("base_uint::operator/= : division by zero");
+        if (nDivBits > nNumBits)
+            return *this;
+        int shift = nNumBits - nDivBits;
+        div <<= shift;
+        int nTop = (nNumBits - 1) / 32;
+        while (shift >= 0)
+        {
+            int i = nTop;
+            while (i > 0 && num.pn[i] == div.pn[i])
+                i--;
+            if (num.pn[i] >= div.pn[i])
+            {
+                uint64 borrow = 0;
+                for (int j = 0; j <= nTop; j++)
+                {
+                    uint64 n = (uint64)num.pn[j] - div.pn[j] - borrow;
+                    num.pn[j] = (unsigned int)n;
+                    borrow = (n >> 32) & 1;
+                }
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            for (int j = 0; j < nTop; j++)
+                div.pn[j] = (div.pn[j] >> 1) | (div.pn[j+1] << 31);
+            div.pn[nTop] >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
 
     base_uint& operator++()
     {
@@ -362,6 +442,39 @@ public:
         return sizeof(pn);
     }
 
+    uint64 GetLow64() const
+    {
+        return pn[0] | (uint64)pn[1] << 32;
+    }
+
+    // Position of the highest set bit plus one, 0 for zero
+    unsigned int bits() const
+    {
+        for (int i = WIDTH-1; i >= 0; i--)
+        {
+            if (pn[i])
+            {
+                unsigned int nBits = 32;
+                while (!(pn[i] & (1U << (nBits-1))))
+                    nBits--;
+                return 32 * i + nBits;
+            }
+        }
+        return 0;
+    }
+
+    double getdouble() const
+    {
+        double ret = 0.0;
+        double fact = 1.0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            ret += fact * pn[i];
+            fact *= 4294967296.0;
+        }
+        return ret;
+    }
+
 
     unsigned int GetSerializeSize(int nType=0, int nVersion=VERSION) const
     {
@@ -570,6 +683,56 @@ public:
         else
             *this = 0;
     }
+
+    // The compact form of a target kept in nBits: the top byte is a size in
+    // bytes, the low 23 bits are the most significant bits of the number and
+    // bit 23 is a sign.  Same values as CBigNum::SetCompact and GetCompact
+    // for anything that fits, pfOverflow says when it doesn't.
+    uint256& SetCompact(unsigned int nCompact, bool* pfNegative=NULL, bool* pfOverflow=NULL)
+    {
+        unsigned int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = (nWord != 0 && (nCompact & 0x00800000) != 0);
+        if (pfOverflow)
+            *pfOverflow = (nWord != 0 && (nSize > 34 ||
+                                          (nWord > 0xff && nSize > 33) ||
+                                          (nWord > 0xffff && nSize > 32)));
+        return *this;
+    }
+
+    unsigned int GetCompact() const
+    {
+        unsigned int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = GetLow64() << 8 * (3 - nSize);
+        else
+        {
+            uint256 bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.GetLow64();
+        }
+
+        // The mantissa can't have its top bit set, that's the sign
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }
@@ -584,6 +747,9 @@ inline const uint256 operator&(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { return uint256(a) |= b; }
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
+inline const uint256 operator*(const base_uint256& a, const base_uint256& b) { return uint256(a) *= b; }
+inline const uint256 operator/(const base_uint256& a, const base_uint256& b) { return uint256(a) /= b; }
+inline const uint256 operator*(const base_uint256& a, unsigned int b)        { return uint256(a) *= b; }
 
 inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
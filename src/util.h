@@ -324,6 +324,16 @@ inline int64 atoi64(const std::string& str)
 #endif
 }
 
+// Adds to n for all threads to see without taking a lock, returns the new value
+inline int64 AtomicAdd(volatile int64& n, int64 nAdd)
+{
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd64(&n, nAdd) + nAdd;
+#else
+    return __sync_add_and_fetch(&n, nAdd);
+#endif
+}
+
 inline int atoi(const std::string& str)
 {
     return atoi(str.c_str());
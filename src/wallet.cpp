@@ -42,6 +42,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateSpendable(wtx);
                     vWalletUpdated.push_back(txin.prevout.hash);
                 }
             }
@@ -49,6 +50,503 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
     }
 }
 
+void CWallet::OrderedInsert(int64 nTime, CWalletTx* pwtx, CAccountingEntry* pacentry)
+{
+    // requires cs_mapWallet
+    // New items are almost always the newest, so this is usually the end
+    // and nothing has to move
+    TxOrderKey key(nTime, nOrderSequence++);
+    pair<TxOrderKey, TxPair> item(key, TxPair(pwtx, pacentry));
+    wtxOrdered.insert(upper_bound(wtxOrdered.begin(), wtxOrdered.end(), item), item);
+    if (pacentry)
+    {
+        vAcentryOrdered.insert(upper_bound(vAcentryOrdered.begin(), vAcentryOrdered.end(), key), key);
+        vector<TxOrderKey>& vAccount = mapAcentryOrdered[pacentry->strAccount];
+        vAccount.insert(upper_bound(vAccount.begin(), vAccount.end(), key), key);
+    }
+}
+
+static void EraseOrderedKey(vector<CWallet::TxOrderKey>& v, const CWallet::TxOrderKey& key)
+{
+    vector<CWallet::TxOrderKey>::iterator it = lower_bound(v.begin(), v.end(), key);
+    if (it != v.end() && *it == key)
+        v.erase(it);
+}
+
+void CWallet::OrderedErase(int64 nTime, CWalletTx* pwtx, CAccountingEntry* pacentry)
+{
+    // requires cs_mapWallet
+    TxPair item(pwtx, pacentry);
+    TxItems::iterator it = lower_bound(wtxOrdered.begin(), wtxOrdered.end(), make_pair(TxOrderKey(nTime, 0), TxPair()));
+    for (; it != wtxOrdered.end() && (*it).first.first == nTime; ++it)
+    {
+        if ((*it).second == item)
+        {
+            if (pacentry)
+            {
+                EraseOrderedKey(vAcentryOrdered, (*it).first);
+                EraseOrderedKey(mapAcentryOrdered[pacentry->strAccount], (*it).first);
+            }
+            wtxOrdered.erase(it);
+            return;
+        }
+    }
+}
+
+unsigned int CWallet::GetOrderedPosition(const string& strAccount, int nFrom) const
+{
+    // requires cs_mapWallet
+    // Where listtransactions starts for strAccount, the newest nFrom items
+    // skipped.  It lists all wallet transactions but only the account's
+    // own accounting entries, so what counts after a position is every
+    // item less the other accounts' entries.  That only grows towards the
+    // start, so the last position with at least nFrom after it is found
+    // by bisection.
+    unsigned int nSize = wtxOrdered.size();
+    if (strAccount == "*")
+        return nSize - min((unsigned int)max(nFrom, 0), nSize);
+
+    static const vector<TxOrderKey> vEmpty;
+    map<string, vector<TxOrderKey> >::const_iterator mi = mapAcentryOrdered.find(strAccount);
+    const vector<TxOrderKey>& vAccount = (mi != mapAcentryOrdered.end() ? (*mi).second : vEmpty);
+    unsigned int nLow = 0;
+    unsigned int nHigh = nSize;
+    while (nLow < nHigh)
+    {
+        unsigned int nMid = nHigh - (nHigh - nLow) / 2;
+        int nCounted = 0;
+        if (nMid < nSize)
+        {
+            const TxOrderKey& key = wtxOrdered[nMid].first;
+            int nOther = (vAcentryOrdered.end() - lower_bound(vAcentryOrdered.begin(), vAcentryOrdered.end(), key)) -
+                         (vAccount.end() - lower_bound(vAccount.begin(), vAccount.end(), key));
+            nCounted = (nSize - nMid) - nOther;
+        }
+        if (nCounted >= nFrom)
+            nLow = nMid;
+        else
+            nHigh = nMid - 1;
+    }
+    return nLow;
+}
+
+void CWallet::ReindexOrdered()
+{
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        wtxOrdered.clear();
+        vAcentryOrdered.clear();
+        mapAcentryOrdered.clear();
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            CWalletTx* pwtx = &(*it).second;
+            pwtx->nTimeOrdered = pwtx->GetTxTime();
+            OrderedInsert(pwtx->nTimeOrdered, pwtx, (CAccountingEntry*)0);
+        }
+        BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+            OrderedInsert(entry.nTime, (CWalletTx*)0, &entry);
+    }
+}
+
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    // Only call once the entry is committed to wallet.dat
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        laccentries.push_back(acentry);
+        CAccountingEntry& entry = laccentries.back();
+        OrderedInsert(entry.nTime, (CWalletTx*)0, &entry);
+        mapLedgerSettled[entry.strAccount] += entry.nCreditDebit;
+    }
+}
+
+void CWallet::LedgerAddAmounts(const CWalletTx& wtx, map<string, int64>& mapSpent, map<string, int64>& mapRecv, bool fSettled)
+{
+    // requires cs_mapWallet and cs_mapAddressBook
+    // Same amounts as CWalletTx::GetAccountAmounts, for all accounts at once.
+    // Received amounts go to mapRecv, the rest doesn't depend on minconf
+    // and goes to mapSpent.
+    if (!wtx.IsFinal())
+        return;
+
+    int64 nGeneratedImmature, nGeneratedMature, nFee;
+    string strSentAccount;
+    list<pair<string, int64> > listReceived;
+    list<pair<string, int64> > listSent;
+    wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
+
+    if (nGeneratedMature != 0)
+        mapSpent[""] += nGeneratedMature;
+    if (nFee != 0 || !listSent.empty())
+    {
+        int64& nSentBalance = mapSpent[strSentAccount];
+        nSentBalance -= nFee;
+        BOOST_FOREACH(const PAIRTYPE(string, int64)& s, listSent)
+            nSentBalance -= s.second;
+    }
+    BOOST_FOREACH(const PAIRTYPE(string, int64)& r, listReceived)
+    {
+        map<string, string>::const_iterator mi = mapAddressBook.find(r.first);
+        mapRecv[mi != mapAddressBook.end() ? (*mi).second : string("")] += r.second;
+        if (fSettled)
+            setLedgerAddresses.insert(r.first);
+    }
+
+    // Outputs to addresses not in the address book are change and left out
+    // of the sent amounts, so labelling one later changes those too
+    if (fSettled && wtx.GetDebit() > 0)
+    {
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        {
+            vector<unsigned char> vchPubKey;
+            if (IsChange(txout) && ExtractPubKey(txout.scriptPubKey, this, vchPubKey))
+                setLedgerAddresses.insert(PubKeyToAddress(vchPubKey));
+        }
+    }
+}
+
+void CWallet::LedgerAddReceived(const CWalletTx& wtx)
+{
+    // requires cs_mapWallet
+    if (wtx.IsCoinBase())
+        return;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        uint160 hash160 = wtx.vout[i].scriptPubKey.GetBitcoinAddressHash160();
+        if (hash160 == 0 || !IsMine(wtx.vout[i]))
+            continue;
+        mapReceived[hash160].vRecent.push_back(make_pair(&wtx, i));
+    }
+}
+
+void CWallet::LedgerEraseReceived(const CWalletTx& wtx)
+{
+    // requires cs_mapWallet
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        map<uint160, CReceivedTally>::iterator mi = mapReceived.find(txout.scriptPubKey.GetBitcoinAddressHash160());
+        if (mi == mapReceived.end())
+            continue;
+        vector<pair<const CWalletTx*,unsigned int> >& vRecent = (*mi).second.vRecent;
+        for (unsigned int i = 0; i < vRecent.size(); )
+        {
+            if (vRecent[i].first == &wtx)
+                vRecent.erase(vRecent.begin() + i);
+            else
+                i++;
+        }
+    }
+}
+
+void CWallet::LedgerSettleReceived(const CWalletTx& wtx)
+{
+    // requires cs_mapWallet
+    int nHeight = nBestHeight - wtx.GetDepthInMainChain() + 1;
+    for (unsigned int n = 0; n < wtx.vout.size(); n++)
+    {
+        map<uint160, CReceivedTally>::iterator mi = mapReceived.find(wtx.vout[n].scriptPubKey.GetBitcoinAddressHash160());
+        if (mi == mapReceived.end())
+            continue;
+        CReceivedTally& tally = (*mi).second;
+        for (unsigned int i = 0; i < tally.vRecent.size(); i++)
+        {
+            if (tally.vRecent[i] == make_pair(&wtx, n))
+            {
+                tally.vRecent.erase(tally.vRecent.begin() + i);
+                tally.nSettled += wtx.vout[n].nValue;
+                tally.nSettledHeight = max(tally.nSettledHeight, nHeight);
+                break;
+            }
+        }
+    }
+}
+
+void CWallet::RefreshLedger()
+{
+    // requires cs_mapWallet and cs_mapAddressBook
+    // A reorg can only undo settled transactions if it goes that deep
+    if (!fLedgerDirty && pindexLedgerBest && !pindexLedgerBest->IsInMainChain())
+    {
+        CBlockIndex* pfork = pindexLedgerBest;
+        while (pfork && !pfork->IsInMainChain())
+            pfork = pfork->pprev;
+        if (!pfork || pindexLedgerBest->nHeight - pfork->nHeight + 1 >= LEDGER_SETTLED_DEPTH)
+            fLedgerDirty = true;
+    }
+
+    if (fLedgerDirty)
+    {
+        printf("RefreshLedger() : rebuilding account ledger\n");
+        mapLedgerSettled.clear();
+        setLedgerRecent.clear();
+        setLedgerAddresses.clear();
+        mapReceived.clear();
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            setLedgerRecent.insert(&(*it).second);
+            LedgerAddReceived((*it).second);
+        }
+        BOOST_FOREACH(const CAccountingEntry& entry, laccentries)
+            mapLedgerSettled[entry.strAccount] += entry.nCreditDebit;
+        pindexLedgerBest = NULL;
+        fLedgerDirty = false;
+    }
+
+    if (pindexLedgerBest != pindexBest)
+    {
+        pindexLedgerBest = pindexBest;
+        fLedgerTallied = false;
+
+        // Move whatever is deep enough now over to the settled totals
+        for (set<const CWalletTx*>::iterator it = setLedgerRecent.begin(); it != setLedgerRecent.end(); )
+        {
+            const CWalletTx* pwtx = *it;
+            if (pwtx->IsFinal() && pwtx->GetBlocksToMaturity() == 0 && pwtx->GetDepthInMainChain() >= LEDGER_SETTLED_DEPTH)
+            {
+                LedgerAddAmounts(*pwtx, mapLedgerSettled, mapLedgerSettled, true);
+                LedgerSettleReceived(*pwtx);
+                setLedgerRecent.erase(it++);
+            }
+            else
+                ++it;
+        }
+    }
+
+    if (fLedgerTallied)
+        return;
+
+    // Tally the recent transactions by depth.  Amounts that count at any
+    // minconf go in the deepest slot, then summing from the deep end gives
+    // the total for each minconf.
+    mapLedgerRecent.clear();
+    BOOST_FOREACH(const CWalletTx* pwtx, setLedgerRecent)
+    {
+        map<string, int64> mapSpent;
+        map<string, int64> mapRecv;
+        LedgerAddAmounts(*pwtx, mapSpent, mapRecv, false);
+        BOOST_FOREACH(const PAIRTYPE(string, int64)& item, mapSpent)
+        {
+            vector<int64>& vTotals = mapLedgerRecent[item.first];
+            vTotals.resize(LEDGER_SETTLED_DEPTH + 1, 0);
+            vTotals[LEDGER_SETTLED_DEPTH] += item.second;
+        }
+        if (mapRecv.empty())
+            continue;
+        int nDepth = max(0, min(pwtx->GetDepthInMainChain(), LEDGER_SETTLED_DEPTH));
+        BOOST_FOREACH(const PAIRTYPE(string, int64)& item, mapRecv)
+        {
+            vector<int64>& vTotals = mapLedgerRecent[item.first];
+            vTotals.resize(LEDGER_SETTLED_DEPTH + 1, 0);
+            vTotals[nDepth] += item.second;
+        }
+    }
+    for (map<string, vector<int64> >::iterator mi = mapLedgerRecent.begin(); mi != mapLedgerRecent.end(); ++mi)
+    {
+        vector<int64>& vTotals = (*mi).second;
+        for (int n = LEDGER_SETTLED_DEPTH - 1; n >= 0; n--)
+            vTotals[n] += vTotals[n+1];
+    }
+    fLedgerTallied = true;
+}
+
+bool CWallet::GetAccountBalance(const string& strAccount, int nMinDepth, int64& nBalanceRet)
+{
+    // Deeper minconf than the ledger keeps has to be answered by a full scan
+    if (nMinDepth > LEDGER_SETTLED_DEPTH)
+        return false;
+    nMinDepth = max(nMinDepth, 0);
+
+    CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        RefreshLedger();
+
+        nBalanceRet = 0;
+        map<string, int64>::const_iterator mi = mapLedgerSettled.find(strAccount);
+        if (mi != mapLedgerSettled.end())
+            nBalanceRet += (*mi).second;
+        map<string, vector<int64> >::const_iterator mr = mapLedgerRecent.find(strAccount);
+        if (mr != mapLedgerRecent.end())
+            nBalanceRet += (*mr).second[nMinDepth];
+    }
+    return true;
+}
+
+bool CWallet::GetAccountBalances(int nMinDepth, map<string, int64>& mapBalancesRet)
+{
+    if (nMinDepth > LEDGER_SETTLED_DEPTH)
+        return false;
+    nMinDepth = max(nMinDepth, 0);
+
+    CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        RefreshLedger();
+
+        BOOST_FOREACH(const PAIRTYPE(string, int64)& item, mapLedgerSettled)
+            mapBalancesRet[item.first] += item.second;
+        for (map<string, vector<int64> >::const_iterator mr = mapLedgerRecent.begin(); mr != mapLedgerRecent.end(); ++mr)
+            mapBalancesRet[(*mr).first] += (*mr).second[nMinDepth];
+    }
+    return true;
+}
+
+bool CWallet::GetReceivedByHash160(const uint160& hash160, int nMinDepth, int64& nAmountRet, int& nConfRet)
+{
+    // nConfRet is the depth of the newest output counted, INT_MAX if none were
+    nAmountRet = 0;
+    nConfRet = INT_MAX;
+    if (nMinDepth > LEDGER_SETTLED_DEPTH)
+        return false;
+
+    CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        RefreshLedger();
+
+        map<uint160, CReceivedTally>::const_iterator mi = mapReceived.find(hash160);
+        if (mi == mapReceived.end())
+            return true;
+        const CReceivedTally& tally = (*mi).second;
+        if (tally.nSettledHeight >= 0)
+        {
+            nAmountRet += tally.nSettled;
+            nConfRet = nBestHeight - tally.nSettledHeight + 1;
+        }
+        BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, tally.vRecent)
+        {
+            const CWalletTx* pcoin = coin.first;
+            if (!pcoin->IsFinal())
+                continue;
+            int nDepth = pcoin->GetDepthInMainChain();
+            if (nDepth < nMinDepth)
+                continue;
+            nAmountRet += pcoin->vout[coin.second].nValue;
+            nConfRet = min(nConfRet, nDepth);
+        }
+    }
+    return true;
+}
+
+void CWallet::GetAccountAddresses(const string& strAccount, set<uint160>& setAddressRet)
+{
+    setAddressRet.clear();
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        if (!fAccountAddressesBuilt)
+        {
+            mapAccountAddresses.clear();
+            BOOST_FOREACH(const PAIRTYPE(string, string)& item, mapAddressBook)
+            {
+                uint160 hash160;
+                if (AddressToHash160(item.first, hash160))
+                    mapAccountAddresses[item.second].insert(hash160);
+            }
+            fAccountAddressesBuilt = true;
+        }
+
+        map<string, set<uint160> >::const_iterator mi = mapAccountAddresses.find(strAccount);
+        if (mi == mapAccountAddresses.end())
+            return;
+
+        // We're only counting our own valid bitcoin addresses and not ip addresses
+        BOOST_FOREACH(const uint160& hash160, (*mi).second)
+        {
+            CScript scriptPubKey;
+            scriptPubKey.SetBitcoinAddress(hash160);
+            if (::IsMine(*this, scriptPubKey))
+                setAddressRet.insert(hash160);
+        }
+    }
+}
+
+bool CWallet::IsSpendableConfirmed(const CWalletTx& wtx) const
+{
+    // Same test GetBalance has always used: GetAvailableCredit counts
+    // nothing for immature coinbase
+    if (!wtx.IsFinal() || !wtx.IsConfirmed())
+        return false;
+    if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
+        return false;
+    return true;
+}
+
+void CWallet::UpdateSpendable(const CWalletTx& wtx)
+{
+    // requires cs_mapWallet, wtx must be the copy held in mapWallet
+    bool fConfirmed = IsSpendableConfirmed(wtx);
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        const CTxOut& txout = wtx.vout[i];
+        pair<const CWalletTx*,unsigned int> coin = make_pair(&wtx, i);
+        map<pair<const CWalletTx*,unsigned int>, bool>::iterator mi = mapSpendable.find(coin);
+        if (mi != mapSpendable.end())
+        {
+            ((*mi).second ? nSpendableConfirmed : nSpendableUnconfirmed) -= txout.nValue;
+            mapSpendable.erase(mi);
+        }
+
+        if (txout.nValue <= 0 || wtx.IsSpent(i) || !IsMine(txout))
+            continue;
+        mapSpendable.insert(make_pair(coin, fConfirmed));
+        (fConfirmed ? nSpendableConfirmed : nSpendableUnconfirmed) += txout.nValue;
+    }
+}
+
+void CWallet::EraseSpendable(const CWalletTx& wtx)
+{
+    // requires cs_mapWallet
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        map<pair<const CWalletTx*,unsigned int>, bool>::iterator mi = mapSpendable.find(make_pair(&wtx, i));
+        if (mi != mapSpendable.end())
+        {
+            ((*mi).second ? nSpendableConfirmed : nSpendableUnconfirmed) -= wtx.vout[i].nValue;
+            mapSpendable.erase(mi);
+        }
+    }
+}
+
+void CWallet::RefreshSpendable() const
+{
+    // requires cs_mapWallet
+    // Depth, finality and maturity only change with the best chain, so
+    // reclassify the unspent coins once per new best block (or reorg)
+    if (hashSpendableBest == hashBestChain)
+        return;
+    hashSpendableBest = hashBestChain;
+
+    nSpendableConfirmed = 0;
+    nSpendableUnconfirmed = 0;
+    const CWalletTx* pcoinLast = NULL;
+    bool fConfirmed = false;
+    for (map<pair<const CWalletTx*,unsigned int>, bool>::iterator mi = mapSpendable.begin(); mi != mapSpendable.end(); ++mi)
+    {
+        // Outputs of the same transaction are adjacent in the map
+        const CWalletTx* pcoin = (*mi).first.first;
+        if (pcoin != pcoinLast)
+        {
+            fConfirmed = IsSpendableConfirmed(*pcoin);
+            pcoinLast = pcoin;
+        }
+        (*mi).second = fConfirmed;
+        (fConfirmed ? nSpendableConfirmed : nSpendableUnconfirmed) += pcoin->vout[(*mi).first.second].nValue;
+    }
+}
+
+void CWallet::ReindexSpendable()
+{
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        mapSpendable.clear();
+        nSpendableConfirmed = 0;
+        nSpendableUnconfirmed = 0;
+        hashSpendableBest = hashBestChain;
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateSpendable((*it).second);
+    }
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -60,7 +558,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         wtx.pwallet = this;
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            wtx.nTimeOrdered = wtx.GetTxTime();
+            OrderedInsert(wtx.nTimeOrdered, &wtx, (CAccountingEntry*)0);
+            setLedgerRecent.insert(&wtx);
+            LedgerAddReceived(wtx);
+        }
+        fLedgerTallied = false;
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -83,6 +588,15 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                 fUpdated = true;
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
+
+            // Once it's in a block the tx is listed at the block's time
+            int64 nTime = wtx.GetTxTime();
+            if (nTime != wtx.nTimeOrdered)
+            {
+                OrderedErase(wtx.nTimeOrdered, &wtx, (CAccountingEntry*)0);
+                wtx.nTimeOrdered = nTime;
+                OrderedInsert(wtx.nTimeOrdered, &wtx, (CAccountingEntry*)0);
+            }
         }
 
         //// debug print
@@ -93,6 +607,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             if (!wtx.WriteToDisk())
                 return false;
 
+        UpdateSpendable(wtx);
+
         // If default receiving address gets used, replace it with a new one
         CScript scriptDefaultKey;
         scriptDefaultKey.SetBitcoinAddress(vchDefaultKey);
@@ -145,8 +661,18 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            EraseSpendable((*mi).second);
+            OrderedErase((*mi).second.nTimeOrdered, &(*mi).second, (CAccountingEntry*)0);
+            if (!setLedgerRecent.erase(&(*mi).second))
+                fLedgerDirty = true;
+            fLedgerTallied = false;
+            LedgerEraseReceived((*mi).second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -401,25 +927,180 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+// Rescans read blocks on a few threads ahead of the scan, which picks out
+// the transactions with an output that might pay to one of our keys.  Only
+// those, and ones touching a wallet transaction, get the full IsMine
+// treatment.  Long scans leave their position in wallet.dat so an
+// interrupted one picks up where it stopped.
+
+static const unsigned int RESCAN_READ_AHEAD = 64;
+static const unsigned int RESCAN_MAX_THREADS = 4;
+static const int RESCAN_CHECKPOINT_BLOCKS = 1000;
+
+bool ScriptMatchesKeys(const CScript& script, const set<uint160>& setKeyHashes)
+{
+    // Any push of one of our key hashes or public keys, a superset of what
+    // Solver will accept
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    vector<unsigned char> vch;
+    while (pc < script.end())
+    {
+        if (!script.GetOp(pc, opcode, vch))
+            return false;
+        if (vch.size() == 20 && setKeyHashes.count(uint160(vch)))
+            return true;
+        if (vch.size() >= 33 && setKeyHashes.count(Hash160(vch)))
+            return true;
+    }
+    return false;
+}
+
+class CRescanBlock
+{
+public:
+    CBlock block;
+    vector<bool> vfMatch;
+};
+
+class CRescan
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condBlocks;
+    vector<CBlockIndex*> vIndex;
+    map<unsigned int, boost::shared_ptr<CRescanBlock> > mapBlocks;
+    set<uint160> setKeyHashes;
+    unsigned int nNextRead;
+    unsigned int nConsumed;
+    bool fAbort;
+
+    CRescan()
+    {
+        nNextRead = 0;
+        nConsumed = 0;
+        fAbort = false;
+    }
+};
+
+void static ThreadRescanRead(CRescan* prescan)
+{
+    loop
+    {
+        unsigned int n;
+        {
+            boost::unique_lock<boost::mutex> lock(prescan->mutex);
+            while (prescan->nNextRead < prescan->vIndex.size() &&
+                   prescan->nNextRead >= prescan->nConsumed + RESCAN_READ_AHEAD && !prescan->fAbort)
+                prescan->condRead.wait(lock);
+            if (prescan->nNextRead >= prescan->vIndex.size() || prescan->fAbort)
+                return;
+            n = prescan->nNextRead++;
+        }
+
+        boost::shared_ptr<CRescanBlock> prb(new CRescanBlock());
+        if (!prb->block.ReadFromDisk(prescan->vIndex[n], true))
+            printf("ThreadRescanRead() : ReadFromDisk failed at height %d\n", prescan->vIndex[n]->nHeight);
+        prb->vfMatch.resize(prb->block.vtx.size());
+        for (int i = 0; i < prb->block.vtx.size(); i++)
+            BOOST_FOREACH(const CTxOut& txout, prb->block.vtx[i].vout)
+                if (ScriptMatchesKeys(txout.scriptPubKey, prescan->setKeyHashes))
+                    prb->vfMatch[i] = true;
+
+        boost::unique_lock<boost::mutex> lock(prescan->mutex);
+        prescan->mapBlocks[n] = prb;
+        prescan->condBlocks.notify_all();
+    }
+}
+
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, bool fRebuildLedger)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
-    CRITICAL_BLOCK(cs_mapWallet)
+    CRescan rescan;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+        rescan.vIndex.push_back(pindex);
+    if (rescan.vIndex.empty())
+        return 0;
+    CRITICAL_BLOCK(cs_mapKeys)
+        BOOST_FOREACH(const PAIRTYPE(vector<unsigned char>, CPrivKey)& item, mapKeys)
+            rescan.setKeyHashes.insert(Hash160(item.first));
+
+    // A -rescan may change anything, so start the account ledger over
+    if (fRebuildLedger)
+        CRITICAL_BLOCK(cs_mapWallet)
+            fLedgerDirty = true;
+
+    bool fCheckpoint = fFileBacked && rescan.vIndex.size() > RESCAN_CHECKPOINT_BLOCKS;
+    if (fCheckpoint)
+        CWalletDB(strWalletFile).WriteRescanBlock(CBlockLocator(pindexStart));
+
+    int64 nStart = GetTimeMillis();
+    boost::thread_group threads;
+    unsigned int nThreads = min(RESCAN_MAX_THREADS, max(1u, boost::thread::hardware_concurrency()));
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(ThreadRescanRead, &rescan));
+
+    bool fInterrupted = false;
+    for (unsigned int n = 0; n < rescan.vIndex.size(); n++)
     {
-        while (pindex)
+        if (fShutdown || fRequestShutdown)
+        {
+            fInterrupted = true;
+            break;
+        }
+
+        boost::shared_ptr<CRescanBlock> prb;
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            boost::unique_lock<boost::mutex> lock(rescan.mutex);
+            while (!rescan.mapBlocks.count(n))
+                rescan.condBlocks.wait(lock);
+            prb = rescan.mapBlocks[n];
+            rescan.mapBlocks.erase(n);
+            rescan.nConsumed = n + 1;
+            rescan.condRead.notify_all();
+        }
+
+        // The locks are only taken a transaction at a time so the node
+        // carries on while a long rescan runs
+        CBlock& block = prb->block;
+        for (int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            bool fCandidate = prb->vfMatch[i];
+            if (!fCandidate)
+            CRITICAL_BLOCK(cs_mapWallet)
             {
+                fCandidate = mapWallet.count(tx.GetHash());
+                for (int j = 0; j < tx.vin.size() && !fCandidate; j++)
+                    if (mapWallet.count(tx.vin[j].prevout.hash))
+                        fCandidate = true;
+            }
+            if (fCandidate)
+            CRITICAL_BLOCK(cs_main)
+            CRITICAL_BLOCK(cs_mapWallet)
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
-            }
-            pindex = pindex->pnext;
+        }
+
+        if (fCheckpoint && (n + 1) % RESCAN_CHECKPOINT_BLOCKS == 0)
+        {
+            CWalletDB(strWalletFile).WriteRescanBlock(CBlockLocator(rescan.vIndex[n]));
+            printf("ScanForWalletTransactions() : at height %d, %.1f blocks/s\n", rescan.vIndex[n]->nHeight,
+                   (n + 1) * 1000.0 / max((int64)1, GetTimeMillis() - nStart));
         }
     }
+
+    {
+        boost::unique_lock<boost::mutex> lock(rescan.mutex);
+        rescan.fAbort = true;
+        rescan.condRead.notify_all();
+    }
+    threads.join_all();
+
+    if (fFileBacked && !fInterrupted)
+        CWalletDB(strWalletFile).EraseRescanBlock();
     return ret;
 }
 
@@ -427,57 +1108,77 @@ void CWallet::ReacceptWalletTransactions()
 {
     CTxDB txdb("r");
     bool fRepeat = true;
-    while (fRepeat) CRITICAL_BLOCK(cs_mapWallet)
+    while (fRepeat)
     {
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        CBlockIndex* pindexScan = NULL;
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(cs_mapWallet)
         {
-            CWalletTx& wtx = item.second;
-            if (wtx.IsCoinBase() && wtx.IsSpent(0))
-                continue;
-
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
+                CWalletTx& wtx = item.second;
+                if (wtx.IsCoinBase() && wtx.IsSpent(0))
                     continue;
-                }
-                for (int i = 0; i < txindex.vSpent.size(); i++)
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (int i = 0; i < txindex.vSpent.size(); i++)
+                    {
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
+                        UpdateSpendable(wtx);
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Reaccept any txes of ours that aren't already in a block
+                    if (!wtx.IsCoinBase())
+                        wtx.AcceptWalletTransaction(txdb, false);
                 }
             }
-            else
+            if (!vMissingTx.empty())
             {
-                // Reaccept any txes of ours that aren't already in a block
-                if (!wtx.IsCoinBase())
-                    wtx.AcceptWalletTransaction(txdb, false);
+                // Scan from the earliest block holding one of the spends
+                set<pair<unsigned int, unsigned int> > setMissingBlocks;
+                BOOST_FOREACH(const CDiskTxPos& pos, vMissingTx)
+                    setMissingBlocks.insert(make_pair(pos.nFile, pos.nBlockPos));
+                for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+                {
+                    CBlockIndex* pindex = (*mi).second;
+                    if (setMissingBlocks.count(make_pair(pindex->nFile, pindex->nBlockPos)) && pindex->IsInMainChain() &&
+                        (!pindexScan || pindex->nHeight < pindexScan->nHeight))
+                        pindexScan = pindex;
+                }
+                if (!pindexScan)
+                    pindexScan = pindexGenesisBlock;
             }
         }
-        if (!vMissingTx.empty())
-        {
-            // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
-                fRepeat = true;  // Found missing transactions: re-do Reaccept.
-        }
+
+        // Outside the locks, the scan takes them a transaction at a time
+        if (!vMissingTx.empty() && ScanForWalletTransactions(pindexScan))
+            fRepeat = true;  // Found missing transactions: re-do Reaccept.
     }
 }
 
@@ -563,26 +1264,108 @@ void CWallet::ResendWalletTransactions()
 
 int64 CWallet::GetBalance() const
 {
-    int64 nStart = GetTimeMillis();
-
     int64 nTotal = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
-            nTotal += pcoin->GetAvailableCredit();
-        }
+        RefreshSpendable();
+        nTotal = nSpendableConfirmed;
     }
+    return nTotal;
+}
 
-    //printf("GetBalance() %"PRI64d"ms\n", GetTimeMillis() - nStart);
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    // Coins of ours that GetBalance doesn't count yet: unconfirmed or
+    // immature generated
+    int64 nTotal = 0;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        RefreshSpendable();
+        nTotal = nSpendableUnconfirmed;
+    }
     return nTotal;
 }
 
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+// Coin selection limits.  An input takes about 180 bytes and CreateTransaction
+// gives up on anything over MAX_BLOCK_SIZE_GEN/5, so selections with more
+// inputs than that are never useful.  Only the largest SELECT_COINS_MAX_CANDIDATES
+// coins below the target are searched, which keeps a send from scaling with
+// the size of the wallet.
+static const unsigned int SELECT_COINS_MAX_INPUTS = MAX_BLOCK_SIZE_GEN/5/180;
+static const unsigned int SELECT_COINS_MAX_CANDIDATES = 2000;
+static const int SELECT_COINS_MAX_TRIES = 100000;
+
+//
+// Depth first search for a subset of vValue (sorted largest first) that adds up
+// to between nTargetValue and nTargetValue + nTolerance, so the transaction
+// needs no change output.  Each coin is tried included before excluded, and a
+// branch is cut as soon as it overshoots or can't reach the target with what's
+// left.  Gives up after SELECT_COINS_MAX_TRIES steps.
+//
+static bool SelectCoinsBnB(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue, int64 nTolerance,
+                           vector<char>& vfBest, int64& nBest)
+{
+    // vRemaining[i] is the value of vValue[i] and everything after it
+    vector<int64> vRemaining(vValue.size() + 1, 0);
+    for (int i = vValue.size() - 1; i >= 0; i--)
+        vRemaining[i] = vRemaining[i+1] + vValue[i].first;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    bool fFound = false;
+    int64 nTotal = 0;
+    unsigned int nInputs = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < SELECT_COINS_MAX_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal > nTargetValue + nTolerance || nTotal + vRemaining[i] < nTargetValue)
+        {
+            fBacktrack = true;
+        }
+        else if (nTotal >= nTargetValue)
+        {
+            if (!fFound || nTotal < nBest)
+            {
+                fFound = true;
+                nBest = nTotal;
+                vfBest = vfIncluded;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+        else if (i == vValue.size() || nInputs >= SELECT_COINS_MAX_INPUTS)
+        {
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Go back to the last coin we included and try without it
+            while (i > 0 && !vfIncluded[i-1])
+                i--;
+            if (i == 0)
+                break;
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            nInputs--;
+            i++;
+        }
+        else
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+            nInputs++;
+            i++;
+        }
+    }
+    return fFound;
+}
+
+bool SelectCoinsFromValues(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vCoins, int64 nTargetValue,
+                           set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet)
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -594,58 +1377,40 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    CRITICAL_BLOCK(cs_mapWallet)
+    for (unsigned int i = 0; i < vCoins.size(); i++)
     {
-       vector<const CWalletTx*> vCoins;
-       vCoins.reserve(mapWallet.size());
-       for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-           vCoins.push_back(&(*it).second);
-       random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-       BOOST_FOREACH(const CWalletTx* pcoin, vCoins)
-       {
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
+        const pair<int64, pair<const CWalletTx*,unsigned int> >& coin = vCoins[i];
+        int64 n = coin.first;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
-                continue;
-
-            for (int i = 0; i < pcoin->vout.size(); i++)
-            {
-                if (pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]))
-                    continue;
-
-                int64 n = pcoin->vout[i].nValue;
-
-                if (n <= 0)
-                    continue;
-
-                pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin,i));
-
-                if (n == nTargetValue)
-                {
-                    setCoinsRet.insert(coin.second);
-                    nValueRet += coin.first;
-                    return true;
-                }
-                else if (n < nTargetValue + CENT)
-                {
-                    vValue.push_back(coin);
-                    nTotalLower += n;
-                }
-                else if (n < coinLowestLarger.first)
-                {
-                    coinLowestLarger = coin;
-                }
-            }
+        if (n == nTargetValue)
+        {
+            setCoinsRet.insert(coin.second);
+            nValueRet += coin.first;
+            return true;
+        }
+        else if (n < nTargetValue + CENT)
+        {
+            vValue.push_back(coin);
+        }
+        else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
         }
     }
 
-    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + CENT)
+    // Largest first, and only as many as we're willing to search
+    if (vValue.size() > SELECT_COINS_MAX_CANDIDATES)
+    {
+        partial_sort(vValue.begin(), vValue.begin() + SELECT_COINS_MAX_CANDIDATES, vValue.end(),
+                     greater<pair<int64, pair<const CWalletTx*,unsigned int> > >());
+        vValue.resize(SELECT_COINS_MAX_CANDIDATES);
+    }
+    else
+        sort(vValue.rbegin(), vValue.rend());
+    BOOST_FOREACH(const PAIRTYPE(int64, PAIRTYPE(const CWalletTx*,unsigned int))& coin, vValue)
+        nTotalLower += coin.first;
+
+    if ((nTotalLower == nTargetValue || nTotalLower == nTargetValue + CENT) && vValue.size() <= SELECT_COINS_MAX_INPUTS)
     {
         for (int i = 0; i < vValue.size(); ++i)
         {
@@ -664,67 +1429,117 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    if (nTotalLower >= nTargetValue + CENT)
-        nTargetValue += CENT;
+    // A combination that needs no change output at all is best, as long as
+    // it doesn't overpay by more than a change output would cost in fees
+    vector<char> vfBest;
+    int64 nBest = 0;
+    if (!SelectCoinsBnB(vValue, nTargetValue, MIN_TX_FEE, vfBest, nBest))
+    {
+        if (nTotalLower >= nTargetValue + CENT)
+            nTargetValue += CENT;
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend());
-    vector<char> vfIncluded;
-    vector<char> vfBest(vValue.size(), true);
-    int64 nBest = nTotalLower;
+        // Solve subset sum by stochastic approximation
+        vector<char> vfIncluded;
+        vfBest.assign(vValue.size(), true);
+        nBest = nTotalLower;
+        bool fBestTooMany = (vValue.size() > SELECT_COINS_MAX_INPUTS);
 
-    for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
         {
-            for (int i = 0; i < vValue.size(); i++)
+            vfIncluded.assign(vValue.size(), false);
+            int64 nTotal = 0;
+            unsigned int nInputs = 0;
+            bool fReachedTarget = false;
+            for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                for (int i = 0; i < vValue.size() && nInputs < SELECT_COINS_MAX_INPUTS; i++)
                 {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
+                    if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
                     {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
+                        nTotal += vValue[i].first;
+                        nInputs++;
+                        vfIncluded[i] = true;
+                        if (nTotal >= nTargetValue)
                         {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
+                            fReachedTarget = true;
+                            if (nTotal < nBest || fBestTooMany)
+                            {
+                                nBest = nTotal;
+                                vfBest = vfIncluded;
+                                fBestTooMany = false;
+                            }
+                            nTotal -= vValue[i].first;
+                            nInputs--;
+                            vfIncluded[i] = false;
                         }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
                     }
                 }
             }
         }
+
+        // If the next larger is still closer, or the subset would make the
+        // transaction too big, return it
+        if (coinLowestLarger.second.first && (fBestTooMany || coinLowestLarger.first - nTargetValue <= nBest - nTargetValue))
+        {
+            setCoinsRet.insert(coinLowestLarger.second);
+            nValueRet += coinLowestLarger.first;
+            return true;
+        }
+        if (fBestTooMany)
+            return false;
     }
 
-    // If the next larger is still closer, return it
-    if (coinLowestLarger.second.first && coinLowestLarger.first - nTargetValue <= nBest - nTargetValue)
+    for (int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+
+    //// debug print
+    printf("SelectCoins() best subset: ");
+    for (int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            printf("%s ", FormatMoney(vValue[i].first).c_str());
+    printf("total %s\n", FormatMoney(nBest).c_str());
+
+    return true;
+}
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+{
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vCoins;
+
+    CRITICAL_BLOCK(cs_mapWallet)
     {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else {
-        for (int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
+        RefreshSpendable();
+
+        // Only coins counted as confirmed can be spent, the rest of the
+        // spendable index is waiting on confirmations or maturity
+        vCoins.reserve(mapSpendable.size());
+        const CWalletTx* pcoinLast = NULL;
+        bool fDeepEnough = false;
+        for (map<pair<const CWalletTx*,unsigned int>, bool>::const_iterator mi = mapSpendable.begin(); mi != mapSpendable.end(); ++mi)
+        {
+            if (!(*mi).second)
+                continue;
+
+            // Outputs of the same transaction are adjacent in the map
+            const CWalletTx* pcoin = (*mi).first.first;
+            if (pcoin != pcoinLast)
             {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
+                fDeepEnough = (pcoin->GetDepthInMainChain() >= (pcoin->IsFromMe() ? nConfMine : nConfTheirs));
+                pcoinLast = pcoin;
             }
-
-        //// debug print
-        printf("SelectCoins() best subset: ");
-        for (int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                printf("%s ", FormatMoney(vValue[i].first).c_str());
-        printf("total %s\n", FormatMoney(nBest).c_str());
+            if (fDeepEnough)
+                vCoins.push_back(make_pair(pcoin->vout[(*mi).first.second].nValue, (*mi).first));
+        }
     }
 
-    return true;
+    // Shuffle so ties between equal values don't always go the same way
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+
+    return SelectCoinsFromValues(vCoins, nTargetValue, setCoinsRet, nValueRet);
 }
 
 bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
@@ -762,6 +1577,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
+                wtxNew.InvalidateHash();
                 wtxNew.fFromMe = true;
 
                 int64 nTotalValue = nValue + nFeeRet;
@@ -882,6 +1698,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.pwallet = this;
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateSpendable(coin);
                 vWalletUpdated.push_back(coin.GetHash());
             }
 
@@ -964,6 +1781,8 @@ bool CWallet::LoadWallet(bool& fFirstRunRet)
     fFirstRunRet = false;
     if (!CWalletDB(strWalletFile,"cr+").LoadWallet(this))
         return false;
+    ReindexSpendable();
+    ReindexOrdered();
     fFirstRunRet = vchDefaultKey.empty();
 
     if (!mapKeys.count(vchDefaultKey))
@@ -984,7 +1803,30 @@ bool CWallet::LoadWallet(bool& fFirstRunRet)
 
 bool CWallet::SetAddressBookName(const string& strAddress, const string& strName)
 {
-    mapAddressBook[strAddress] = strName;
+    CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        map<string, string>::iterator mi = mapAddressBook.find(strAddress);
+        if (mi == mapAddressBook.end() || (*mi).second != strName)
+        {
+            // Settled amounts involving this address now belong to another
+            // account or are no longer change
+            if (setLedgerAddresses.count(strAddress))
+                fLedgerDirty = true;
+            fLedgerTallied = false;
+        }
+        if (fAccountAddressesBuilt)
+        {
+            uint160 hash160;
+            if (AddressToHash160(strAddress, hash160))
+            {
+                if (mi != mapAddressBook.end())
+                    mapAccountAddresses[(*mi).second].erase(hash160);
+                mapAccountAddresses[strName].insert(hash160);
+            }
+        }
+        mapAddressBook[strAddress] = strName;
+    }
     if (!fFileBacked)
         return false;
     return CWalletDB(strWalletFile).WriteName(strAddress, strName);
@@ -992,7 +1834,21 @@ bool CWallet::SetAddressBookName(const string& strAddress, const string& strName
 
 bool CWallet::DelAddressBookName(const string& strAddress)
 {
-    mapAddressBook.erase(strAddress);
+    CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        map<string, string>::iterator mi = mapAddressBook.find(strAddress);
+        if (mi != mapAddressBook.end())
+        {
+            if (setLedgerAddresses.count(strAddress))
+                fLedgerDirty = true;
+            fLedgerTallied = false;
+            uint160 hash160;
+            if (fAccountAddressesBuilt && AddressToHash160(strAddress, hash160))
+                mapAccountAddresses[(*mi).second].erase(hash160);
+            mapAddressBook.erase(mi);
+        }
+    }
     if (!fFileBacked)
         return false;
     return CWalletDB(strWalletFile).EraseName(strAddress);
@@ -1260,6 +2116,7 @@ bool CWallet::CommitTransactionWithForeignInput(CWalletTx& wtxNew, uint256 hashI
                 CWalletTx &pcoin = mapWallet[txin.prevout.hash];
                 pcoin.MarkSpent(txin.prevout.n);
                 pcoin.WriteToDisk();
+                UpdateSpendable(pcoin);
                 vWalletUpdated.push_back(pcoin.GetHash());
             }
 
@@ -1344,6 +2201,7 @@ pair<string,string> CWallet::SendMoneyFromMultisignTx(string strAddress, CTransa
         // Change is last by convention
         if (fChange)
             wtxNew.vout.push_back(outChange);
+        wtxNew.InvalidateHash();
     }
     else
     {
@@ -1490,6 +2348,7 @@ pair<string,string> CWallet::SendMoneyFromMultisignTx(string strAddress, CTransa
 
     // Use the new scriptSig
     wtxNew.vin[0].scriptSig = scriptSigNew;
+    wtxNew.InvalidateHash();
 
     // Check if it verifies.  If we had to push any placeholders for signatures, it
     // will not, and we have to ask the user to have the counterparties sign.
@@ -1518,6 +2377,7 @@ pair<string,string> CWallet::SendMoneyFromMultisignTx(string strAddress, CTransa
 
     // It does not verify - serialize and convert to hex for other party signature
     wtxNew.vin[0].scriptSig = scriptSigNewWithPlaceholders;
+    wtxNew.InvalidateHash();
 
     CDataStream ss;
     ss.reserve(10000);
@@ -11,6 +11,29 @@
 class CWalletTx;
 class CReserveKey;
 class CWalletDB;
+class CAccountingEntry;
+
+// Account balances for minconf up to this are kept by the ledger in CWallet
+static const int LEDGER_SETTLED_DEPTH = 120;
+
+//
+// Outputs paying one of our addresses.  Once an output is LEDGER_SETTLED_DEPTH
+// deep its value moves from vRecent into nSettled.  Coinbase outputs are not
+// counted, the getreceivedby calls never did.
+//
+class CReceivedTally
+{
+public:
+    int64 nSettled;
+    int nSettledHeight;  // newest block with a settled output, -1 if none
+    std::vector<std::pair<const CWalletTx*,unsigned int> > vRecent;
+
+    CReceivedTally()
+    {
+        nSettled = 0;
+        nSettledHeight = -1;
+    }
+};
 
 class CWallet : public CKeyStore
 {
@@ -18,6 +41,61 @@ private:
     bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
+    // Index of our unspent outputs in mapWallet, so balance and coin selection
+    // don't have to walk the whole transaction history.  The value is true if
+    // the output is counted in nSpendableConfirmed (final, confirmed and mature)
+    // and false if it is counted in nSpendableUnconfirmed.  Whether a coin is
+    // confirmed depends on the best chain, so the split is re-tallied over the
+    // index whenever hashBestChain has moved, which also takes care of reorgs.
+    // All of it requires cs_mapWallet.
+    mutable std::map<std::pair<const CWalletTx*,unsigned int>, bool> mapSpendable;
+    mutable uint256 hashSpendableBest;
+    mutable int64 nSpendableConfirmed;
+    mutable int64 nSpendableUnconfirmed;
+
+    void OrderedInsert(int64 nTime, CWalletTx* pwtx, CAccountingEntry* pacentry);
+    void OrderedErase(int64 nTime, CWalletTx* pwtx, CAccountingEntry* pacentry);
+
+    // Per account balance ledger for GetAccountBalance.  Moves and the amounts
+    // of transactions at least LEDGER_SETTLED_DEPTH deep never change, so they
+    // are summed once into mapLedgerSettled.  Everything newer stays in
+    // setLedgerRecent, moving over to the settled totals as the chain grows.
+    // mapLedgerRecent holds running totals of setLedgerRecent per account and
+    // minconf: entry n is what counts towards a minconf n balance.  It is
+    // re-tallied whenever the best chain, a recent transaction or the address
+    // book has changed since.  A reorg deeper than the settled depth, a
+    // -rescan or relabelling an address counted in the settled totals sets
+    // fLedgerDirty and the ledger is rebuilt on next use.
+    // Requires cs_mapWallet and cs_mapAddressBook.
+    std::map<std::string, int64> mapLedgerSettled;
+    std::set<const CWalletTx*> setLedgerRecent;
+    std::map<std::string, std::vector<int64> > mapLedgerRecent;
+    std::set<std::string> setLedgerAddresses;
+    CBlockIndex* pindexLedgerBest;
+    bool fLedgerDirty;
+    bool fLedgerTallied;
+
+    // Received amounts by our bitcoin address (hash160), for getreceivedby*
+    // and listreceivedby*.  Outputs settle together with the account ledger.
+    // Requires cs_mapWallet.
+    std::map<uint160, CReceivedTally> mapReceived;
+
+    void LedgerAddAmounts(const CWalletTx& wtx, std::map<std::string, int64>& mapSpent, std::map<std::string, int64>& mapRecv, bool fSettled);
+    void LedgerAddReceived(const CWalletTx& wtx);
+    void LedgerEraseReceived(const CWalletTx& wtx);
+    void LedgerSettleReceived(const CWalletTx& wtx);
+    void RefreshLedger();
+
+    // Our addresses by account, built from mapAddressBook on first use and
+    // kept current by SetAddressBookName and DelAddressBookName.  Requires
+    // cs_mapAddressBook.
+    std::map<std::string, std::set<uint160> > mapAccountAddresses;
+    bool fAccountAddressesBuilt;
+
+    bool IsSpendableConfirmed(const CWalletTx& wtx) const;
+    void UpdateSpendable(const CWalletTx& wtx);
+    void EraseSpendable(const CWalletTx& wtx);
+    void RefreshSpendable() const;
 
 public:
     bool fFileBacked;
@@ -29,11 +107,25 @@ public:
     CWallet()
     {
         fFileBacked = false;
+        nSpendableConfirmed = 0;
+        nSpendableUnconfirmed = 0;
+        nOrderSequence = 0;
+        pindexLedgerBest = NULL;
+        fLedgerDirty = true;
+        fLedgerTallied = false;
+        fAccountAddressesBuilt = false;
     }
     CWallet(std::string strWalletFileIn)
     {
         strWalletFile = strWalletFileIn;
         fFileBacked = true;
+        nSpendableConfirmed = 0;
+        nSpendableUnconfirmed = 0;
+        nOrderSequence = 0;
+        pindexLedgerBest = NULL;
+        fLedgerDirty = true;
+        fLedgerTallied = false;
+        fAccountAddressesBuilt = false;
     }
 
     mutable CCriticalSection cs_mapWallet;
@@ -48,15 +140,43 @@ public:
 
     std::vector<unsigned char> vchDefaultKey;
 
+    // Wallet transactions and accounting entries in time order, oldest
+    // first, so listtransactions can index a page from the end without
+    // sorting the whole wallet.  Each is keyed by its time and a sequence
+    // number, so items with the same time stay in the order they were
+    // added.  vAcentryOrdered and mapAcentryOrdered hold the keys of all
+    // accounting entries and of each account's, which tells how many of
+    // another account's entries come after a position.  Accounting entries
+    // are read into laccentries once by LoadWallet.  Kept current by
+    // AddToWallet, EraseFromWallet and AddAccountingEntry; requires
+    // cs_mapWallet.
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::pair<int64, uint64> TxOrderKey;
+    typedef std::vector<std::pair<TxOrderKey, TxPair> > TxItems;
+    TxItems wtxOrdered;
+    std::vector<TxOrderKey> vAcentryOrdered;
+    std::map<std::string, std::vector<TxOrderKey> > mapAcentryOrdered;
+    uint64 nOrderSequence;
+    std::list<CAccountingEntry> laccentries;
+
     bool AddKey(const CKey& key);
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, bool fRebuildLedger = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    void ReindexSpendable();
+    void ReindexOrdered();
+    unsigned int GetOrderedPosition(const std::string& strAccount, int nFrom) const;
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    bool GetAccountBalance(const std::string& strAccount, int nMinDepth, int64& nBalanceRet);
+    bool GetAccountBalances(int nMinDepth, std::map<std::string, int64>& mapBalancesRet);
+    bool GetReceivedByHash160(const uint160& hash160, int nMinDepth, int64& nAmountRet, int& nConfRet);
+    void GetAccountAddresses(const std::string& strAccount, std::set<uint160>& setAddressRet);
     int64 GetBalance() const;
+    int64 GetUnconfirmedBalance() const;
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
@@ -228,6 +348,7 @@ public:
     std::vector<char> vfSpent;
 
     // memory only
+    int64 nTimeOrdered;  // key of this tx in pwallet->wtxOrdered
     mutable char fDebitCached;
     mutable char fCreditCached;
     mutable char fAvailableCreditCached;
@@ -273,6 +394,7 @@ public:
         fFromMe = false;
         strFromAccount.clear();
         vfSpent.clear();
+        nTimeOrdered = 0;
         fDebitCached = false;
         fCreditCached = false;
         fAvailableCreditCached = false;
@@ -614,4 +736,9 @@ public:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+// Picks coins from vCoins (value, coin) adding up to at least nTargetValue.
+// Used by CWallet::SelectCoinsMinConf once it has the eligible coins.
+bool SelectCoinsFromValues(const std::vector<std::pair<int64, std::pair<const CWalletTx*,unsigned int> > >& vCoins, int64 nTargetValue,
+                           std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet);
+
 #endif